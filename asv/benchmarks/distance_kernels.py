@@ -0,0 +1,66 @@
+# Micro-benchmarks of the lane wise distance kernels of the C extension.
+# Every kernel is timed with each instruction set the machine supports;
+# 'scalar' is the plain C implementation the vector ones are compared to.
+
+import os
+from ctypes import CDLL, c_double, c_int64, c_void_p
+
+import numpy as np
+
+from tardis import __path__ as path
+
+montecarlo = CDLL(os.path.join(path[0], 'montecarlo', 'montecarlo.so'))
+
+ISAS = {'scalar': 0, 'avx2': 1, 'avx512': 2}
+NO_OF_LANES = 1000000
+NO_OF_SHELLS = 20
+TIME_EXPLOSION = 5.2e7
+
+
+def pointer(array):
+    return array.ctypes.data_as(c_void_p)
+
+
+class TimeDistanceKernels:
+    params = sorted(ISAS)
+    param_names = ['isa']
+
+    def setup(self, isa):
+        if not montecarlo.distance_kernels_supported(ISAS[isa]):
+            raise NotImplementedError('{0} is not supported'.format(isa))
+        montecarlo.distance_kernels_select(ISAS[isa])
+        rs = np.random.RandomState(23111963)
+        self.r_inner = np.linspace(6.912e14, 1.0368e15, NO_OF_SHELLS)
+        self.r_outer = np.append(self.r_inner[1:], 1.2e15)
+        self.shell_id = rs.randint(0, NO_OF_SHELLS, NO_OF_LANES).astype(np.int64)
+        self.r = self.r_inner[self.shell_id] + rs.random_sample(NO_OF_LANES) * (
+            self.r_outer[self.shell_id] - self.r_inner[self.shell_id])
+        self.mu = 2 * rs.random_sample(NO_OF_LANES) - 1
+        self.recently_crossed_boundary = rs.randint(-1, 2, NO_OF_LANES).astype(np.int64)
+        self.nu = 1e15 * (1 + rs.random_sample(NO_OF_LANES))
+        self.nu_line = 0.99 * self.nu
+        self.last_line = (rs.random_sample(NO_OF_LANES) < 0.01).astype(np.int64)
+        self.result = np.empty(NO_OF_LANES)
+        self.next_shell_id = np.empty(NO_OF_LANES, dtype=np.int64)
+
+    def teardown(self, isa):
+        montecarlo.distance_kernels_select(ISAS['scalar'])
+
+    def time_doppler_factor_lanes(self, isa):
+        montecarlo.doppler_factor_lanes(
+            c_int64(NO_OF_LANES), pointer(self.r), pointer(self.mu),
+            c_double(1 / TIME_EXPLOSION), pointer(self.result))
+
+    def time_distance2boundary_lanes(self, isa):
+        montecarlo.distance2boundary_lanes(
+            c_int64(NO_OF_LANES), pointer(self.r), pointer(self.mu),
+            pointer(self.shell_id), pointer(self.recently_crossed_boundary),
+            pointer(self.r_inner), pointer(self.r_outer), pointer(self.result),
+            pointer(self.next_shell_id))
+
+    def time_distance2line_lanes(self, isa):
+        montecarlo.distance2line_lanes(
+            c_int64(NO_OF_LANES), pointer(self.r), pointer(self.mu),
+            pointer(self.nu), pointer(self.nu_line), pointer(self.last_line),
+            c_double(TIME_EXPLOSION), c_double(1 / TIME_EXPLOSION),
+            pointer(self.result))
@@ -0,0 +1,101 @@
+# Cost of the packet loop of the C extension per event. A synthetic model
+# (power law electron densities, random tau_sobolevs) is propagated in
+# scatter mode; the number of events only depends on the seed, so the run
+# time compares the per event cost of two builds. Extensions built with
+# instrumentation (setup.py build --with-instrumentation) also report it
+# directly in ns per event.
+
+import time
+
+import numpy as np
+from astropy import units as u
+
+from tardis.montecarlo import montecarlo
+from tardis.montecarlo.base import MontecarloRunner
+
+NO_OF_PACKETS = 50000
+NO_OF_LINES = 2000
+NO_OF_SHELLS = 20
+TIME_EXPLOSION = 13 * 86400.0
+SEED = 23111963
+
+
+class Namespace(object):
+    def __init__(self, **kwargs):
+        self.__dict__.update(kwargs)
+
+
+def synthetic_model():
+    rs = np.random.RandomState(SEED)
+    v_inner = 1.1e9 + np.arange(NO_OF_SHELLS) * (1e9 / NO_OF_SHELLS)
+    structure = Namespace(
+        no_of_shells=NO_OF_SHELLS,
+        volumes=np.ones(NO_OF_SHELLS) * u.cm ** 3,
+        r_inner=v_inner * TIME_EXPLOSION * u.cm,
+        r_outer=(v_inner + 1e9 / NO_OF_SHELLS) * TIME_EXPLOSION * u.cm,
+        v_inner=v_inner * u.cm / u.s)
+    tau_sobolevs = 10 ** (-6 + 9 * rs.random_sample((NO_OF_LINES, NO_OF_SHELLS)))
+    montecarlo_config = Namespace(
+        seed=SEED, nthreads=1, thread_private_estimators=False,
+        packet_batch_size=0, compact_storage=False,
+        sparse_j_blue_estimators=False, schedule='static',
+        schedule_chunk_size=0, packet_source='python', rng='mt',
+        packet_block_size=0, packet_tracking_stride=1, line_skipping=False,
+        line_culling_threshold=0.0,
+        virtual_spectrum_range=Namespace(
+            start=50 * u.angstrom, end=250000 * u.angstrom),
+        sigma_thomson=6.652486e-25 / u.cm ** 2,
+        enable_reflective_inner_boundary=False, inner_boundary_albedo=0.0)
+    tardis_config = Namespace(
+        structure=structure, montecarlo=montecarlo_config,
+        supernova=Namespace(time_explosion=TIME_EXPLOSION * u.s,
+                            luminosity_nu_start=0 * u.Hz,
+                            luminosity_nu_end=np.inf * u.Hz),
+        spectrum=Namespace(
+            frequency=np.linspace(1e14, 6e15, 10001) * u.Hz),
+        plasma=Namespace(line_interaction_type='scatter'))
+    packet_src = Namespace(
+        nu_start=2e14, nu_end=3e15,
+        packet_nus=2e14 + 2.8e15 * rs.random_sample(NO_OF_PACKETS),
+        packet_mus=np.sqrt(rs.random_sample(NO_OF_PACKETS)),
+        packet_energies=np.ones(NO_OF_PACKETS) / NO_OF_PACKETS)
+    plasma_array = Namespace(
+        electron_densities=Namespace(
+            values=3e9 * (v_inner[0] / v_inner) ** 7),
+        tau_sobolevs=Namespace(values=np.asfortranarray(tau_sobolevs)),
+        t_electrons=np.ones(NO_OF_SHELLS) * 1e4)
+    lines = Namespace(nu=Namespace(
+        values=3e15 * 0.1 ** (np.arange(NO_OF_LINES) / float(NO_OF_LINES))))
+    return Namespace(
+        tardis_config=tardis_config, packet_src=packet_src,
+        plasma_array=plasma_array, atom_data=Namespace(lines=lines),
+        j_blue_estimators=np.zeros((NO_OF_SHELLS, NO_OF_LINES)),
+        montecarlo_virtual_luminosity=np.zeros(10000),
+        time_of_simulation=1.0, current_no_of_packets=NO_OF_PACKETS,
+        t_inner=10000 * u.K, iterations_executed=0)
+
+
+class TimePacketLoop:
+    def setup(self):
+        self.model = synthetic_model()
+        self.runner = MontecarloRunner()
+
+    def time_packet_loop(self):
+        self.model.j_blue_estimators.fill(0)
+        self.runner.run(self.model, 0)
+
+
+class TrackPacketLoop:
+    unit = 'ns per event'
+
+    def setup(self):
+        if not montecarlo.INSTRUMENTED:
+            raise NotImplementedError('the extension is not instrumented')
+        self.model = synthetic_model()
+        self.runner = MontecarloRunner()
+
+    def track_time_per_event(self):
+        start = time.time()
+        self.runner.run(self.model, 0)
+        run_time = time.time() - start
+        return 1e9 * run_time / self.runner.thread_counters['events'].sum()
@@ -0,0 +1,55 @@
+# Convergence of the packet sources of the C extension. The packets are
+# histogrammed into a spectrum, and its noise is the relative root mean
+# square deviation from the black body, averaged over several seeds.
+# Random (native) sources converge as N^-1/2, Sobol points faster.
+
+import numpy as np
+
+from tardis.montecarlo import montecarlo
+
+TEMPERATURE = 10000.0
+NU_START = 1e14
+NU_END = 3e15
+NO_OF_BINS = 100
+SEEDS = [23111963, 250819801106, 1963, 42]
+
+
+def blackbody_bin_fractions():
+    nu = np.linspace(NU_START, NU_END, NO_OF_BINS * 1000 + 1)
+    x = 6.6260755e-27 * nu / (1.3806488e-16 * TEMPERATURE)
+    intensity = nu ** 3 / np.expm1(x)
+    cdf = np.concatenate(
+        ([0], np.cumsum(0.5 * (intensity[1:] + intensity[:-1]))))
+    fractions = np.diff(cdf[::1000])
+    return fractions / fractions.sum()
+
+
+class TrackPacketSourceConvergence:
+    params = [['native', 'sobol'], [10000, 100000, 1000000]]
+    param_names = ['packet_source', 'no_of_packets']
+    unit = 'relative rms'
+
+    def setup(self, packet_source, no_of_packets):
+        self.expected = blackbody_bin_fractions()
+
+    def track_spectrum_noise(self, packet_source, no_of_packets):
+        noise = []
+        for seed in SEEDS:
+            packet_nus, packet_mus, packet_energies = montecarlo.create_packets(
+                packet_source, no_of_packets, TEMPERATURE, NU_START, NU_END,
+                seed)
+            spectrum, _ = np.histogram(
+                packet_nus, bins=NO_OF_BINS, range=(NU_START, NU_END),
+                weights=packet_energies)
+            noise.append(np.sqrt(np.mean(
+                (spectrum / self.expected - 1) ** 2)))
+        return np.mean(noise)
+
+
+class TimePacketSource:
+    params = [['native', 'sobol']]
+    param_names = ['packet_source']
+
+    def time_create_packets(self, packet_source):
+        montecarlo.create_packets(packet_source, 1000000, TEMPERATURE,
+                                  NU_START, NU_END, SEEDS[0])
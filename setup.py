@@ -62,6 +62,15 @@ add_command_option('build', 'with-openmp', 'compile TARDIS without OpenMP',
                    is_bool=True)
 add_command_option('develop', 'with-openmp', 'compile TARDIS without OpenMP',
                    is_bool=True)
+add_command_option('install', 'with-instrumentation',
+                   'compile TARDIS with Monte Carlo event counters',
+                   is_bool=True)
+add_command_option('build', 'with-instrumentation',
+                   'compile TARDIS with Monte Carlo event counters',
+                   is_bool=True)
+add_command_option('develop', 'with-instrumentation',
+                   'compile TARDIS with Monte Carlo event counters',
+                   is_bool=True)
 
 # Adjust the compiler in case the default on this platform is to use a
 # broken one.
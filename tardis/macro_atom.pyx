@@ -71,3 +71,84 @@ def normalize_transition_probabilities(double [:, :] p_transition,
                     continue
 
                 p_transition[j,k] /= norm_factor[k]
+
+def build_alias_tables(double [:, :] p_transition,
+                       int_type_t [:] reference_levels):
+    """
+    Build Walker/Vose alias tables of the normalized transition probabilities
+    of every macro atom level in every shell.
+
+    Transition j of a block with n transitions is drawn from one uniform
+    random number u by x = n * u and j = start + int(x); if
+    x - int(x) >= alias_probabilities[j] the transition alias_indices[j] is
+    taken instead.
+
+    Parameters
+    ----------
+    p_transition : 2D array [transition, shell]
+        normalized transition probabilities
+    reference_levels : 1D array
+        start of the block of every level, followed by the number of
+        transitions
+
+    Returns
+    -------
+    alias_probabilities : 2D array [transition, shell]
+    alias_indices : 2D array [transition, shell]
+    """
+    cdef int i, j, k, n, start_id, end_id, small_id, large_id, last_large_id
+    cdef int no_of_small, no_of_large
+    cdef int no_of_transitions = p_transition.shape[0]
+    cdef np.ndarray[double, ndim=2] alias_probabilities = np.ones(
+        (p_transition.shape[0], p_transition.shape[1]), order='F')
+    cdef np.ndarray[int_type_t, ndim=2] alias_indices = np.empty(
+        (p_transition.shape[0], p_transition.shape[1]), dtype=np.int64,
+        order='F')
+    cdef np.ndarray[double, ndim=1] scaled = np.zeros(no_of_transitions)
+    cdef np.ndarray[int_type_t, ndim=1] small = np.zeros(no_of_transitions,
+                                                         dtype=np.int64)
+    cdef np.ndarray[int_type_t, ndim=1] large = np.zeros(no_of_transitions,
+                                                         dtype=np.int64)
+
+    for i in range(len(reference_levels) - 1):
+        start_id = reference_levels[i]
+        end_id = reference_levels[i + 1]
+        n = end_id - start_id
+        for k in range(0, p_transition.shape[1]):
+            no_of_small = 0
+            no_of_large = 0
+            last_large_id = start_id
+            for j in range(start_id, end_id):
+                alias_indices[j, k] = j
+                scaled[j] = p_transition[j, k] * n
+                if scaled[j] < 1.0:
+                    small[no_of_small] = j
+                    no_of_small += 1
+                else:
+                    large[no_of_large] = j
+                    no_of_large += 1
+            while no_of_small > 0 and no_of_large > 0:
+                no_of_small -= 1
+                small_id = small[no_of_small]
+                large_id = large[no_of_large - 1]
+                last_large_id = large_id
+                alias_probabilities[small_id, k] = scaled[small_id]
+                alias_indices[small_id, k] = large_id
+                scaled[large_id] = (scaled[large_id] + scaled[small_id]) - 1.0
+                if scaled[large_id] < 1.0:
+                    no_of_large -= 1
+                    small[no_of_small] = large_id
+                    no_of_small += 1
+            # What is left over only differs from 1 by rounding, except for
+            # transitions that are impossible and must never be drawn.
+            while no_of_small > 0:
+                no_of_small -= 1
+                small_id = small[no_of_small]
+                if scaled[small_id] == 0.0 and p_transition[last_large_id, k] > 0.0:
+                    alias_probabilities[small_id, k] = 0.0
+                    alias_indices[small_id, k] = last_large_id
+            while no_of_large > 0:
+                no_of_large -= 1
+                alias_probabilities[large[no_of_large], k] = 1.0
+
+    return alias_probabilities, alias_indices
@@ -8,6 +8,7 @@ import numpy as np
 import pandas as pd
 from astropy import constants, units as u
 import scipy.special
+import scipy.sparse
 
 from util import intensity_black_body
 from tardis import packet_source
@@ -71,6 +72,11 @@ class Radial1DModel(object):
 
     """
 
+    # Properties written by to_hdf5 that are fixed once the Monte Carlo
+    # transport of an iteration has started.
+    transport_input_hdf5_properties = ['plasma_array', 'j_blues',
+                                       'configuration_dict']
+
     @classmethod
     def from_h5(cls, buffer_or_fname):
         raise NotImplementedError("This is currently not implemented")
@@ -188,12 +194,31 @@ class Radial1DModel(object):
         elif radiative_rates_type == 'detailed':
             logger.info('Calculating J_blues for radiate_rates_type=detailed')
 
-            self.j_blues = pd.DataFrame(self.j_blue_estimators.transpose() * self.j_blues_norm_factor.value,
-                                        index=self.atom_data.lines.index, columns=np.arange(len(self.t_rads)))
-            for i in xrange(self.tardis_config.structure.no_of_shells):
-                zero_j_blues = self.j_blues[i] == 0.0
-                self.j_blues[i][zero_j_blues] = w_epsilon * intensity_black_body(
-                    self.atom_data.lines.nu.values[zero_j_blues], self.t_rads.value[i])
+            if scipy.sparse.issparse(self.j_blue_estimators):
+                # Lines that were not hit get the dilute black body, the
+                # entries of the sparse estimator are all non zero.
+                j_blue_estimators = self.j_blue_estimators.tocoo()
+                j_blues = w_epsilon * intensity_black_body(
+                    nus[np.newaxis].T, self.t_rads.value)
+                j_blues[j_blue_estimators.col, j_blue_estimators.row] = (
+                    j_blue_estimators.data *
+                    self.j_blues_norm_factor.value[j_blue_estimators.row])
+                self.j_blues = pd.DataFrame(j_blues, index=self.atom_data.lines.index,
+                                            columns=np.arange(len(self.t_rads)))
+            else:
+                self.j_blues = pd.DataFrame(self.j_blue_estimators.transpose() * self.j_blues_norm_factor.value,
+                                            index=self.atom_data.lines.index, columns=np.arange(len(self.t_rads)))
+                for i in xrange(self.tardis_config.structure.no_of_shells):
+                    zero_j_blues = self.j_blues[i] == 0.0
+                    self.j_blues[i][zero_j_blues] = w_epsilon * intensity_black_body(
+                        self.atom_data.lines.nu.values[zero_j_blues], self.t_rads.value[i])
+
+            culled_line_ids = self.runner.culled_line_ids
+            if culled_line_ids is not None:
+                # Lines culled as optically thin do not change the radiation
+                # field, they see the dilute black body.
+                self.j_blues.iloc[culled_line_ids] = self.ws * intensity_black_body(
+                    nus[culled_line_ids][np.newaxis].T, self.t_rads.value)
 
         else:
             raise ValueError('radiative_rates_type type unknown - %s', radiative_rates_type)
@@ -205,6 +230,10 @@ class Radial1DModel(object):
 
         if self.tardis_config.plasma.line_interaction_type in ('downbranch', 'macroatom'):
             self.transition_probabilities = self.plasma_array.transition_probabilities
+            self.transition_alias_probabilities = \
+                self.plasma_array.transition_alias_probabilities
+            self.transition_alias_indices = \
+                self.plasma_array.transition_alias_indices
 
 
     def update_radiationfield(self, log_sampling=5):
@@ -217,14 +246,8 @@ class Radial1DModel(object):
         old_t_rads = self.t_rads.copy()
         old_ws = self.ws.copy()
         old_t_inner = self.t_inner
-        luminosity_wavelength_filter = (self.montecarlo_nu > self.tardis_config.supernova.luminosity_nu_start) & \
-                            (self.montecarlo_nu < self.tardis_config.supernova.luminosity_nu_end)
-        emitted_filter = self.montecarlo_luminosity.value >= 0
-        emitted_luminosity = np.sum(self.montecarlo_luminosity.value[emitted_filter & luminosity_wavelength_filter]) \
-                             * self.montecarlo_luminosity.unit
-
-        absorbed_luminosity = -np.sum(self.montecarlo_luminosity.value[~emitted_filter & luminosity_wavelength_filter]) \
-                              * self.montecarlo_luminosity.unit
+        emitted_luminosity = self.runner.emitted_luminosity
+        absorbed_luminosity = self.runner.reabsorbed_luminosity
         updated_t_inner = self.t_inner \
                           * (emitted_luminosity / self.tardis_config.supernova.luminosity_requested).to(1).value \
                             ** convergence_section.t_inner_update_exponent
@@ -287,9 +310,16 @@ class Radial1DModel(object):
 
 
     def simulate(self, update_radiation_field=True, enable_virtual=False, initialize_j_blues=False,
-                 initialize_nlte=False):
+                 initialize_nlte=False, while_running=None):
         """
         Run a simulation
+
+        Parameters
+        ----------
+
+        while_running : callable, optional
+            called without arguments while the Monte Carlo transport runs,
+            it must not modify the model
         """
 
         if update_radiation_field:
@@ -303,7 +333,8 @@ class Radial1DModel(object):
 
         self.t_inner = t_inner_new
 
-        self.packet_src.create_packets(self.current_no_of_packets, self.t_inner.value)
+        if self.tardis_config.montecarlo.packet_source == 'python':
+            self.packet_src.create_packets(self.current_no_of_packets, self.t_inner.value)
 
         if enable_virtual:
             no_of_virtual_packets = self.tardis_config.montecarlo.no_of_virtual_packets
@@ -313,19 +344,42 @@ class Radial1DModel(object):
             or np.any(np.isneginf(self.plasma_array.tau_sobolevs.values)):
             raise ValueError('Some tau_sobolevs are nan, inf, -inf in tau_sobolevs. Something went wrong!')
 
-        self.j_blue_estimators = np.zeros((len(self.t_rads), len(self.atom_data.lines)))
+        if self.tardis_config.montecarlo.sparse_j_blue_estimators:
+            # The runner returns the estimator as a sparse matrix.
+            self.j_blue_estimators = None
+        else:
+            if self.tardis_config.montecarlo.compact_storage:
+                j_blue_estimator_dtype = np.float32
+            else:
+                j_blue_estimator_dtype = np.float64
+            self.j_blue_estimators = np.zeros(
+                (len(self.t_rads), len(self.atom_data.lines)),
+                dtype=j_blue_estimator_dtype)
         self.montecarlo_virtual_luminosity = np.zeros_like(self.spectrum.frequency.value)
 
-        self.runner.run(self, no_of_virtual_packets=no_of_virtual_packets,
-                        nthreads=self.tardis_config.montecarlo.nthreads) #self = model
+        self.runner.start(self, no_of_virtual_packets=no_of_virtual_packets,
+                          nthreads=self.tardis_config.montecarlo.nthreads) #self = model
+        try:
+            if while_running is not None:
+                while_running()
+        finally:
+            self.runner.wait()
 
 
         (montecarlo_nu, montecarlo_energies, self.j_estimators,
          self.nubar_estimators, last_line_interaction_in_id,
          last_line_interaction_out_id, self.last_interaction_type,
          self.last_line_interaction_shell_id) = self.runner.legacy_return()
-
-        if np.sum(montecarlo_energies < 0) == len(montecarlo_energies):
+        self.j_blue_estimators = self.runner.j_blue_estimator
+        logger.debug('Thread busy times of the Monte Carlo run: %s s '
+                     '(load imbalance %.3f)', self.runner.thread_busy_times,
+                     self.runner.thread_load_imbalance)
+        if self.runner.thread_counters is not None:
+            logger.info('Monte Carlo events of iteration %d:\n%s',
+                        self.iterations_executed + 1,
+                        self.runner.format_event_counters())
+
+        if self.runner.no_of_emitted_packets == 0:
             logger.critical("No r-packet escaped through the outer boundary.")
 
         self.montecarlo_nu = self.runner.packet_nu
@@ -333,17 +387,8 @@ class Radial1DModel(object):
 
 
 
-        montecarlo_reabsorbed_luminosity = np.histogram(
-            self.runner.reabsorbed_packet_nu,
-            weights=self.runner.reabsorbed_packet_luminosity,
-            bins=self.tardis_config.spectrum.frequency.value)[0] * u.erg / u.s
-
-
-
-        montecarlo_emitted_luminosity = np.histogram(
-            self.runner.emitted_packet_nu,
-            weights=self.runner.emitted_packet_luminosity,
-            bins=self.tardis_config.spectrum.frequency.value)[0] * u.erg / u.s
+        montecarlo_reabsorbed_luminosity = self.runner.reabsorbed_spectrum_luminosity.to(u.erg / u.s)
+        montecarlo_emitted_luminosity = self.runner.emitted_spectrum_luminosity.to(u.erg / u.s)
 
 
 
@@ -380,7 +425,8 @@ class Radial1DModel(object):
         self.spectrum_virtual.to_ascii('virtual_' + fname)
 
 
-    def to_hdf5(self, buffer_or_fname, path='', close_h5=True):
+    def to_hdf5(self, buffer_or_fname, path='', close_h5=True, properties=None,
+                exclude_properties=()):
         """
             This allows the model to be written to an HDF5 file for later analysis. Currently, the saved properties
             are specified hard coded in include_from_model_in_hdf5. This is a dict where the key corresponds to the
@@ -400,6 +446,12 @@ class Radial1DModel(object):
             path in the HDF5 file
         close_h5: ~bool
             close the HDF5 file or not.
+        properties: ~list of ~str, optional
+            names of the properties to write, all if None. The properties in
+            transport_input_hdf5_properties do not change during the
+            Monte Carlo transport.
+        exclude_properties: ~list of ~str, optional
+            names of the properties not to write
         """
 
 
@@ -462,6 +514,9 @@ class Radial1DModel(object):
 
 
         for key in include_from_model_in_hdf5:
+            if ((properties is not None and key not in properties) or
+                    key in exclude_properties):
+                continue
             if include_from_model_in_hdf5[key] is None:
                 _save_model_property(getattr(self, key), key, path, hdf_store)
             elif callable(include_from_model_in_hdf5[key]):
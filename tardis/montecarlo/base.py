@@ -1,3 +1,6 @@
+import sys
+import threading
+
 from astropy import units as u, constants as const
 
 from scipy.special import zeta
@@ -20,13 +23,105 @@ class MontecarloRunner(object):
                                 (const.h / const.k_B)).cgs.value
 
 
+    _run_thread = None
+    # Event counters of every thread in the last run, a structured array of
+    # montecarlo.INSTRUMENTATION_COUNTERS_DTYPE. None unless the extension
+    # was built with instrumentation (setup.py build --with-instrumentation).
+    thread_counters = None
+    # Indices of the lines that were culled from the line list of the last
+    # run (montecarlo.line_culling_threshold), None if all lines were used.
+    culled_line_ids = None
+
+    def __init__(self):
+        self._buffers = {}
+        # Storage of the geometry, atomic data and settings of the model
+        # it was built for, see montecarlo.StaticStorage
+        self.static_storage = None
+
+    def get_buffer(self, name, size, dtype):
+        """
+        Return a persistent array for the C extension. It is only
+        reallocated if size or dtype change, otherwise the array of the
+        previous run is returned with its old content. Arrays the runner
+        exposes from such buffers are overwritten by the next run.
+
+        Parameters
+        ----------
+
+        name : ~str
+        size : ~int
+        dtype : ~numpy.dtype
+
+        Returns
+        -------
+
+        buffer : ~numpy.ndarray
+        """
+        buffer = self._buffers.get(name)
+        if (buffer is None or buffer.shape != (size,) or
+                buffer.dtype != np.dtype(dtype)):
+            buffer = np.empty(size, dtype=dtype)
+            self._buffers[name] = buffer
+        return buffer
+
     def run(self, model, no_of_virtual_packets, nthreads=1):
+        self.start(model, no_of_virtual_packets, nthreads=nthreads)
+        self.wait()
+
+    def start(self, model, no_of_virtual_packets, nthreads=1):
+        """
+        Start the Monte Carlo transport in a background thread and return
+        immediately. The transport releases the GIL, so the caller can do
+        other work until `wait`. The model must not be modified before
+        `wait` returns.
+
+        Parameters
+        ----------
+
+        model : ~tardis.model.Radial1DModel
+        no_of_virtual_packets : ~int
+        nthreads : ~int
+        """
+        if self._run_thread is not None:
+            raise RuntimeError('The Monte Carlo transport is already running')
         self.time_of_simulation = model.time_of_simulation
         self.volume = model.tardis_config.structure.volumes
+        self._run_exception = None
+        self._run_thread = threading.Thread(
+            target=self._run_transport,
+            args=(model, no_of_virtual_packets, nthreads))
+        self._run_thread.start()
+
+    def _run_transport(self, model, no_of_virtual_packets, nthreads):
+        try:
+            montecarlo.montecarlo_radial1d(
+                model, self, virtual_packet_flag=no_of_virtual_packets,
+                nthreads=nthreads)
+        except Exception:
+            self._run_exception = sys.exc_info()[1]
+
+    def poll(self):
+        """
+        Check whether the transport started with `start` has finished.
+
+        Returns
+        -------
+
+        finished : ~bool
+        """
+        return self._run_thread is None or not self._run_thread.is_alive()
 
-        montecarlo.montecarlo_radial1d(
-            model, self, virtual_packet_flag=no_of_virtual_packets,
-            nthreads=nthreads)
+    def wait(self):
+        """
+        Wait for the transport started with `start` to finish. Exceptions of
+        the transport are raised here.
+        """
+        if self._run_thread is None:
+            return
+        self._run_thread.join()
+        self._run_thread = None
+        if self._run_exception is not None:
+            raise self._run_exception
 
     def legacy_return(self):
         return (self.packet_nu, self.packet_energy,
@@ -73,6 +168,97 @@ class MontecarloRunner(object):
     def reabsorbed_packet_luminosity(self):
         return -self.packet_luminosity[~self.emitted_packet_mask]
 
+    @property
+    def emitted_spectrum_luminosity(self):
+        """
+        Luminosity of the emitted packets in the bins of the spectrum, as
+        binned by the threads of the Monte Carlo loop.
+        """
+        return (u.Quantity(self._spectrum_emitted_energy, u.erg) /
+                self.time_of_simulation)
+
+    @property
+    def reabsorbed_spectrum_luminosity(self):
+        return (u.Quantity(self._spectrum_reabsorbed_energy, u.erg) /
+                self.time_of_simulation)
+
+    @property
+    def emitted_luminosity(self):
+        """
+        Luminosity of the emitted packets between luminosity_nu_start and
+        luminosity_nu_end.
+        """
+        return (u.Quantity(self._luminosity_emitted_energy, u.erg) /
+                self.time_of_simulation)
+
+    @property
+    def reabsorbed_luminosity(self):
+        return (u.Quantity(self._luminosity_reabsorbed_energy, u.erg) /
+                self.time_of_simulation)
+
+    @property
+    def thread_load_imbalance(self):
+        """
+        Ratio of the longest to the mean busy time of the threads that
+        propagated packets in the last run, 1 for a perfectly balanced run.
+        """
+        busy_times = self.thread_busy_times[self.thread_packet_counts > 0]
+        if len(busy_times) == 0 or busy_times.mean() == 0:
+            return 1.0
+        return busy_times.max() / busy_times.mean()
+
+    @property
+    def event_counts(self):
+        """
+        Number of events of the real packets per event type in the last run,
+        summed over all threads. Only available with instrumentation.
+        """
+        events = self.thread_counters['events'].sum(axis=0)
+        return dict(zip(montecarlo.INSTRUMENTATION_EVENTS, events))
+
+    @property
+    def event_tick_fractions(self):
+        """
+        Fraction of the ticks spent in the event handlers per event type.
+        Only available with instrumentation.
+        """
+        ticks = self.thread_counters['event_ticks'].sum(axis=0).astype(float)
+        return dict(zip(montecarlo.INSTRUMENTATION_EVENTS,
+                        ticks / max(ticks.sum(), 1)))
+
+    @property
+    def events_per_packet(self):
+        """
+        Mean number of events of a real packet in the last run. Only available
+        with instrumentation.
+        """
+        no_of_packets = self.thread_counters['packets'].sum()
+        if no_of_packets == 0:
+            return 0.0
+        return self.thread_counters['events'].sum() / float(no_of_packets)
+
+    def format_event_counters(self):
+        """
+        Summarize the event counters of the last run for the log.
+
+        Returns
+        -------
+
+        summary : ~str
+        """
+        counts = self.event_counts
+        tick_fractions = self.event_tick_fractions
+        lines = ['{0:d} packets, {1:.2f} events per packet, '
+                 '{2:d} macro atom jumps, {3:d} virtual packets'.format(
+                     int(self.thread_counters['packets'].sum()),
+                     self.events_per_packet,
+                     int(self.thread_counters['macro_atom_jumps'].sum()),
+                     int(self.thread_counters['virtual_packets'].sum()))]
+        for name in montecarlo.INSTRUMENTATION_EVENTS:
+            lines.append('{0:>18s}: {1:12d} events {2:6.1%} of the ticks'.format(
+                name, int(counts[name]), tick_fractions[name]))
+        return '\n'.join(lines)
+
     def calculate_radiationfield_properties(self):
         """
         Calculate an updated radiation field from the :math:`\\bar{nu}_\\textrm{estimator}` and :math:`\\J_\\textrm{estimator}`
@@ -8,10 +8,12 @@ import logging
 import time
 
 import numpy as np
+from scipy import sparse
 cimport numpy as np
 from astropy import constants
 from astropy import units
 from libc.stdlib cimport free
+from libc.string cimport memset
 
 np.import_array()
 
@@ -22,6 +24,41 @@ cdef extern from "src/cmontecarlo.h":
         CONTINUUM_OFF = 0
         CONTINUUM_ON = 1
 
+    ctypedef enum packet_schedule_t:
+        PACKET_SCHEDULE_STATIC = 0
+        PACKET_SCHEDULE_DYNAMIC = 1
+        PACKET_SCHEDULE_GUIDED = 2
+
+    ctypedef enum rng_backend_t:
+        RNG_BACKEND_MT = 0
+        RNG_BACKEND_XOSHIRO = 1
+
+    ctypedef enum packet_source_t:
+        PACKET_SOURCE_ARRAYS = 0
+        PACKET_SOURCE_BLACKBODY = 1
+        PACKET_SOURCE_SOBOL = 2
+
+    ctypedef enum instrumentation_event_t:
+        INSTRUMENTATION_NO_OF_EVENTS = 5
+
+    ctypedef struct instrumentation_counters_t:
+        pass
+
+    ctypedef struct frequency_index_t:
+        int_type_t *first_below
+        int_type_t no_of_bins
+        double log_nu_min
+        double inverse_bin_width
+
+    ctypedef struct macro_atom_transition_t:
+        double alias_probability
+        np.int32_t transition_type
+        np.int32_t destination_level_id
+        np.int32_t transition_line_id
+        np.int32_t alias_transition_type
+        np.int32_t alias_destination_level_id
+        np.int32_t alias_transition_line_id
+
     ctypedef struct storage_model_t:
         double *packet_nus
         double *packet_mus
@@ -34,6 +71,13 @@ cdef extern from "src/cmontecarlo.h":
         int_type_t *last_line_interaction_shell_id
         int_type_t *last_interaction_type
         int_type_t no_of_packets
+        int_type_t packet_block_size
+        int_type_t packet_tracking_stride
+        packet_source_t packet_source
+        double packet_source_temperature
+        double packet_source_nu_start
+        double packet_source_nu_end
+        unsigned long packet_source_seed
         int_type_t no_of_shells
         double *r_inner
         double *r_outer
@@ -44,17 +88,24 @@ cdef extern from "src/cmontecarlo.h":
         double *inverse_electron_densities
         double *line_list_nu
         double *line_lists_tau_sobolevs
+        float *line_lists_tau_sobolevs_compact
         double *continuum_list_nu
         int_type_t line_lists_tau_sobolevs_nd
+        double *line_lists_tau_cumulative
         double *line_lists_j_blues
+        float *line_lists_j_blues_compact
         int_type_t line_lists_j_blues_nd
         int_type_t no_of_lines
+        int_type_t *line_list_full_ids
+        double *line_list_full_nu
+        int_type_t *line_list_full_next
         int_type_t no_of_edges
         int_type_t line_interaction_id
         double *transition_probabilities
         int_type_t transition_probabilities_nd
         int_type_t *line2macro_level_upper
         int_type_t *macro_block_references
+        macro_atom_transition_t *macro_atom_transitions
         int_type_t *transition_type
         int_type_t *destination_level_id
         int_type_t *transition_line_id
@@ -66,6 +117,15 @@ cdef extern from "src/cmontecarlo.h":
         double spectrum_delta_nu
         double spectrum_end_nu
         double *spectrum_virt_nu
+        int_type_t spectrum_virt_nu_size
+        double *spectrum_emitted_nu
+        double *spectrum_reabsorbed_nu
+        int_type_t spectrum_nu_size
+        double luminosity_nu_start
+        double luminosity_nu_end
+        double luminosity_emitted_energy
+        double luminosity_reabsorbed_energy
+        int_type_t no_of_emitted_packets
         double sigma_thomson
         double inverse_sigma_thomson
         double inner_boundary_albedo
@@ -83,8 +143,287 @@ cdef extern from "src/cmontecarlo.h":
         int_type_t *virt_last_line_interaction_out_id
         int_type_t virt_packet_count
         int_type_t virt_array_size
+        int_type_t thread_private_estimators
+        double **line_lists_j_blues_blocks
+        int_type_t packet_batch_size
+        rng_backend_t rng_backend
+        packet_schedule_t packet_schedule
+        int_type_t packet_schedule_chunk_size
+        double *thread_busy_times
+        int_type_t *thread_packet_counts
+        instrumentation_counters_t *thread_counters
+        int_type_t sparse_j_blue_estimators
+        int_type_t *line_lists_j_blues_sparse_indices
+        double *line_lists_j_blues_sparse_values
+        int_type_t line_lists_j_blues_sparse_count
+        frequency_index_t line_list_nu_index
+        frequency_index_t continuum_list_nu_index
+
+    void montecarlo_main_loop(storage_model_t * storage, int_type_t virtual_packet_flag, int nthreads, unsigned long seed) nogil
+    void frequency_index_init(frequency_index_t * index, double *nu, int_type_t number_of_lines)
+    void frequency_index_free(frequency_index_t * index)
+    void packet_source_init(storage_model_t *storage)
+    void packet_source_free(storage_model_t *storage)
+    void packet_source_create_packets(storage_model_t *storage, int_type_t first_packet, int_type_t last_packet)
+    int_type_t instrumentation_enabled()
+
+PACKET_SOURCES = {'python': PACKET_SOURCE_ARRAYS,
+                  'native': PACKET_SOURCE_BLACKBODY,
+                  'sobol': PACKET_SOURCE_SOBOL}
+
+cdef class CMemory:
+    """
+    Owner of memory allocated by the C code, frees it when the arrays
+    that use it as their base are gone.
+    """
+    cdef void *data
+
+    def __dealloc__(self):
+        free(self.data)
+
+
+cdef np.ndarray c_array_to_numpy(void *data, np.npy_intp size, int typenum):
+    """
+    Wrap a malloc'ed C array in a numpy array that owns it.
+    """
+    cdef np.ndarray array = np.PyArray_SimpleNewFromData(1, &size, typenum, data)
+    cdef CMemory memory = CMemory.__new__(CMemory)
+    memory.data = data
+    np.set_array_base(array, memory)
+    return array
+
+
+MACRO_ATOM_TRANSITION_DTYPE = np.dtype([
+    ('alias_probability', np.float64),
+    ('transition_type', np.int32),
+    ('destination_level_id', np.int32),
+    ('transition_line_id', np.int32),
+    ('alias_transition_type', np.int32),
+    ('alias_destination_level_id', np.int32),
+    ('alias_transition_line_id', np.int32)], align=True)
+
+
+# Event types of instrumentation_event_t, in the order of the counters.
+INSTRUMENTATION_EVENTS = ['line_scatter', 'boundary_crossing',
+                          'thomson_scatter', 'bound_free', 'free_free']
+
+# Layout of instrumentation_counters_t, the event counters of a thread.
+INSTRUMENTATION_COUNTERS_DTYPE = np.dtype([
+    ('events', np.int64, INSTRUMENTATION_NO_OF_EVENTS),
+    ('event_ticks', np.uint64, INSTRUMENTATION_NO_OF_EVENTS),
+    ('macro_atom_jumps', np.int64),
+    ('virtual_packets', np.int64),
+    ('packets', np.int64)])
+
+INSTRUMENTED = bool(instrumentation_enabled())
+
+
+def pack_macro_atom_transitions(alias_probabilities, alias_indices,
+        transition_type, destination_level_id, transition_line_id):
+    """
+    Pack the macro atom transitions of all shells into records of
+    MACRO_ATOM_TRANSITION_DTYPE, which hold everything a macro atom jump
+    reads: the alias probability and the outcomes of the transition and
+    of its alias.
+
+    Parameters
+    ----------
+    alias_probabilities : ~numpy.ndarray
+        alias probabilities, one column per shell
+    alias_indices : ~numpy.ndarray
+        alias transition indices, one column per shell
+    transition_type : ~numpy.ndarray
+    destination_level_id : ~numpy.ndarray
+    transition_line_id : ~numpy.ndarray
+
+    Returns
+    -------
+    transitions : ~numpy.ndarray
+        records with shape (no_of_shells, no_of_transitions)
+    """
+    alias_indices = alias_indices.transpose()
+    transitions = np.empty(alias_indices.shape,
+                           dtype=MACRO_ATOM_TRANSITION_DTYPE)
+    transitions['alias_probability'] = alias_probabilities.transpose()
+    transitions['transition_type'] = transition_type
+    transitions['destination_level_id'] = destination_level_id
+    transitions['transition_line_id'] = transition_line_id
+    transitions['alias_transition_type'] = transition_type[alias_indices]
+    transitions['alias_destination_level_id'] = \
+        destination_level_id[alias_indices]
+    transitions['alias_transition_line_id'] = \
+        transition_line_id[alias_indices]
+    return transitions
+
+
+def create_packets(packet_source, int_type_t no_of_packets, double temperature,
+        double nu_start, double nu_end, unsigned long seed):
+    """
+    Create packets with the C packet source of the packet loop.
+
+    Parameters
+    ----------
+    packet_source : str
+        'native' or 'sobol', see montecarlo.packet_source
+    no_of_packets : int
+    temperature : float
+        temperature of the inner boundary in K
+    nu_start : float
+        lowest frequency in Hz
+    nu_end : float
+        highest frequency in Hz
+    seed : int
+
+    Returns
+    -------
+    packet_nus, packet_mus, packet_energies : ~numpy.ndarray
+    """
+    cdef storage_model_t storage
+    memset(&storage, 0, sizeof(storage_model_t))
+    storage.packet_source = PACKET_SOURCES[packet_source]
+    if storage.packet_source == PACKET_SOURCE_ARRAYS:
+        raise ValueError('packet_source has to be native or sobol')
+    storage.no_of_packets = no_of_packets
+    storage.packet_source_temperature = temperature
+    storage.packet_source_nu_start = nu_start
+    storage.packet_source_nu_end = nu_end
+    storage.packet_source_seed = seed
+    packet_source_init(&storage)
+    packet_source_create_packets(&storage, 0, no_of_packets)
+    # The numpy arrays take over the packet arrays.
+    packets = (c_array_to_numpy(storage.packet_nus, no_of_packets, np.NPY_FLOAT64),
+               c_array_to_numpy(storage.packet_mus, no_of_packets, np.NPY_FLOAT64),
+               c_array_to_numpy(storage.packet_energies, no_of_packets, np.NPY_FLOAT64))
+    storage.packet_nus = NULL
+    storage.packet_mus = NULL
+    storage.packet_energies = NULL
+    packet_source_free(&storage)
+    return packets
+
+
+cdef class StaticStorage:
+    """
+    The part of the storage model that is the same in every iteration of a
+    model: the geometry, the atomic data and the settings. Every run of
+    montecarlo_radial1d starts from a copy of its storage.
+
+    Parameters
+    ----------
+    model : `tardis.model.Radial1DModel`
+    """
+    cdef storage_model_t storage
+    cdef readonly object model
+    # Arrays the storage points to
+    cdef readonly np.ndarray r_inner, r_outer, v_inner, line_list_nu
+    cdef readonly np.ndarray continuum_list_nu, chi_bf_tmp_partial, l_pop, l_pop_r
+    cdef readonly np.ndarray line2macro_level_upper, macro_block_references
+    cdef readonly np.ndarray transition_type, destination_level_id, transition_line_id
+
+    def __cinit__(self):
+        memset(&self.storage, 0, sizeof(storage_model_t))
+
+    def __dealloc__(self):
+        frequency_index_free(&self.storage.line_list_nu_index)
+        frequency_index_free(&self.storage.continuum_list_nu_index)
+
+    def __init__(self, model):
+        cdef storage_model_t *storage = &self.storage
+        self.model = model
+        # Setup of structure
+        structure = model.tardis_config.structure
+        storage.no_of_shells = structure.no_of_shells
+        self.r_inner = np.ascontiguousarray(structure.r_inner.to('cm').value, dtype=np.float64)
+        storage.r_inner = <double*> self.r_inner.data
+        self.r_outer = np.ascontiguousarray(structure.r_outer.to('cm').value, dtype=np.float64)
+        storage.r_outer = <double*> self.r_outer.data
+        self.v_inner = np.ascontiguousarray(structure.v_inner.to('cm/s').value, dtype=np.float64)
+        storage.v_inner = <double*> self.v_inner.data
+        # times
+        storage.time_explosion = model.tardis_config.supernova.time_explosion.to('s').value
+        storage.inverse_time_explosion = 1.0 / storage.time_explosion
+        # Switch for continuum processes
+        storage.cont_status = CONTINUUM_OFF
+        # Continuum data
+        if storage.cont_status == CONTINUUM_ON:
+            self.continuum_list_nu = np.array([9.0e14, 8.223e14, 6.0e14, 3.5e14, 3.0e14])  # sorted list of threshold frequencies
+            storage.continuum_list_nu = <double*> self.continuum_list_nu.data
+            storage.no_of_edges = self.continuum_list_nu.size
+            frequency_index_init(&storage.continuum_list_nu_index, storage.continuum_list_nu, storage.no_of_edges)
+            self.chi_bf_tmp_partial = np.zeros(self.continuum_list_nu.size)
+            storage.chi_bf_tmp_partial = <double*> self.chi_bf_tmp_partial.data
+            self.l_pop = np.ones(storage.no_of_shells * self.continuum_list_nu.size, dtype=np.float64)
+            storage.l_pop = <double*> self.l_pop.data
+            self.l_pop_r = np.ones(storage.no_of_shells * self.continuum_list_nu.size, dtype=np.float64)
+            storage.l_pop_r = <double*> self.l_pop_r.data
+        # Line lists
+        self.line_list_nu = np.ascontiguousarray(model.atom_data.lines.nu.values, dtype=np.float64)
+        storage.line_list_nu = <double*> self.line_list_nu.data
+        storage.no_of_lines = self.line_list_nu.size
+        frequency_index_init(&storage.line_list_nu_index, storage.line_list_nu, storage.no_of_lines)
+        storage.line_lists_j_blues_nd = storage.no_of_lines
+        # Settings
+        montecarlo_config = model.tardis_config.montecarlo
+        storage.sparse_j_blue_estimators = montecarlo_config.sparse_j_blue_estimators
+        storage.thread_private_estimators = montecarlo_config.thread_private_estimators
+        storage.packet_batch_size = montecarlo_config.packet_batch_size
+        storage.packet_block_size = montecarlo_config.packet_block_size
+        if storage.packet_block_size > 0:
+            storage.packet_tracking_stride = montecarlo_config.packet_tracking_stride
+        else:
+            storage.packet_tracking_stride = 1
+        packet_schedule = montecarlo_config.schedule
+        if packet_schedule == 'dynamic':
+            storage.packet_schedule = PACKET_SCHEDULE_DYNAMIC
+        elif packet_schedule == 'guided':
+            storage.packet_schedule = PACKET_SCHEDULE_GUIDED
+        else:
+            storage.packet_schedule = PACKET_SCHEDULE_STATIC
+        storage.packet_schedule_chunk_size = montecarlo_config.schedule_chunk_size
+        if montecarlo_config.rng == 'xoshiro':
+            storage.rng_backend = RNG_BACKEND_XOSHIRO
+        else:
+            storage.rng_backend = RNG_BACKEND_MT
+        storage.packet_source = PACKET_SOURCES[montecarlo_config.packet_source]
+        storage.packet_source_nu_start = model.packet_src.nu_start
+        storage.packet_source_nu_end = model.packet_src.nu_end
+        line_interaction_type = model.tardis_config.plasma.line_interaction_type
+        if line_interaction_type == 'scatter':
+            storage.line_interaction_id = 0
+        elif line_interaction_type == 'downbranch':
+            storage.line_interaction_id = 1
+        elif line_interaction_type == 'macroatom':
+            storage.line_interaction_id = 2
+        else:
+            storage.line_interaction_id = -99
+        # macro atom & downbranch
+        if storage.line_interaction_id >= 1:
+            self.line2macro_level_upper = model.atom_data.lines_upper2macro_reference_idx
+            storage.line2macro_level_upper = <int_type_t*> self.line2macro_level_upper.data
+            self.transition_type = model.atom_data.macro_atom_data['transition_type'].values
+            storage.transition_type = <int_type_t*> self.transition_type.data
+            # Destination level is not needed and/or generated for downbranch
+            self.destination_level_id = model.atom_data.macro_atom_data['destination_level_idx'].values
+            storage.destination_level_id = <int_type_t*> self.destination_level_id.data
+            self.transition_line_id = model.atom_data.macro_atom_data['lines_idx'].values
+            storage.transition_line_id = <int_type_t*> self.transition_line_id.data
+            # The end of the last block is appended, so that every block has its size.
+            self.macro_block_references = np.hstack((
+                model.atom_data.macro_atom_references['block_references'].values,
+                self.transition_type.size))
+            storage.macro_block_references = <int_type_t*> self.macro_block_references.data
+        storage.spectrum_start_nu = model.tardis_config.spectrum.frequency.value.min()
+        storage.spectrum_end_nu = model.tardis_config.spectrum.frequency.value.max()
+        storage.spectrum_virt_start_nu = montecarlo_config.virtual_spectrum_range.end.to('Hz', units.spectral()).value
+        storage.spectrum_virt_end_nu = montecarlo_config.virtual_spectrum_range.start.to('Hz', units.spectral()).value
+        storage.spectrum_delta_nu = model.tardis_config.spectrum.frequency.value[1] - model.tardis_config.spectrum.frequency.value[0]
+        storage.spectrum_nu_size = model.tardis_config.spectrum.frequency.size - 1
+        storage.luminosity_nu_start = model.tardis_config.supernova.luminosity_nu_start.to('Hz').value
+        storage.luminosity_nu_end = model.tardis_config.supernova.luminosity_nu_end.to('Hz').value
+        storage.sigma_thomson = montecarlo_config.sigma_thomson.to('1/cm^2').value
+        storage.inverse_sigma_thomson = 1.0 / storage.sigma_thomson
+        storage.reflective_inner_boundary = montecarlo_config.enable_reflective_inner_boundary
+        storage.inner_boundary_albedo = montecarlo_config.inner_boundary_albedo
 
-    void montecarlo_main_loop(storage_model_t * storage, int_type_t virtual_packet_flag, int nthreads, unsigned long seed)
 
 def montecarlo_radial1d(model, runner, int_type_t virtual_packet_flag=0,
                         int nthreads=4):
@@ -115,99 +454,189 @@ def montecarlo_radial1d(model, runner, int_type_t virtual_packet_flag=0,
                     int_type_t log_packets,
                     int_type_t do_scatter
     """
-    cdef storage_model_t storage
-    cdef np.ndarray[double, ndim=1] packet_nus = model.packet_src.packet_nus
-    storage.packet_nus = <double*> packet_nus.data
-    cdef np.ndarray[double, ndim=1] packet_mus = model.packet_src.packet_mus
-    storage.packet_mus = <double*> packet_mus.data
-    cdef np.ndarray[double, ndim=1] packet_energies = model.packet_src.packet_energies
-    storage.packet_energies = <double*> packet_energies.data
-    storage.no_of_packets = packet_nus.size
-    # Setup of structure
-    structure = model.tardis_config.structure
-    storage.no_of_shells = structure.no_of_shells
-    cdef np.ndarray[double, ndim=1] r_inner = structure.r_inner.to('cm').value
-    storage.r_inner = <double*> r_inner.data
-    cdef np.ndarray[double, ndim=1] r_outer = structure.r_outer.to('cm').value
-    storage.r_outer = <double*> r_outer.data
-    cdef np.ndarray[double, ndim=1] v_inner = structure.v_inner.to('cm/s').value
-    storage.v_inner = <double*> v_inner.data
-    # Setup the rest
-    # times
-    storage.time_explosion = model.tardis_config.supernova.time_explosion.to('s').value
-    storage.inverse_time_explosion = 1.0 / storage.time_explosion
+    # The static part of the storage is built once per model, every run
+    # starts from a copy of it and only sets the per-iteration data.
+    cdef StaticStorage static_storage = runner.static_storage
+    if static_storage is None or static_storage.model is not model:
+        static_storage = StaticStorage(model)
+        runner.static_storage = static_storage
+    cdef storage_model_t storage = static_storage.storage
+    cdef np.ndarray[double, ndim=1] packet_nus
+    cdef np.ndarray[double, ndim=1] packet_mus
+    cdef np.ndarray[double, ndim=1] packet_energies
+    if storage.packet_source != PACKET_SOURCE_ARRAYS:
+        # The packets are created by the threads of the main loop.
+        storage.no_of_packets = model.current_no_of_packets
+        storage.packet_source_temperature = model.t_inner.value
+        # Streams after the ones of the transport, different every iteration
+        storage.packet_source_seed = model.tardis_config.montecarlo.seed + (
+            model.iterations_executed + 1) * storage.no_of_packets
+    else:
+        packet_nus = model.packet_src.packet_nus
+        storage.packet_nus = <double*> packet_nus.data
+        packet_mus = model.packet_src.packet_mus
+        storage.packet_mus = <double*> packet_mus.data
+        packet_energies = model.packet_src.packet_energies
+        storage.packet_energies = <double*> packet_energies.data
+        storage.no_of_packets = packet_nus.size
     #electron density
     cdef np.ndarray[double, ndim=1] electron_densities = model.plasma_array.electron_densities.values
     storage.electron_densities = <double*> electron_densities.data
-    cdef np.ndarray[double, ndim=1] inverse_electron_densities = 1.0 / electron_densities
+    cdef np.ndarray[double, ndim=1] inverse_electron_densities = runner.get_buffer(
+        'inverse_electron_densities', storage.no_of_shells, np.float64)
+    np.divide(1.0, electron_densities, out=inverse_electron_densities)
     storage.inverse_electron_densities = <double*> inverse_electron_densities.data
-    # Switch for continuum processes
-    storage.cont_status = CONTINUUM_OFF
-    # Continuum data
-    cdef np.ndarray[double, ndim=1] continuum_list_nu
-    cdef np.ndarray[double, ndim =1] chi_bf_tmp_partial
-    cdef np.ndarray[double, ndim=1] l_pop
-    cdef np.ndarray[double, ndim=1] l_pop_r
-    if storage.cont_status == CONTINUUM_ON:
-        continuum_list_nu = np.array([9.0e14, 8.223e14, 6.0e14, 3.5e14, 3.0e14])  # sorted list of threshold frequencies
-        storage.continuum_list_nu = <double*> continuum_list_nu.data
-        storage.no_of_edges = continuum_list_nu.size
-        chi_bf_tmp_partial = np.zeros(continuum_list_nu.size)
-        storage.chi_bf_tmp_partial = <double*> chi_bf_tmp_partial.data
-        l_pop = np.ones(storage.no_of_shells * continuum_list_nu.size, dtype=np.float64)
-        storage.l_pop = <double*> l_pop.data
-        l_pop_r = np.ones(storage.no_of_shells * continuum_list_nu.size, dtype=np.float64)
-        storage.l_pop_r = <double*> l_pop_r.data
     # Line lists
-    cdef np.ndarray[double, ndim=1] line_list_nu = model.atom_data.lines.nu.values
-    storage.line_list_nu = <double*> line_list_nu.data
-    storage.no_of_lines = line_list_nu.size
     cdef np.ndarray[double, ndim=2] line_lists_tau_sobolevs = model.plasma_array.tau_sobolevs.values.transpose()
-    storage.line_lists_tau_sobolevs = <double*> line_lists_tau_sobolevs.data
-    storage.line_lists_tau_sobolevs_nd = line_lists_tau_sobolevs.shape[1]
-    cdef np.ndarray[double, ndim=2] line_lists_j_blues = model.j_blue_estimators
-    storage.line_lists_j_blues = <double*> line_lists_j_blues.data
-    storage.line_lists_j_blues_nd = line_lists_j_blues.shape[1]
-    line_interaction_type = model.tardis_config.plasma.line_interaction_type
-    if line_interaction_type == 'scatter':
-        storage.line_interaction_id = 0
-    elif line_interaction_type == 'downbranch':
-        storage.line_interaction_id = 1
-    elif line_interaction_type == 'macroatom':
-        storage.line_interaction_id = 2
+    # Line culling drops the lines that are optically thin in all shells from
+    # the line list the packets are propagated through. The macro atom still
+    # emits in the full line list, mapped back by line_list_full_next, and the
+    # model reconstructs the j_blues of the culled lines.
+    cdef double line_culling_threshold = model.tardis_config.montecarlo.line_culling_threshold
+    cdef np.ndarray[int_type_t, ndim=1] line_list_full_ids
+    cdef np.ndarray[int_type_t, ndim=1] line_list_full_next
+    cdef np.ndarray[double, ndim=1] line_list_nu
+    runner.culled_line_ids = None
+    if line_culling_threshold > 0:
+        kept_lines = (line_lists_tau_sobolevs >= line_culling_threshold).any(axis=0)
+        if kept_lines.any() and not kept_lines.all():
+            line_list_full_ids = np.flatnonzero(kept_lines).astype(np.int64)
+            line_list_full_next = np.searchsorted(
+                line_list_full_ids, np.arange(storage.no_of_lines),
+                side='right').astype(np.int64)
+            line_list_nu = static_storage.line_list_nu[line_list_full_ids]
+            if not model.tardis_config.montecarlo.compact_storage:
+                line_lists_tau_sobolevs = np.ascontiguousarray(
+                    line_lists_tau_sobolevs[:, line_list_full_ids])
+            storage.line_list_full_ids = <int_type_t*> line_list_full_ids.data
+            storage.line_list_full_nu = storage.line_list_nu
+            storage.line_list_full_next = <int_type_t*> line_list_full_next.data
+            storage.line_list_nu = <double*> line_list_nu.data
+            storage.no_of_lines = line_list_nu.size
+            storage.line_lists_j_blues_nd = storage.no_of_lines
+            frequency_index_init(&storage.line_list_nu_index,
+                                 storage.line_list_nu, storage.no_of_lines)
+            runner.culled_line_ids = np.flatnonzero(~kept_lines)
+    cdef np.ndarray line_lists_j_blues
+    # The compact storage reads single precision tau_sobolevs from a buffer of
+    # the runner in place of the double precision matrix, and accumulates the
+    # j_blue estimator in the single precision array the model provides.
+    cdef np.ndarray[float, ndim=2] line_lists_tau_sobolevs_compact
+    storage.line_lists_tau_sobolevs = NULL
+    storage.line_lists_tau_sobolevs_compact = NULL
+    if model.tardis_config.montecarlo.compact_storage:
+        line_lists_tau_sobolevs_compact = runner.get_buffer(
+            'line_lists_tau_sobolevs_compact',
+            storage.no_of_shells * storage.no_of_lines, np.float32).reshape(
+                storage.no_of_shells, storage.no_of_lines)
+        if storage.line_list_full_ids != NULL:
+            np.take(line_lists_tau_sobolevs, line_list_full_ids, axis=1,
+                    out=line_lists_tau_sobolevs_compact)
+        else:
+            np.copyto(line_lists_tau_sobolevs_compact, line_lists_tau_sobolevs,
+                      casting='same_kind')
+        storage.line_lists_tau_sobolevs_compact = <float*> line_lists_tau_sobolevs_compact.data
     else:
-        storage.line_interaction_id = -99
+        storage.line_lists_tau_sobolevs = <double*> line_lists_tau_sobolevs.data
+    storage.line_lists_tau_sobolevs_nd = storage.no_of_lines
+    # Line skipping searches the cumulative tau_sobolevs of every shell, summed
+    # over the same values the line interactions read.
+    cdef np.ndarray[double, ndim=1] line_lists_tau_cumulative
+    cdef np.ndarray[double, ndim=2] tau_cumulative
+    storage.line_lists_tau_cumulative = NULL
+    if model.tardis_config.montecarlo.line_skipping:
+        line_lists_tau_cumulative = runner.get_buffer(
+            'line_lists_tau_cumulative',
+            storage.no_of_shells * (storage.line_lists_tau_sobolevs_nd + 1),
+            np.float64)
+        tau_cumulative = line_lists_tau_cumulative.reshape(
+            storage.no_of_shells, storage.line_lists_tau_sobolevs_nd + 1)
+        tau_cumulative[:, 0] = 0
+        if model.tardis_config.montecarlo.compact_storage:
+            np.cumsum(line_lists_tau_sobolevs_compact, axis=1, dtype=np.float64,
+                      out=tau_cumulative[:, 1:])
+        else:
+            np.cumsum(line_lists_tau_sobolevs, axis=1, out=tau_cumulative[:, 1:])
+        storage.line_lists_tau_cumulative = <double*> line_lists_tau_cumulative.data
+    # The sparse j_blue estimator is accumulated in thread private hash maps
+    # instead of the dense array of the model.
+    if not storage.sparse_j_blue_estimators:
+        line_lists_j_blues = model.j_blue_estimators
+        if storage.line_list_full_ids != NULL:
+            line_lists_j_blues = runner.get_buffer(
+                'line_lists_j_blues',
+                storage.no_of_shells * storage.line_lists_j_blues_nd,
+                model.j_blue_estimators.dtype).reshape(
+                    storage.no_of_shells, storage.line_lists_j_blues_nd)
+            line_lists_j_blues.fill(0)
+        if line_lists_j_blues.dtype == np.float32:
+            storage.line_lists_j_blues_compact = <float*> line_lists_j_blues.data
+        else:
+            storage.line_lists_j_blues = <double*> line_lists_j_blues.data
+    cdef np.ndarray[double, ndim=1] thread_busy_times = np.zeros(max(nthreads, 1), dtype=np.float64)
+    cdef np.ndarray[int_type_t, ndim=1] thread_packet_counts = np.zeros(max(nthreads, 1), dtype=np.int64)
+    storage.thread_busy_times = <double*> thread_busy_times.data
+    storage.thread_packet_counts = <int_type_t*> thread_packet_counts.data
+    # Only an extension built with instrumentation fills the event counters.
+    cdef np.ndarray thread_counters = None
+    storage.thread_counters = NULL
+    if INSTRUMENTED:
+        thread_counters = np.zeros(max(nthreads, 1),
+                                   dtype=INSTRUMENTATION_COUNTERS_DTYPE)
+        storage.thread_counters = <instrumentation_counters_t*> thread_counters.data
     # macro atom & downbranch
     cdef np.ndarray[double, ndim=2] transition_probabilities
-    cdef np.ndarray[int_type_t, ndim=1] line2macro_level_upper
-    cdef np.ndarray[int_type_t, ndim=1] macro_block_references
-    cdef np.ndarray[int_type_t, ndim=1] transition_type
-    cdef np.ndarray[int_type_t, ndim=1] destination_level_id
-    cdef np.ndarray[int_type_t, ndim=1] transition_line_id
+    cdef np.ndarray macro_atom_transitions
     if storage.line_interaction_id >= 1:
         transition_probabilities = model.transition_probabilities.values.transpose()
         storage.transition_probabilities = <double*> transition_probabilities.data
         storage.transition_probabilities_nd = transition_probabilities.shape[1]
-        line2macro_level_upper = model.atom_data.lines_upper2macro_reference_idx
-        storage.line2macro_level_upper = <int_type_t*> line2macro_level_upper.data
-        macro_block_references = model.atom_data.macro_atom_references['block_references'].values
-        storage.macro_block_references = <int_type_t*> macro_block_references.data
-        transition_type = model.atom_data.macro_atom_data['transition_type'].values
-        storage.transition_type = <int_type_t*> transition_type.data
-        # Destination level is not needed and/or generated for downbranch
-        destination_level_id = model.atom_data.macro_atom_data['destination_level_idx'].values
-        storage.destination_level_id = <int_type_t*> destination_level_id.data
-        transition_line_id = model.atom_data.macro_atom_data['lines_idx'].values
-        storage.transition_line_id = <int_type_t*> transition_line_id.data
-    cdef np.ndarray[double, ndim=1] output_nus = np.zeros(storage.no_of_packets, dtype=np.float64)
-    cdef np.ndarray[double, ndim=1] output_energies = np.zeros(storage.no_of_packets, dtype=np.float64)
+        macro_atom_transitions = pack_macro_atom_transitions(
+            model.transition_alias_probabilities,
+            model.transition_alias_indices, static_storage.transition_type,
+            static_storage.destination_level_id,
+            static_storage.transition_line_id)
+        storage.macro_atom_transitions = <macro_atom_transition_t*> macro_atom_transitions.data
+    # The packet outputs live in buffers of the runner that are reused by
+    # every run, every tracked packet writes its output_nus and
+    # output_energies. Streaming runs only track every
+    # packet_tracking_stride-th packet. All packets are binned into the
+    # emitted and reabsorbed spectra by the threads.
+    cdef int_type_t no_of_tracked_packets = storage.no_of_packets
+    if storage.packet_tracking_stride == 0:
+        no_of_tracked_packets = 0
+    elif storage.packet_tracking_stride > 1:
+        no_of_tracked_packets = ((storage.no_of_packets - 1) //
+                                 storage.packet_tracking_stride + 1)
+    cdef np.ndarray[double, ndim=1] spectra = runner.get_buffer(
+        'spectra', 2 * storage.spectrum_nu_size, np.float64)
+    spectra.fill(0)
+    storage.spectrum_emitted_nu = <double*> spectra.data
+    storage.spectrum_reabsorbed_nu = storage.spectrum_emitted_nu + storage.spectrum_nu_size
+    storage.luminosity_emitted_energy = 0
+    storage.luminosity_reabsorbed_energy = 0
+    storage.no_of_emitted_packets = 0
+    cdef np.ndarray[double, ndim=1] output_nus = runner.get_buffer(
+        'output_nus', no_of_tracked_packets, np.float64)
+    cdef np.ndarray[double, ndim=1] output_energies = runner.get_buffer(
+        'output_energies', no_of_tracked_packets, np.float64)
     storage.output_nus = <double*> output_nus.data
     storage.output_energies = <double*> output_energies.data
-    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_in_id = -1 * np.ones(storage.no_of_packets, dtype=np.int64)
-    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_out_id = -1 * np.ones(storage.no_of_packets, dtype=np.int64)
-    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_shell_id = -1 * np.ones(storage.no_of_packets, dtype=np.int64)
-    cdef np.ndarray[int_type_t, ndim=1] last_interaction_type = -1 * np.ones(storage.no_of_packets, dtype=np.int64)
-    cdef np.ndarray[double, ndim=1] last_interaction_in_nu = -1 * np.ones(storage.no_of_packets, dtype=np.float64)
+    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_in_id = runner.get_buffer(
+        'last_line_interaction_in_id', no_of_tracked_packets, np.int64)
+    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_out_id = runner.get_buffer(
+        'last_line_interaction_out_id', no_of_tracked_packets, np.int64)
+    cdef np.ndarray[int_type_t, ndim=1] last_line_interaction_shell_id = runner.get_buffer(
+        'last_line_interaction_shell_id', no_of_tracked_packets, np.int64)
+    cdef np.ndarray[int_type_t, ndim=1] last_interaction_type = runner.get_buffer(
+        'last_interaction_type', no_of_tracked_packets, np.int64)
+    cdef np.ndarray[double, ndim=1] last_interaction_in_nu = runner.get_buffer(
+        'last_interaction_in_nu', no_of_tracked_packets, np.float64)
+    last_line_interaction_in_id.fill(-1)
+    last_line_interaction_out_id.fill(-1)
+    last_line_interaction_shell_id.fill(-1)
+    last_interaction_type.fill(-1)
+    last_interaction_in_nu.fill(-1)
     storage.last_line_interaction_in_id = <int_type_t*> last_line_interaction_in_id.data
     storage.last_line_interaction_out_id = <int_type_t*> last_line_interaction_out_id.data
     storage.last_line_interaction_shell_id = <int_type_t*> last_line_interaction_shell_id.data
@@ -217,45 +646,58 @@ def montecarlo_radial1d(model, runner, int_type_t virtual_packet_flag=0,
     cdef np.ndarray[double, ndim=1] nubars = np.zeros(storage.no_of_shells, dtype=np.float64)
     storage.js = <double*> js.data
     storage.nubars = <double*> nubars.data
-    storage.spectrum_start_nu = model.tardis_config.spectrum.frequency.value.min()
-    storage.spectrum_end_nu = model.tardis_config.spectrum.frequency.value.max()
-    storage.spectrum_virt_start_nu = model.tardis_config.montecarlo.virtual_spectrum_range.end.to('Hz', units.spectral()).value
-    storage.spectrum_virt_end_nu = model.tardis_config.montecarlo.virtual_spectrum_range.start.to('Hz', units.spectral()).value
-    storage.spectrum_delta_nu = model.tardis_config.spectrum.frequency.value[1] - model.tardis_config.spectrum.frequency.value[0]
     cdef np.ndarray[double, ndim=1] spectrum_virt_nu = model.montecarlo_virtual_luminosity
     storage.spectrum_virt_nu = <double*> spectrum_virt_nu.data
-    storage.sigma_thomson = model.tardis_config.montecarlo.sigma_thomson.to('1/cm^2').value
-    storage.inverse_sigma_thomson = 1.0 / storage.sigma_thomson
-    storage.reflective_inner_boundary = model.tardis_config.montecarlo.enable_reflective_inner_boundary
-    storage.inner_boundary_albedo = model.tardis_config.montecarlo.inner_boundary_albedo
+    storage.spectrum_virt_nu_size = spectrum_virt_nu.size
     # Data for continuum implementation
     cdef np.ndarray[double, ndim=1] t_electrons = model.plasma_array.t_electrons
     storage.t_electrons = <double*> t_electrons.data
-    ######## Setting up the output ########
-    #cdef np.ndarray[double, ndim=1] output_nus = np.zeros(storage.no_of_packets, dtype=np.float64)
-    #cdef np.ndarray[double, ndim=1] output_energies = np.zeros(storage.no_of_packets, dtype=np.float64)
-    montecarlo_main_loop(&storage, virtual_packet_flag, nthreads, model.tardis_config.montecarlo.seed)
-
-    cdef np.ndarray[double, ndim=1] virt_packet_nus = np.zeros(storage.virt_packet_count, dtype=np.float64)
-    cdef np.ndarray[double, ndim=1] virt_packet_energies = np.zeros(storage.virt_packet_count, dtype=np.float64)
-    cdef np.ndarray[double, ndim=1] virt_last_interaction_in_nu = np.zeros(storage.virt_packet_count, dtype=np.float64)
-    cdef np.ndarray[int_type_t, ndim=1] virt_last_interaction_type = np.zeros(storage.virt_packet_count, dtype=np.int64)
-    cdef np.ndarray[int_type_t, ndim=1] virt_last_line_interaction_in_id = np.zeros(storage.virt_packet_count, dtype=np.int64)
-    cdef np.ndarray[int_type_t, ndim=1] virt_last_line_interaction_out_id = np.zeros(storage.virt_packet_count, dtype=np.int64)
-
-    for i in range(storage.virt_packet_count):
-        virt_packet_nus[i] = storage.virt_packet_nus[i]
-        virt_packet_energies[i] = storage.virt_packet_energies[i]
-        virt_last_interaction_in_nu[i] = storage.virt_last_interaction_in_nu[i]
-        virt_last_interaction_type[i] = storage.virt_last_interaction_type[i]
-        virt_last_line_interaction_in_id[i] = storage.virt_last_line_interaction_in_id[i]
-        virt_last_line_interaction_out_id[i] = storage.virt_last_line_interaction_out_id[i]
-    free(<void *>storage.virt_packet_nus)
-    free(<void *>storage.virt_packet_energies)
-    free(<void *>storage.virt_last_interaction_in_nu)
-    free(<void *>storage.virt_last_interaction_type)
-    free(<void *>storage.virt_last_line_interaction_in_id)
-    free(<void *>storage.virt_last_line_interaction_out_id)
+    cdef unsigned long seed = model.tardis_config.montecarlo.seed
+    # The transport only touches the storage, other Python threads can run
+    # meanwhile (see MontecarloRunner.start).
+    with nogil:
+        montecarlo_main_loop(&storage, virtual_packet_flag, nthreads, seed)
+    if storage.line_list_full_ids != NULL:
+        frequency_index_free(&storage.line_list_nu_index)
+
+    # The virtual packet arrays take over the memory allocated by the C code.
+    virt_packet_nus = c_array_to_numpy(
+        storage.virt_packet_nus, storage.virt_packet_count, np.NPY_FLOAT64)
+    virt_packet_energies = c_array_to_numpy(
+        storage.virt_packet_energies, storage.virt_packet_count, np.NPY_FLOAT64)
+    virt_last_interaction_in_nu = c_array_to_numpy(
+        storage.virt_last_interaction_in_nu, storage.virt_packet_count, np.NPY_FLOAT64)
+    virt_last_interaction_type = c_array_to_numpy(
+        storage.virt_last_interaction_type, storage.virt_packet_count, np.NPY_INT64)
+    virt_last_line_interaction_in_id = c_array_to_numpy(
+        storage.virt_last_line_interaction_in_id, storage.virt_packet_count, np.NPY_INT64)
+    virt_last_line_interaction_out_id = c_array_to_numpy(
+        storage.virt_last_line_interaction_out_id, storage.virt_packet_count, np.NPY_INT64)
+
+    if storage.sparse_j_blue_estimators:
+        j_blue_sparse_indices = c_array_to_numpy(
+            storage.line_lists_j_blues_sparse_indices,
+            storage.line_lists_j_blues_sparse_count, np.NPY_INT64)
+        j_blue_sparse_values = c_array_to_numpy(
+            storage.line_lists_j_blues_sparse_values,
+            storage.line_lists_j_blues_sparse_count, np.NPY_FLOAT64)
+        j_blue_sparse_lines = j_blue_sparse_indices % storage.line_lists_j_blues_nd
+        if storage.line_list_full_ids != NULL:
+            j_blue_sparse_lines = line_list_full_ids[j_blue_sparse_lines]
+        runner.j_blue_estimator = sparse.coo_matrix(
+            (j_blue_sparse_values,
+             (j_blue_sparse_indices // storage.line_lists_j_blues_nd,
+              j_blue_sparse_lines)),
+            shape=(storage.no_of_shells, static_storage.line_list_nu.size))
+    else:
+        if storage.line_list_full_ids != NULL:
+            model.j_blue_estimators[:, line_list_full_ids] = line_lists_j_blues
+        runner.j_blue_estimator = model.j_blue_estimators
+    runner._spectrum_emitted_energy = spectra[:storage.spectrum_nu_size]
+    runner._spectrum_reabsorbed_energy = spectra[storage.spectrum_nu_size:]
+    runner._luminosity_emitted_energy = storage.luminosity_emitted_energy
+    runner._luminosity_reabsorbed_energy = storage.luminosity_reabsorbed_energy
+    runner.no_of_emitted_packets = storage.no_of_emitted_packets
     runner._packet_nu = output_nus
     runner._packet_energy = output_energies
     runner.j_estimator = js
@@ -265,6 +707,9 @@ def montecarlo_radial1d(model, runner, int_type_t virtual_packet_flag=0,
     runner.last_interaction_type = last_interaction_type
     runner.last_line_interaction_shell_id = last_line_interaction_shell_id
     runner.last_interaction_in_nu = last_interaction_in_nu
+    runner.thread_busy_times = thread_busy_times
+    runner.thread_packet_counts = thread_packet_counts
+    runner.thread_counters = thread_counters
     runner.virt_packet_nus = virt_packet_nus
     runner.virt_packet_energies = virt_packet_energies
     runner.virt_last_interaction_in_nu = virt_last_interaction_in_nu
@@ -15,6 +15,10 @@ else:
     link_args = []
     define_macros = []
 
+if get_distutils_option('with_instrumentation',
+                        ['build', 'install', 'develop']) is not None:
+    define_macros.append(('WITHINSTRUMENTATION', None))
+
 def get_extensions():
     sources = ['tardis/montecarlo/montecarlo.pyx']
     sources += [os.path.relpath(fname) for fname in glob(
@@ -3,15 +3,7 @@
 #endif
 #include "cmontecarlo.h"
 
-rk_state mt_state;
-
-void
-initialize_random_kit (unsigned long seed)
-{
-  rk_seed (seed, &mt_state);
-}
-
-INLINE tardis_error_t
+tardis_error_t
 line_search (double *nu, double nu_insert, int64_t number_of_lines,
 	     int64_t * result)
 {
@@ -35,6 +27,93 @@ line_search (double *nu, double nu_insert, int64_t number_of_lines,
   return ret_val;
 }
 
+void
+frequency_index_init (frequency_index_t * index, double *nu,
+		      int64_t number_of_lines)
+{
+  int64_t i, bin;
+  index->no_of_bins = number_of_lines > 0 ? number_of_lines : 1;
+  index->first_below = (int64_t *) malloc (sizeof (int64_t) * (index->no_of_bins + 1));
+  index->log_nu_min = 0.0;
+  index->inverse_bin_width = 0.0;
+  if (number_of_lines > 0 && nu[0] > nu[number_of_lines - 1])
+    {
+      index->log_nu_min = log (nu[number_of_lines - 1]);
+      index->inverse_bin_width = index->no_of_bins / (log (nu[0]) - index->log_nu_min);
+    }
+  // The bins are non-increasing along the list, walk it from the red end.
+  i = number_of_lines;
+  for (bin = 0; bin <= index->no_of_bins; bin++)
+    {
+      while (i > 0 && frequency_index_bin (index, nu[i - 1]) < bin)
+	{
+	  i--;
+	}
+      index->first_below[bin] = i;
+    }
+}
+
+void
+frequency_index_free (frequency_index_t * index)
+{
+  free (index->first_below);
+  index->first_below = NULL;
+}
+
+int64_t
+frequency_index_bin (frequency_index_t * index, double nu)
+{
+  double x = (log (nu) - index->log_nu_min) * index->inverse_bin_width;
+  if (!(x >= 0.0))
+    {
+      return 0;
+    }
+  return x < index->no_of_bins ? (int64_t) x : index->no_of_bins - 1;
+}
+
+tardis_error_t
+indexed_line_search (frequency_index_t * index, double *nu, double nu_insert,
+		     int64_t number_of_lines, int64_t * result)
+{
+  int64_t imin, imax, imid, bin;
+  if (index->first_below == NULL)
+    {
+      return line_search (nu, nu_insert, number_of_lines, result);
+    }
+  if (nu_insert > nu[0])
+    {
+      *result = 0;
+    }
+  else if (nu_insert < nu[number_of_lines - 1])
+    {
+      *result = number_of_lines;
+    }
+  else
+    {
+      /*
+         Since the bins are monotonic in nu, all lines of higher bins are
+         blue-ward and all lines of lower bins red-ward of nu_insert.
+       */
+      bin = frequency_index_bin (index, nu_insert);
+      imin = index->first_below[bin + 1];
+      imax = index->first_below[bin];
+      while (imin < imax)
+	{
+	  imid = imin + (imax - imin) / 2;
+	  if (nu[imid] < nu_insert)
+	    {
+	      imax = imid;
+	    }
+	  else
+	    {
+	      imin = imid + 1;
+	    }
+	}
+      *result = imin;
+    }
+  return TARDIS_ERROR_OK;
+}
+
 inline tardis_error_t
 reverse_binary_search (double *x, double x_insert,
 		       int64_t imin, int64_t imax, int64_t * result)
@@ -121,7 +200,159 @@ binary_search (double *x, double x_insert, int64_t imin,
   return ret_val;
 }
 
-INLINE double
+void
+j_blue_map_init (j_blue_map_t * map, int64_t capacity)
+{
+  int64_t i;
+  map->indices = (int64_t *) malloc (sizeof (int64_t) * capacity);
+  map->values = (double *) calloc (capacity, sizeof (double));
+  map->capacity = capacity;
+  map->count = 0;
+  for (i = 0; i < capacity; i++)
+    {
+      map->indices[i] = -1;
+    }
+}
+
+void
+j_blue_map_free (j_blue_map_t * map)
+{
+  free (map->indices);
+  free (map->values);
+  map->indices = NULL;
+  map->values = NULL;
+  map->capacity = 0;
+  map->count = 0;
+}
+
+static inline int64_t
+j_blue_map_slot (j_blue_map_t * map, int64_t index)
+{
+  // Fibonacci hashing, consecutive lines of a shell spread over the slots.
+  uint64_t slot = ((uint64_t) index * 0x9E3779B97F4A7C15ULL) >> 32;
+  slot &= map->capacity - 1;
+  while (map->indices[slot] != -1 && map->indices[slot] != index)
+    {
+      slot = (slot + 1) & (map->capacity - 1);
+    }
+  return slot;
+}
+
+static void
+j_blue_map_grow (j_blue_map_t * map)
+{
+  j_blue_map_t grown;
+  int64_t i, slot;
+  j_blue_map_init (&grown, 2 * map->capacity);
+  for (i = 0; i < map->capacity; i++)
+    {
+      if (map->indices[i] != -1)
+	{
+	  slot = j_blue_map_slot (&grown, map->indices[i]);
+	  grown.indices[slot] = map->indices[i];
+	  grown.values[slot] = map->values[i];
+	}
+    }
+  grown.count = map->count;
+  j_blue_map_free (map);
+  *map = grown;
+}
+
+void
+j_blue_map_add (j_blue_map_t * map, int64_t index, double value)
+{
+  int64_t slot = j_blue_map_slot (map, index);
+  if (map->indices[slot] == -1)
+    {
+      if (2 * (map->count + 1) > map->capacity)
+	{
+	  j_blue_map_grow (map);
+	  slot = j_blue_map_slot (map, index);
+	}
+      map->indices[slot] = index;
+      map->count++;
+    }
+  map->values[slot] += value;
+}
+
+typedef struct JBlueMapEntry
+{
+  int64_t index;
+  int64_t thread_id;
+  double value;
+} j_blue_map_entry_t;
+
+static int
+compare_j_blue_map_entries (const void *a, const void *b)
+{
+  const j_blue_map_entry_t *x = (const j_blue_map_entry_t *) a;
+  const j_blue_map_entry_t *y = (const j_blue_map_entry_t *) b;
+  if (x->index != y->index)
+    {
+      return x->index < y->index ? -1 : 1;
+    }
+  return (x->thread_id > y->thread_id) - (x->thread_id < y->thread_id);
+}
+
+void
+montecarlo_merge_j_blue_maps (storage_model_t * storage,
+			      storage_model_t * thread_storages,
+			      int64_t no_of_threads)
+{
+  int64_t thread_id, i, no_of_entries = 0, count = 0;
+  j_blue_map_entry_t *entries;
+  for (thread_id = 0; thread_id < no_of_threads; thread_id++)
+    {
+      if (thread_storages[thread_id].line_lists_j_blues_map != NULL)
+	{
+	  no_of_entries += thread_storages[thread_id].line_lists_j_blues_map->count;
+	}
+    }
+  entries = (j_blue_map_entry_t *) malloc (sizeof (j_blue_map_entry_t) * (no_of_entries + 1));
+  for (thread_id = 0; thread_id < no_of_threads; thread_id++)
+    {
+      j_blue_map_t *map = thread_storages[thread_id].line_lists_j_blues_map;
+      if (map == NULL)
+	{
+	  continue;
+	}
+      for (i = 0; i < map->capacity; i++)
+	{
+	  if (map->indices[i] != -1)
+	    {
+	      entries[count].index = map->indices[i];
+	      entries[count].thread_id = thread_id;
+	      entries[count].value = map->values[i];
+	      count++;
+	    }
+	}
+      j_blue_map_free (map);
+      free (map);
+      thread_storages[thread_id].line_lists_j_blues_map = NULL;
+    }
+  /* Entries of the same index are summed in thread order, like the dense reduction. */
+  qsort (entries, no_of_entries, sizeof (j_blue_map_entry_t), compare_j_blue_map_entries);
+  storage->line_lists_j_blues_sparse_indices = (int64_t *) malloc (sizeof (int64_t) * (no_of_entries + 1));
+  storage->line_lists_j_blues_sparse_values = (double *) malloc (sizeof (double) * (no_of_entries + 1));
+  count = 0;
+  for (i = 0; i < no_of_entries; i++)
+    {
+      if (count > 0 && storage->line_lists_j_blues_sparse_indices[count - 1] == entries[i].index)
+	{
+	  storage->line_lists_j_blues_sparse_values[count - 1] += entries[i].value;
+	}
+      else
+	{
+	  storage->line_lists_j_blues_sparse_indices[count] = entries[i].index;
+	  storage->line_lists_j_blues_sparse_values[count] = entries[i].value;
+	  count++;
+	}
+    }
+  storage->line_lists_j_blues_sparse_count = count;
+  free (entries);
+}
+
+double
 rpacket_doppler_factor (rpacket_t * packet, storage_model_t * storage)
 {
   return 1.0 -
@@ -143,7 +374,6 @@ bf_cross_section(storage_model_t * storage, int64_t continuum_id, double comov_n
   return sigma_bf * pow((storage->continuum_list_nu[continuum_id] / comov_nu), 3);
 }
 
-INLINE
 void calculate_chi_bf(rpacket_t * packet, storage_model_t * storage)
 {
   double bf_helper = 0;
@@ -158,7 +388,8 @@ void calculate_chi_bf(rpacket_t * packet, storage_model_t * storage)
   doppler_factor = rpacket_doppler_factor (packet, storage);
   comov_nu = rpacket_get_nu (packet) * doppler_factor;
 
-  line_search(storage->continuum_list_nu, comov_nu, no_of_continuum_edges, &current_continuum_id);
+  indexed_line_search(&storage->continuum_list_nu_index, storage->continuum_list_nu,
+		      comov_nu, no_of_continuum_edges, &current_continuum_id);
   rpacket_set_current_continuum_id(packet, current_continuum_id);
 
   shell_id = rpacket_get_current_shell_id(packet);
@@ -179,7 +410,7 @@ void calculate_chi_bf(rpacket_t * packet, storage_model_t * storage)
   rpacket_set_chi_boundfree(packet, bf_helper * doppler_factor);
 }
 
-INLINE double
+double
 compute_distance2boundary (rpacket_t * packet, storage_model_t * storage)
 {
   double r = rpacket_get_r (packet);
@@ -285,7 +516,7 @@ compute_distance2line (rpacket_t * packet, storage_model_t * storage,
   return ret_val;
 }
 
-INLINE void
+void
 compute_distance2continuum(rpacket_t * packet, storage_model_t * storage)
 {
   double chi_boundfree, chi_freefree, chi_electron, chi_continuum, d_continuum;
@@ -309,7 +540,7 @@ compute_distance2continuum(rpacket_t * packet, storage_model_t * storage)
       storage->inverse_sigma_thomson * rpacket_get_tau_event (packet);
   }
 
-  if (packet->virtual_packet > 0)
+  if (rpacket_get_virtual_packet (packet) > 0)
     {
 	  //Set all continuum distances to MISS_DISTANCE in case of an virtual_packet
 	  rpacket_set_d_continuum(packet, MISS_DISTANCE);
@@ -335,34 +566,65 @@ compute_distance2continuum(rpacket_t * packet, storage_model_t * storage)
 	}
 }
 
-INLINE int64_t
-macro_atom (rpacket_t * packet, storage_model_t * storage)
+int64_t
+macro_atom (rpacket_t * packet, storage_model_t * storage, rng_state_t *rng_state)
 {
   int emit = 0, i = 0;
+  int64_t line_id = 0;
   double p, event_random;
   int activate_level =
-    storage->line2macro_level_upper[rpacket_get_next_line_id (packet) - 1];
+    storage->line2macro_level_upper[montecarlo_full_line_id
+				    (storage,
+				     rpacket_get_next_line_id (packet) - 1)];
   while (emit != -1)
     {
-      event_random = rk_double (&mt_state);
-      i = storage->macro_block_references[activate_level] - 1;
-      p = 0.0;
-      do
+      INSTRUMENTATION_COUNT (&storage->counters, macro_atom_jumps);
+      event_random = rng_double (rng_state);
+      if (storage->macro_atom_transitions != NULL)
+	{
+	  // Draw from the alias table of the level with the same random number.
+	  int64_t block_start = storage->macro_block_references[activate_level];
+	  double x = event_random *
+	    (storage->macro_block_references[activate_level + 1] - block_start);
+	  macro_atom_transition_t *transition =
+	    &storage->macro_atom_transitions[rpacket_get_current_shell_id (packet) *
+					     storage->transition_probabilities_nd +
+					     block_start + (int64_t) x];
+	  if (x - (int64_t) x < transition->alias_probability)
+	    {
+	      emit = transition->transition_type;
+	      activate_level = transition->destination_level_id;
+	      line_id = transition->transition_line_id;
+	    }
+	  else
+	    {
+	      emit = transition->alias_transition_type;
+	      activate_level = transition->alias_destination_level_id;
+	      line_id = transition->alias_transition_line_id;
+	    }
+	}
+      else
 	{
-	  p +=
-	    storage->
-	    transition_probabilities[rpacket_get_current_shell_id (packet) *
-				     storage->transition_probabilities_nd +
-				     (++i)];
+	  i = storage->macro_block_references[activate_level] - 1;
+	  p = 0.0;
+	  do
+	    {
+	      p +=
+		storage->
+		transition_probabilities[rpacket_get_current_shell_id (packet) *
+					 storage->transition_probabilities_nd +
+					 (++i)];
+	    }
+	  while (p <= event_random);
+	  emit = storage->transition_type[i];
+	  activate_level = storage->destination_level_id[i];
+	  line_id = storage->transition_line_id[i];
 	}
-      while (p <= event_random);
-      emit = storage->transition_type[i];
-      activate_level = storage->destination_level_id[i];
     }
-  return storage->transition_line_id[i];
+  return line_id;
 }
 
-INLINE double
+double
 move_packet (rpacket_t * packet, storage_model_t * storage, double distance)
 {
   double new_r, doppler_factor, comov_energy, comov_nu;
@@ -380,22 +642,41 @@ move_packet (rpacket_t * packet, storage_model_t * storage, double distance)
 	{
 	  comov_energy = rpacket_get_energy (packet) * doppler_factor;
 	  comov_nu = rpacket_get_nu (packet) * doppler_factor;
+	  if (storage->thread_private_estimators)
+	    {
+	      storage->js[rpacket_get_current_shell_id (packet)] +=
+		comov_energy * distance;
+	      storage->nubars[rpacket_get_current_shell_id (packet)] +=
+		comov_energy * distance * comov_nu;
+	    }
+	  else
+	    {
 #ifdef WITHOPENMP
 #pragma omp atomic
 #endif
-	  storage->js[rpacket_get_current_shell_id (packet)] +=
-	    comov_energy * distance;
+	      storage->js[rpacket_get_current_shell_id (packet)] +=
+		comov_energy * distance;
 #ifdef WITHOPENMP
 #pragma omp atomic
 #endif
-	  storage->nubars[rpacket_get_current_shell_id (packet)] +=
-	    comov_energy * distance * comov_nu;
+	      storage->nubars[rpacket_get_current_shell_id (packet)] +=
+		comov_energy * distance * comov_nu;
+	    }
 	}
     }
   return doppler_factor;
 }
 
-INLINE void
+void
+kahan_add (float *sum, float *compensation, double value)
+{
+  float y = (float) value - *compensation;
+  float t = *sum + y;
+  *compensation = (t - *sum) - y;
+  *sum = t;
+}
+
+void
 increment_j_blue_estimator (rpacket_t * packet, storage_model_t * storage,
 			    double d_line, int64_t j_blue_idx)
 {
@@ -408,16 +689,212 @@ increment_j_blue_estimator (rpacket_t * packet, storage_model_t * storage,
   doppler_factor = 1.0 - mu_interaction * r_interaction *
     storage->inverse_time_explosion * INVERSE_C;
   comov_energy = rpacket_get_energy (packet) * doppler_factor;
+  if (storage->line_lists_j_blues_map != NULL)
+    {
+      j_blue_map_add (storage->line_lists_j_blues_map, j_blue_idx,
+		      comov_energy / rpacket_get_nu (packet));
+    }
+  else if (storage->line_lists_j_blues_blocks != NULL)
+    {
+      int64_t block_id = j_blue_idx >> J_BLUE_BLOCK_SHIFT;
+      if (storage->line_lists_j_blues_blocks[block_id] == NULL)
+	{
+	  storage->line_lists_j_blues_blocks[block_id] =
+	    (double *) calloc (J_BLUE_BLOCK_SIZE, sizeof (double));
+	}
+      if (storage->line_lists_j_blues_compact != NULL)
+	{
+	  /*
+	     A compact block holds a single precision sum and its
+	     compensation in place of every double.
+	   */
+	  float *entry = (float *) storage->line_lists_j_blues_blocks[block_id] +
+	    2 * (j_blue_idx & (J_BLUE_BLOCK_SIZE - 1));
+	  kahan_add (entry, entry + 1, comov_energy / rpacket_get_nu (packet));
+	}
+      else
+	{
+	  storage->line_lists_j_blues_blocks[block_id][j_blue_idx &
+						       (J_BLUE_BLOCK_SIZE - 1)] +=
+	    comov_energy / rpacket_get_nu (packet);
+	}
+    }
+  else
+    {
 #ifdef WITHOPENMP
 #pragma omp atomic
 #endif
-  storage->line_lists_j_blues[j_blue_idx] +=
-    comov_energy / rpacket_get_nu (packet);
+      storage->line_lists_j_blues[j_blue_idx] +=
+	comov_energy / rpacket_get_nu (packet);
+    }
+}
+
+void
+montecarlo_store_virtual_packet (storage_model_t * storage, rpacket_t * packet,
+				 rpacket_t * virt_packet, double weight)
+{
+  int64_t virt_id_nu;
+  virt_packet_chunk_t *chunk = storage->virt_packet_chunks_tail;
+  virt_id_nu =
+    floor ((virt_packet->nu -
+	    storage->spectrum_start_nu) /
+	   storage->spectrum_delta_nu);
+  storage->spectrum_virt_nu[virt_id_nu] += virt_packet->energy * weight;
+  if (storage->packet_block_size > 0)
+    {
+      /* Streaming runs only keep the virtual spectrum, whose size does not grow with the packets. */
+      return;
+    }
+  if (chunk == NULL || chunk->count == VIRT_PACKET_CHUNK_SIZE)
+    {
+      /* Start a new chunk instead of growing (and copying) the existing ones. */
+      chunk = (virt_packet_chunk_t *) malloc (sizeof (virt_packet_chunk_t));
+      chunk->count = 0;
+      chunk->next = NULL;
+      if (storage->virt_packet_chunks_tail == NULL)
+	{
+	  storage->virt_packet_chunks = chunk;
+	}
+      else
+	{
+	  storage->virt_packet_chunks_tail->next = chunk;
+	}
+      storage->virt_packet_chunks_tail = chunk;
+    }
+  chunk->nus[chunk->count] = virt_packet->nu;
+  chunk->energies[chunk->count] = virt_packet->energy * weight;
+  chunk->last_interaction_in_nu[chunk->count] = storage->last_interaction_in_nu[rpacket_get_id (packet)];
+  chunk->last_interaction_type[chunk->count] = storage->last_interaction_type[rpacket_get_id (packet)];
+  chunk->last_line_interaction_in_id[chunk->count] = storage->last_line_interaction_in_id[rpacket_get_id (packet)];
+  chunk->last_line_interaction_out_id[chunk->count] = storage->last_line_interaction_out_id[rpacket_get_id (packet)];
+  chunk->count += 1;
+  storage->virt_packet_count += 1;
+}
+
+int64_t
+montecarlo_kernel_variant (const storage_model_t * storage)
+{
+  int64_t variant = 0;
+  if (storage->line_interaction_id >= 1)
+    {
+      variant |= KERNEL_VARIANT_MACRO_ATOM;
+    }
+  if (storage->cont_status == CONTINUUM_ON)
+    {
+      variant |= KERNEL_VARIANT_CONTINUUM;
+    }
+  if (storage->reflective_inner_boundary)
+    {
+      variant |= KERNEL_VARIANT_REFLECTIVE_INNER_BOUNDARY;
+    }
+  return variant;
+}
+
+/** Kernel variant of the settings of storage for a packet, used by the
+ * event handlers that are called outside of the specialized packet loops.
+ *
+ * @param storage storage model data
+ * @param packet real or virtual packet
+ *
+ * @return kernel variant including KERNEL_VARIANT_VIRTUAL_PACKET
+ */
+static inline int64_t
+montecarlo_packet_variant (const storage_model_t * storage,
+			   rpacket_t * packet)
+{
+  return montecarlo_kernel_variant (storage) |
+    (rpacket_get_virtual_packet (packet) > 0 ? KERNEL_VARIANT_VIRTUAL_PACKET : 0);
+}
+
+int64_t
+montecarlo_full_line_id (const storage_model_t * storage, int64_t line_id)
+{
+  return storage->line_list_full_ids != NULL ?
+    storage->line_list_full_ids[line_id] : line_id;
+}
+
+int64_t
+montecarlo_tracking_slot (const storage_model_t * storage, rpacket_t * packet)
+{
+  int64_t packet_index = rpacket_get_id (packet);
+  if (storage->packet_tracking_stride == 1)
+    {
+      return packet_index;
+    }
+  if (storage->packet_tracking_stride == 0 ||
+      packet_index % storage->packet_tracking_stride != 0)
+    {
+      return -1;
+    }
+  return packet_index / storage->packet_tracking_stride;
+}
+
+void
+montecarlo_record_packet (storage_model_t * storage, rpacket_t * packet,
+			  bool reabsorbed)
+{
+  int64_t tracking_slot = montecarlo_tracking_slot (storage, packet);
+  double nu = rpacket_get_nu (packet);
+  double energy = rpacket_get_energy (packet);
+  INSTRUMENTATION_COUNT (&storage->counters, packets);
+  storage->no_of_emitted_packets += !reabsorbed;
+  if (tracking_slot >= 0)
+    {
+      storage->output_nus[tracking_slot] = nu;
+      storage->output_energies[tracking_slot] = reabsorbed ? -energy : energy;
+    }
+  if (storage->spectrum_emitted_nu != NULL)
+    {
+      double *spectrum = reabsorbed ? storage->spectrum_reabsorbed_nu :
+	storage->spectrum_emitted_nu;
+      int64_t nu_bin = floor ((nu - storage->spectrum_start_nu) /
+			      storage->spectrum_delta_nu);
+      /* The last bin includes its upper edge, like in numpy.histogram. */
+      if (nu == storage->spectrum_end_nu)
+	{
+	  nu_bin = storage->spectrum_nu_size - 1;
+	}
+      if (nu_bin >= 0 && nu_bin < storage->spectrum_nu_size)
+	{
+	  spectrum[nu_bin] += energy;
+	}
+      if (nu > storage->luminosity_nu_start && nu < storage->luminosity_nu_end)
+	{
+	  if (reabsorbed)
+	    {
+	      storage->luminosity_reabsorbed_energy += energy;
+	    }
+	  else
+	    {
+	      storage->luminosity_emitted_energy += energy;
+	    }
+	}
+    }
+}
+
+void
+montecarlo_collect_virtual_packets (storage_model_t * storage,
+				    virt_packet_chunk_t * chunk)
+{
+  while (chunk != NULL)
+    {
+      virt_packet_chunk_t *next = chunk->next;
+      int64_t offset = storage->virt_packet_count;
+      memcpy (storage->virt_packet_nus + offset, chunk->nus, sizeof (double) * chunk->count);
+      memcpy (storage->virt_packet_energies + offset, chunk->energies, sizeof (double) * chunk->count);
+      memcpy (storage->virt_last_interaction_in_nu + offset, chunk->last_interaction_in_nu, sizeof (double) * chunk->count);
+      memcpy (storage->virt_last_interaction_type + offset, chunk->last_interaction_type, sizeof (int64_t) * chunk->count);
+      memcpy (storage->virt_last_line_interaction_in_id + offset, chunk->last_line_interaction_in_id, sizeof (int64_t) * chunk->count);
+      memcpy (storage->virt_last_line_interaction_out_id + offset, chunk->last_line_interaction_out_id, sizeof (int64_t) * chunk->count);
+      storage->virt_packet_count += chunk->count;
+      free (chunk);
+      chunk = next;
+    }
 }
 
 int64_t
 montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
-		       int64_t virtual_mode)
+		       int64_t virtual_mode, rng_state_t *rng_state)
 {
   int64_t i;
   rpacket_t virt_packet;
@@ -425,11 +902,10 @@ montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
   double mu_min;
   double doppler_factor_ratio;
   double weight;
-  int64_t virt_id_nu;
   int64_t reabsorbed;
   if (virtual_mode == 0)
     {
-      reabsorbed = montecarlo_one_packet_loop (storage, packet, 0);
+      reabsorbed = montecarlo_one_packet_loop (storage, packet, 0, rng_state);
     }
   else
     {
@@ -437,7 +913,28 @@ montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
 	{
 	  for (i = 0; i < rpacket_get_virtual_packet_flag (packet); i++)
 	    {
-	      memcpy ((void *) &virt_packet, (void *) packet, sizeof (rpacket_t));
+	      INSTRUMENTATION_COUNT (&storage->counters, virtual_packets);
+	      /* The virtual packet recomputes its distances and opacities,
+	         except at a close line where it keeps those of the packet. */
+	      memcpy ((void *) &virt_packet, (void *) packet,
+		      RPACKET_CORE_SIZE);
+	      rpacket_set_id (&virt_packet, rpacket_get_id (packet));
+	      rpacket_set_virtual_packet_flag (&virt_packet,
+					       rpacket_get_virtual_packet_flag
+					       (packet));
+	      if (rpacket_get_close_line (packet))
+		{
+		  rpacket_set_d_boundary (&virt_packet,
+					  rpacket_get_d_boundary (packet));
+		  rpacket_set_d_continuum (&virt_packet,
+					   rpacket_get_d_continuum (packet));
+		  rpacket_set_chi_continuum (&virt_packet,
+					     rpacket_get_chi_continuum (packet));
+		}
+	      if (storage->cont_status == CONTINUUM_ON)
+		{
+		  virt_packet.continuum = packet->continuum;
+		}
 	      if (virt_packet.r > storage->r_inner[0])
 		{
 		  mu_min =
@@ -450,7 +947,7 @@ montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
 		  mu_min = 0.0;
 		}
 	      mu_bin = (1.0 - mu_min) / rpacket_get_virtual_packet_flag (packet);
-	      virt_packet.mu = mu_min + (i + rk_double (&mt_state)) * mu_bin;
+	      virt_packet.mu = mu_min + (i + rng_double (rng_state)) * mu_bin;
 	      switch (virtual_mode)
 		{
 		case -2:
@@ -475,41 +972,12 @@ montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
 	      virt_packet.energy =
 		rpacket_get_energy (packet) * doppler_factor_ratio;
 	      virt_packet.nu = rpacket_get_nu (packet) * doppler_factor_ratio;
-	      reabsorbed = montecarlo_one_packet_loop (storage, &virt_packet, 1);
+	      reabsorbed = montecarlo_one_packet_loop (storage, &virt_packet, 1, rng_state);
 	      if ((virt_packet.nu < storage->spectrum_end_nu) &&
 		  (virt_packet.nu > storage->spectrum_start_nu))
 		{
-#ifdef WITHOPENMP
-#pragma omp critical
-		  {
-#endif
-		    if (storage->virt_packet_count >= storage->virt_array_size)
-		      {
-			storage->virt_array_size *= 2;
-			storage->virt_packet_nus = realloc(storage->virt_packet_nus, sizeof(double) * storage->virt_array_size);
-			storage->virt_packet_energies = realloc(storage->virt_packet_energies, sizeof(double) * storage->virt_array_size);
-			storage->virt_last_interaction_in_nu = realloc(storage->virt_last_interaction_in_nu, sizeof(double) * storage->virt_array_size);
-      storage->virt_last_interaction_type = realloc(storage->virt_last_interaction_type, sizeof(int64_t) * storage->virt_array_size);
-      storage->virt_last_line_interaction_in_id = realloc(storage->virt_last_line_interaction_in_id, sizeof(int64_t) * storage->virt_array_size);
-      storage->virt_last_line_interaction_out_id = realloc(storage->virt_last_line_interaction_out_id, sizeof(int64_t) * storage->virt_array_size);
-		      }
-		    storage->virt_packet_nus[storage->virt_packet_count] = virt_packet.nu;
-		    storage->virt_packet_energies[storage->virt_packet_count] = virt_packet.energy * weight;
-        storage->virt_last_interaction_in_nu[storage->virt_packet_count] = storage->last_interaction_in_nu[rpacket_get_id (packet)];
-        storage->virt_last_interaction_type[storage->virt_packet_count] = storage->last_interaction_type[rpacket_get_id (packet)];
-        storage->virt_last_line_interaction_in_id[storage->virt_packet_count] = storage->last_line_interaction_in_id[rpacket_get_id (packet)];
-        storage->virt_last_line_interaction_out_id[storage->virt_packet_count] = storage->last_line_interaction_out_id[rpacket_get_id (packet)];
-
-		    storage->virt_packet_count += 1;
-		    virt_id_nu =
-		      floor ((virt_packet.nu -
-			      storage->spectrum_start_nu) /
-			     storage->spectrum_delta_nu);
-		    storage->spectrum_virt_nu[virt_id_nu] +=
-		      virt_packet.energy * weight;
-#ifdef WITHOPENMP
-		  }
-#endif
+		  montecarlo_store_virtual_packet (storage, packet,
+						   &virt_packet, weight);
 		}
 	    }
 	}
@@ -521,13 +989,16 @@ montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
   return reabsorbed;
 }
 
-void
-move_packet_across_shell_boundary (rpacket_t * packet,
-				   storage_model_t * storage, double distance)
+static ALWAYS_INLINE void
+move_packet_across_shell_boundary_variant (rpacket_t * packet,
+					   storage_model_t * storage,
+					   double distance,
+					   rng_state_t *rng_state,
+					   const int64_t variant)
 {
   double comov_energy, doppler_factor, comov_nu, inverse_doppler_factor;
   move_packet (packet, storage, distance);
-  if (rpacket_get_virtual_packet (packet) > 0)
+  if (variant & KERNEL_VARIANT_VIRTUAL_PACKET)
     {
       double delta_tau_event = rpacket_get_chi_continuum(packet) * distance;
       rpacket_set_tau_event (packet,
@@ -536,7 +1007,7 @@ move_packet_across_shell_boundary (rpacket_t * packet,
     }
   else
     {
-      rpacket_reset_tau_event (packet);
+      rpacket_reset_tau_event (packet, rng_state);
     }
   if ((rpacket_get_current_shell_id (packet) < storage->no_of_shells - 1
        && rpacket_get_next_shell_id (packet) == 1)
@@ -554,8 +1025,8 @@ move_packet_across_shell_boundary (rpacket_t * packet,
     {
       rpacket_set_status (packet, TARDIS_PACKET_STATUS_EMITTED);
     }
-  else if ((storage->reflective_inner_boundary == 0) ||
-	   (rk_double (&mt_state) > storage->inner_boundary_albedo))
+  else if (!(variant & KERNEL_VARIANT_REFLECTIVE_INNER_BOUNDARY) ||
+	   (rng_double (rng_state) > storage->inner_boundary_albedo))
     {
       rpacket_set_status (packet, TARDIS_PACKET_STATUS_REABSORBED);
     }
@@ -564,41 +1035,57 @@ move_packet_across_shell_boundary (rpacket_t * packet,
       doppler_factor = rpacket_doppler_factor (packet, storage);
       comov_nu = rpacket_get_nu (packet) * doppler_factor;
       comov_energy = rpacket_get_energy (packet) * doppler_factor;
-      rpacket_set_mu (packet, rk_double (&mt_state));
+      rpacket_set_mu (packet, rng_double (rng_state));
       inverse_doppler_factor = 1.0 / rpacket_doppler_factor (packet, storage);
       rpacket_set_nu (packet, comov_nu * inverse_doppler_factor);
       rpacket_set_energy (packet, comov_energy * inverse_doppler_factor);
       rpacket_set_recently_crossed_boundary (packet, 1);
       if (rpacket_get_virtual_packet_flag (packet) > 0)
 	{
-	  montecarlo_one_packet (storage, packet, -2);
+	  montecarlo_one_packet (storage, packet, -2, rng_state);
 	}
     }
 }
 
+void
+move_packet_across_shell_boundary (rpacket_t * packet,
+				   storage_model_t * storage, double distance,
+				   rng_state_t *rng_state)
+{
+  move_packet_across_shell_boundary_variant (packet, storage, distance,
+					     rng_state,
+					     montecarlo_packet_variant (storage,
+									packet));
+}
+
 void
 montecarlo_thomson_scatter (rpacket_t * packet, storage_model_t * storage,
-			    double distance)
+			    double distance, rng_state_t *rng_state)
 {
   double comov_energy, doppler_factor, comov_nu, inverse_doppler_factor;
+  int64_t tracking_slot;
   doppler_factor = move_packet (packet, storage, distance);
   comov_nu = rpacket_get_nu (packet) * doppler_factor;
   comov_energy = rpacket_get_energy (packet) * doppler_factor;
-  rpacket_set_mu (packet, 2.0 * rk_double (&mt_state) - 1.0);
+  rpacket_set_mu (packet, 2.0 * rng_double (rng_state) - 1.0);
   inverse_doppler_factor = 1.0 / rpacket_doppler_factor (packet, storage);
   rpacket_set_nu (packet, comov_nu * inverse_doppler_factor);
   rpacket_set_energy (packet, comov_energy * inverse_doppler_factor);
-  rpacket_reset_tau_event (packet);
+  rpacket_reset_tau_event (packet, rng_state);
   rpacket_set_recently_crossed_boundary (packet, 0);
-  storage->last_interaction_type[rpacket_get_id (packet)] = 1;
+  tracking_slot = montecarlo_tracking_slot (storage, packet);
+  if (tracking_slot >= 0)
+    {
+      storage->last_interaction_type[tracking_slot] = 1;
+    }
   if (rpacket_get_virtual_packet_flag (packet) > 0)
     {
-      montecarlo_one_packet (storage, packet, 1);
+      montecarlo_one_packet (storage, packet, 1, rng_state);
     }
 }
 
 void
-montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance)
+montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance, rng_state_t *rng_state)
 {
   /* current position in list of continuum edges -> indicates which bound-free processes are possible */
   int64_t current_continuum_id = rpacket_get_current_continuum_id(packet);
@@ -609,7 +1096,7 @@ montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, do
   nu = rpacket_get_nu(packet);
   chi_bf = rpacket_get_chi_boundfree(packet);
   // get new zrand
-  zrand = (rk_double(&mt_state));
+  zrand = (rng_double (rng_state));
   zrand_x_chibf = zrand * chi_bf;
 
   ccontinuum = current_continuum_id;
@@ -625,7 +1112,7 @@ montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, do
 //      ccontinuum = current_continuum_id;
 //   }
 
-  zrand = (rk_double(&mt_state));
+  zrand = (rng_double (rng_state));
   if (zrand < storage->continuum_list_nu[ccontinuum] / nu)
   {
 	// go to ionization energy
@@ -640,18 +1127,21 @@ montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, do
 }
 
 void
-montecarlo_free_free_scatter(rpacket_t * packet, storage_model_t * storage, double distance)
+montecarlo_free_free_scatter(rpacket_t * packet, storage_model_t * storage, double distance, rng_state_t *rng_state)
 {
   rpacket_set_status (packet, TARDIS_PACKET_STATUS_REABSORBED);
 }
 
 
-void
-montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
-			 double distance)
+static ALWAYS_INLINE void
+montecarlo_line_scatter_variant (rpacket_t * packet,
+				 storage_model_t * storage, double distance,
+				 rng_state_t *rng_state, const int64_t variant)
 {
   double comov_energy = 0.0;
   int64_t emission_line_id = 0;
+  int64_t next_line_id = 0;
+  double emission_nu = 0.0;
   double old_doppler_factor = 0.0;
   double inverse_doppler_factor = 0.0;
   double tau_line = 0.0;
@@ -659,17 +1149,28 @@ montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
   double tau_combined = 0.0;
   bool virtual_close_line = false;
   int64_t j_blue_idx = -1;
-  if (rpacket_get_virtual_packet (packet) == 0)
+  int64_t tracking_slot;
+  if (!(variant & KERNEL_VARIANT_VIRTUAL_PACKET))
     {
       j_blue_idx =
 	rpacket_get_current_shell_id (packet) *
 	storage->line_lists_j_blues_nd + rpacket_get_next_line_id (packet);
       increment_j_blue_estimator (packet, storage, distance, j_blue_idx);
     }
-  tau_line =
-    storage->line_lists_tau_sobolevs[rpacket_get_current_shell_id (packet) *
-				     storage->line_lists_tau_sobolevs_nd +
-				     rpacket_get_next_line_id (packet)];
+  if (storage->line_lists_tau_sobolevs_compact != NULL)
+    {
+      tau_line =
+	storage->line_lists_tau_sobolevs_compact[rpacket_get_current_shell_id (packet) *
+						 storage->line_lists_tau_sobolevs_nd +
+						 rpacket_get_next_line_id (packet)];
+    }
+  else
+    {
+      tau_line =
+	storage->line_lists_tau_sobolevs[rpacket_get_current_shell_id (packet) *
+					 storage->line_lists_tau_sobolevs_nd +
+					 rpacket_get_next_line_id (packet)];
+    }
   tau_continuum = rpacket_get_chi_continuum(packet) * distance;
   tau_combined = tau_line + tau_continuum;
   rpacket_set_next_line_id (packet, rpacket_get_next_line_id (packet) + 1);
@@ -677,56 +1178,84 @@ montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
     {
       rpacket_set_last_line (packet, true);
     }
-  if (rpacket_get_virtual_packet (packet) > 0)
+  if (variant & KERNEL_VARIANT_VIRTUAL_PACKET)
     {
       rpacket_set_tau_event (packet,
 			     rpacket_get_tau_event (packet) + tau_line);
+      if (storage->line_lists_tau_cumulative != NULL &&
+	  !rpacket_get_last_line (packet) &&
+	  rpacket_get_tau_event (packet) <= VIRTUAL_PACKET_TAU_LIMIT)
+	{
+	  montecarlo_skip_lines (packet, storage);
+	}
     }
   else if (rpacket_get_tau_event (packet) < tau_combined)
     {
       old_doppler_factor = move_packet (packet, storage, distance);
-      rpacket_set_mu (packet, 2.0 * rk_double (&mt_state) - 1.0);
+      rpacket_set_mu (packet, 2.0 * rng_double (rng_state) - 1.0);
       inverse_doppler_factor = 1.0 / rpacket_doppler_factor (packet, storage);
       comov_energy = rpacket_get_energy (packet) * old_doppler_factor;
       rpacket_set_energy (packet, comov_energy * inverse_doppler_factor);
-      storage->last_interaction_in_nu[rpacket_get_id (packet)] =
-  rpacket_get_nu (packet);
-      storage->last_line_interaction_in_id[rpacket_get_id (packet)] =
-	rpacket_get_next_line_id (packet) - 1;
-      storage->last_line_interaction_shell_id[rpacket_get_id (packet)] =
-	rpacket_get_current_shell_id (packet);
-      storage->last_interaction_type[rpacket_get_id (packet)] = 2;
-      if (storage->line_interaction_id == 0)
-	{
-	  emission_line_id = rpacket_get_next_line_id (packet) - 1;
-	}
-      else if (storage->line_interaction_id >= 1)
-	{
-	  emission_line_id = macro_atom (packet, storage);
-	}
-      storage->last_line_interaction_out_id[rpacket_get_id (packet)] =
-	emission_line_id;
-      rpacket_set_nu (packet,
-		      storage->line_list_nu[emission_line_id] *
-		      inverse_doppler_factor);
-      rpacket_set_nu_line (packet, storage->line_list_nu[emission_line_id]);
-      rpacket_set_next_line_id (packet, emission_line_id + 1);
-      rpacket_reset_tau_event (packet);
-      rpacket_set_recently_crossed_boundary (packet, 0);
-      if (rpacket_get_virtual_packet_flag (packet) > 0)
+      tracking_slot = montecarlo_tracking_slot (storage, packet);
+      if (tracking_slot >= 0)
 	{
-	  virtual_close_line = false;
-	  if (!rpacket_get_last_line (packet) &&
-	      fabs (storage->line_list_nu[rpacket_get_next_line_id (packet)] -
-		    rpacket_get_nu_line (packet)) /
-	      rpacket_get_nu_line (packet) < 1e-7)
-	    {
-	      virtual_close_line = true;
-	    }
-	  // QUESTIONABLE!!!
-	  bool old_close_line = rpacket_get_close_line (packet);
+	  storage->last_interaction_in_nu[tracking_slot] = rpacket_get_nu (packet);
+	  storage->last_line_interaction_in_id[tracking_slot] =
+	    montecarlo_full_line_id (storage,
+				     rpacket_get_next_line_id (packet) - 1);
+	  storage->last_line_interaction_shell_id[tracking_slot] =
+	    rpacket_get_current_shell_id (packet);
+	  storage->last_interaction_type[tracking_slot] = 2;
+	}
+      // The macro atom emits in the line list of the atomic data, which
+      // contains the culled lines as well.
+      if (!(variant & KERNEL_VARIANT_MACRO_ATOM))
+	{
+	  emission_line_id =
+	    montecarlo_full_line_id (storage,
+				     rpacket_get_next_line_id (packet) - 1);
+	}
+      else
+	{
+	  emission_line_id = macro_atom (packet, storage, rng_state);
+	}
+      if (tracking_slot >= 0)
+	{
+	  storage->last_line_interaction_out_id[tracking_slot] = emission_line_id;
+	}
+      if (storage->line_list_full_ids != NULL)
+	{
+	  emission_nu = storage->line_list_full_nu[emission_line_id];
+	  next_line_id = storage->line_list_full_next[emission_line_id];
+	}
+      else
+	{
+	  emission_nu = storage->line_list_nu[emission_line_id];
+	  next_line_id = emission_line_id + 1;
+	}
+      rpacket_set_nu (packet, emission_nu * inverse_doppler_factor);
+      rpacket_set_nu_line (packet, emission_nu);
+      rpacket_set_next_line_id (packet, next_line_id);
+      if (next_line_id == storage->no_of_lines)
+	{
+	  rpacket_set_last_line (packet, true);
+	}
+      rpacket_reset_tau_event (packet, rng_state);
+      rpacket_set_recently_crossed_boundary (packet, 0);
+      if (rpacket_get_virtual_packet_flag (packet) > 0)
+	{
+	  virtual_close_line = false;
+	  if (!rpacket_get_last_line (packet) &&
+	      fabs (storage->line_list_nu[rpacket_get_next_line_id (packet)] -
+		    rpacket_get_nu_line (packet)) /
+	      rpacket_get_nu_line (packet) < 1e-7)
+	    {
+	      virtual_close_line = true;
+	    }
+	  // QUESTIONABLE!!!
+	  bool old_close_line = rpacket_get_close_line (packet);
 	  rpacket_set_close_line (packet, virtual_close_line);
-	  montecarlo_one_packet (storage, packet, 1);
+	  montecarlo_one_packet (storage, packet, 1, rng_state);
 	  rpacket_set_close_line (packet, old_close_line);
 	  virtual_close_line = false;
 	}
@@ -735,6 +1264,11 @@ montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
     {
       rpacket_set_tau_event (packet,
 			     rpacket_get_tau_event (packet) - tau_line);
+      if (storage->line_lists_tau_cumulative != NULL &&
+	  !rpacket_get_last_line (packet))
+	{
+	  montecarlo_skip_lines (packet, storage);
+	}
     }
   if (!rpacket_get_last_line (packet) &&
       fabs (storage->line_list_nu[rpacket_get_next_line_id (packet)] -
@@ -745,7 +1279,193 @@ montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
     }
 }
 
-INLINE void
+void
+montecarlo_line_scatter (rpacket_t * packet, storage_model_t * storage,
+			 double distance, rng_state_t *rng_state)
+{
+  montecarlo_line_scatter_variant (packet, storage, distance, rng_state,
+				   montecarlo_packet_variant (storage, packet));
+}
+
+/** Distance of a packet to a line it has not passed yet.
+ *
+ * @param storage storage model data
+ * @param line_id the line
+ * @param comov_nu comoving frequency of the packet at its position
+ * @param nu frequency of the packet
+ *
+ * @return distance to the line, 0 for a line the packet is already redward of
+ */
+static inline double
+montecarlo_line_distance (storage_model_t * storage, int64_t line_id,
+			  double comov_nu, double nu)
+{
+  double d_line = ((comov_nu - storage->line_list_nu[line_id]) / nu) *
+    C * storage->time_explosion;
+  return d_line > 0.0 ? d_line : 0.0;
+}
+
+/** Check whether a line is a close line, which the packet loop reaches at
+ * distance 0 right after the line before it.
+ *
+ * @param storage storage model data
+ * @param line_id the line, not the first one
+ *
+ * @return true if the line is a close line
+ */
+static inline bool
+montecarlo_close_line (storage_model_t * storage, int64_t line_id)
+{
+  return fabs (storage->line_list_nu[line_id] - storage->line_list_nu[line_id - 1]) /
+    storage->line_list_nu[line_id - 1] < 1e-7;
+}
+
+/** Find the first line at or after a given one that a packet does not pass,
+ * taking every line at its distance from the packet.
+ *
+ * The lines are sorted by decreasing frequency, so distance and cumulative
+ * tau grow along them and the packet passes all lines up to the first one
+ * it stops at. The search gallops to bracket that line, then bisects.
+ *
+ * @param storage storage model data
+ * @param line_id first line to check
+ * @param comov_nu comoving frequency of the packet at its position
+ * @param nu frequency of the packet
+ * @param d_boundary distance of the packet to its shell boundary
+ * @param chi_continuum continuum opacity at the packet's position
+ * @param tau_limit tau_event of the packet plus the cumulative tau_sobolev
+ *        before the first line it passes
+ * @param tau_cumulative cumulative tau_sobolevs of the shell
+ *
+ * @return the first line the packet does not pass, no_of_lines if it passes all
+ */
+static int64_t
+montecarlo_search_stopping_line (storage_model_t * storage, int64_t line_id,
+				 double comov_nu, double nu, double d_boundary,
+				 double chi_continuum, double tau_limit,
+				 const double *tau_cumulative)
+{
+  int64_t low = line_id;
+  int64_t high = line_id;
+  int64_t step = 1;
+  for (;;)
+    {
+      double d_line;
+      if (high >= storage->no_of_lines)
+	{
+	  high = storage->no_of_lines;
+	  break;
+	}
+      d_line = montecarlo_line_distance (storage, high, comov_nu, nu);
+      if (d_line > d_boundary ||
+	  chi_continuum * d_line + tau_cumulative[high + 1] > tau_limit)
+	{
+	  break;
+	}
+      low = high + 1;
+      high += step;
+      step *= 2;
+    }
+  while (low < high)
+    {
+      int64_t middle = low + (high - low) / 2;
+      double d_line = montecarlo_line_distance (storage, middle, comov_nu, nu);
+      if (d_line > d_boundary ||
+	  chi_continuum * d_line + tau_cumulative[middle + 1] > tau_limit)
+	{
+	  high = middle;
+	}
+      else
+	{
+	  low = middle + 1;
+	}
+    }
+  return low;
+}
+
+void
+montecarlo_skip_lines (rpacket_t * packet, storage_model_t * storage)
+{
+  int64_t shell_id = rpacket_get_current_shell_id (packet);
+  int64_t first_line = rpacket_get_next_line_id (packet);
+  int64_t stopping_line = first_line;
+  int64_t line_id;
+  double nu = rpacket_get_nu (packet);
+  double comov_nu = nu * rpacket_doppler_factor (packet, storage);
+  double d_boundary, chi_continuum, tau_limit;
+  double tau_event = rpacket_get_tau_event (packet);
+  bool virtual_packet = rpacket_get_virtual_packet (packet) > 0;
+  const double *tau_cumulative = storage->line_lists_tau_cumulative +
+    shell_id * (storage->line_lists_tau_sobolevs_nd + 1);
+  /* A close line leaves the distances of the packet from before its last
+     interaction, recompute them at its position like the next event would. */
+  rpacket_set_d_boundary (packet, compute_distance2boundary (packet, storage));
+  compute_distance2continuum (packet, storage);
+  d_boundary = rpacket_get_d_boundary (packet);
+  /*
+     A real packet passes a line if it reaches it before its shell boundary
+     and its continuum event and tau_event is left over after the line:
+     chi_continuum * d_line + tau_sobolev <= tau_event. A virtual packet
+     passes a line before its shell boundary if its tau_event stays within
+     VIRTUAL_PACKET_TAU_LIMIT. The packet loop takes close lines at distance
+     0, so they can pass where the search stops; the search continues after
+     them.
+   */
+  if (virtual_packet)
+    {
+      chi_continuum = 0.0;
+      tau_limit = (VIRTUAL_PACKET_TAU_LIMIT - tau_event) + tau_cumulative[first_line];
+    }
+  else
+    {
+      chi_continuum = rpacket_get_chi_continuum (packet);
+      tau_limit = tau_event + tau_cumulative[first_line];
+    }
+  for (;;)
+    {
+      stopping_line = montecarlo_search_stopping_line (storage, stopping_line, comov_nu,
+						       nu, d_boundary, chi_continuum,
+						       tau_limit, tau_cumulative);
+      if (stopping_line == storage->no_of_lines ||
+	  !montecarlo_close_line (storage, stopping_line) ||
+	  tau_cumulative[stopping_line + 1] > tau_limit)
+	{
+	  break;
+	}
+      stopping_line++;
+    }
+  if (stopping_line == first_line)
+    {
+      return;
+    }
+  for (line_id = first_line; line_id < stopping_line; line_id++)
+    {
+      double tau_line = storage->line_lists_tau_sobolevs_compact != NULL ?
+	storage->line_lists_tau_sobolevs_compact[shell_id * storage->line_lists_tau_sobolevs_nd + line_id] :
+	storage->line_lists_tau_sobolevs[shell_id * storage->line_lists_tau_sobolevs_nd + line_id];
+      if (virtual_packet)
+	{
+	  tau_event += tau_line;
+	}
+      else
+	{
+	  double d_line = montecarlo_close_line (storage, line_id) ? 0.0 :
+	    montecarlo_line_distance (storage, line_id, comov_nu, nu);
+	  increment_j_blue_estimator (packet, storage, d_line,
+				      shell_id * storage->line_lists_j_blues_nd + line_id);
+	  tau_event -= tau_line;
+	}
+    }
+  rpacket_set_tau_event (packet, tau_event);
+  rpacket_set_nu_line (packet, storage->line_list_nu[stopping_line - 1]);
+  rpacket_set_next_line_id (packet, stopping_line);
+  if (stopping_line == storage->no_of_lines)
+    {
+      rpacket_set_last_line (packet, true);
+    }
+}
+
+void
 montecarlo_compute_distances (rpacket_t * packet, storage_model_t * storage)
 {
   // Check if the last line was the same nu as the current line.
@@ -769,68 +1489,101 @@ montecarlo_compute_distances (rpacket_t * packet, storage_model_t * storage)
 
 INLINE montecarlo_event_handler_t
 get_event_handler (rpacket_t * packet, storage_model_t * storage,
-		   double *distance)
+		   double *distance, rng_state_t *rng_state)
 {
-  double d_boundary, d_continuum, d_line;
   montecarlo_compute_distances (packet, storage);
+  return montecarlo_select_event_handler (packet, storage, distance, rng_state);
+}
+
+/* Handlers of the event types, in the order of instrumentation_event_t. */
+static const montecarlo_event_handler_t
+  montecarlo_event_handlers[INSTRUMENTATION_NO_OF_EVENTS] = {
+  &montecarlo_line_scatter,
+  &move_packet_across_shell_boundary,
+  &montecarlo_thomson_scatter,
+  &montecarlo_bound_free_scatter,
+  &montecarlo_free_free_scatter
+};
+
+static ALWAYS_INLINE instrumentation_event_t
+montecarlo_continuum_event (rpacket_t * packet, rng_state_t *rng_state,
+			    const int64_t variant)
+{
+  double zrand, normaliz_cont_th, normaliz_cont_bf;
+  if (!(variant & KERNEL_VARIANT_CONTINUUM))
+    {
+      return INSTRUMENTATION_THOMSON_SCATTER;
+    }
+  zrand = (rng_double (rng_state));
+  normaliz_cont_th = rpacket_get_chi_electron(packet)/rpacket_get_chi_continuum(packet);
+  normaliz_cont_bf = rpacket_get_chi_boundfree(packet)/rpacket_get_chi_continuum(packet);
+  if (zrand < normaliz_cont_th)
+    {
+      return INSTRUMENTATION_THOMSON_SCATTER;
+    }
+  else if (zrand < (normaliz_cont_th + normaliz_cont_bf))
+    {
+      return INSTRUMENTATION_BOUND_FREE;
+    }
+  return INSTRUMENTATION_FREE_FREE;
+}
+
+static ALWAYS_INLINE instrumentation_event_t
+montecarlo_select_event (rpacket_t * packet, double *distance,
+			 rng_state_t *rng_state, const int64_t variant)
+{
+  double d_boundary, d_continuum, d_line;
   d_boundary = rpacket_get_d_boundary (packet);
   d_continuum = rpacket_get_d_continuum (packet);
   d_line = rpacket_get_d_line (packet);
-  montecarlo_event_handler_t handler;
   if (d_line <= d_boundary && d_line <= d_continuum)
     {
       *distance = d_line;
-      handler = &montecarlo_line_scatter;
+      return INSTRUMENTATION_LINE_SCATTER;
     }
   else if (d_boundary <= d_continuum)
     {
       *distance = d_boundary;
-      handler = &move_packet_across_shell_boundary;
-    }
-  else
-    {
-      *distance = d_continuum;
-      handler = montecarlo_continuum_event_handler(packet, storage);
+      return INSTRUMENTATION_BOUNDARY_CROSSING;
     }
-  return handler;
+  *distance = d_continuum;
+  return montecarlo_continuum_event (packet, rng_state, variant);
 }
 
-INLINE montecarlo_event_handler_t
-montecarlo_continuum_event_handler(rpacket_t * packet, storage_model_t * storage)
+montecarlo_event_handler_t
+montecarlo_select_event_handler (rpacket_t * packet, storage_model_t * storage,
+				 double *distance, rng_state_t *rng_state)
 {
-  if (storage->cont_status == CONTINUUM_OFF)
-    {
-      return &montecarlo_thomson_scatter;
-    }
-  else
-    {
-  double zrand, normaliz_cont_th, normaliz_cont_bf, normaliz_cont_ff;
-  zrand = (rk_double(&mt_state));
-  normaliz_cont_th = rpacket_get_chi_electron(packet)/rpacket_get_chi_continuum(packet);
-  normaliz_cont_bf = rpacket_get_chi_boundfree(packet)/rpacket_get_chi_continuum(packet);
-  normaliz_cont_ff = rpacket_get_chi_freefree(packet)/rpacket_get_chi_continuum(packet);
+  return montecarlo_event_handlers[montecarlo_select_event
+				   (packet, distance, rng_state,
+				    montecarlo_kernel_variant (storage))];
+}
 
-  if (zrand < normaliz_cont_th)
-    {
-	  //Return the electron scatter event function
-	  return &montecarlo_thomson_scatter;
-    }
-  else if (zrand < (normaliz_cont_th + normaliz_cont_bf))
-    {
-	  //Return the bound-free scatter event function
-	  return &montecarlo_bound_free_scatter;
-	}
-  else
+instrumentation_event_t
+montecarlo_event_type (montecarlo_event_handler_t handler)
+{
+  int64_t event;
+  for (event = 0; event < INSTRUMENTATION_NO_OF_EVENTS; event++)
     {
-	  //Return the free-free scatter event function
-	  return &montecarlo_free_free_scatter;
+      if (handler == montecarlo_event_handlers[event])
+	{
+	  return (instrumentation_event_t) event;
 	}
     }
+  return INSTRUMENTATION_THOMSON_SCATTER;
 }
 
-int64_t
-montecarlo_one_packet_loop (storage_model_t * storage, rpacket_t * packet,
-			    int64_t virtual_packet)
+montecarlo_event_handler_t
+montecarlo_continuum_event_handler(rpacket_t * packet, storage_model_t * storage, rng_state_t *rng_state)
+{
+  return montecarlo_event_handlers[montecarlo_continuum_event
+				   (packet, rng_state,
+				    montecarlo_kernel_variant (storage))];
+}
+
+void
+montecarlo_one_packet_loop_init (rpacket_t * packet, int64_t virtual_packet,
+				 rng_state_t *rng_state)
 {
   rpacket_set_tau_event (packet, 0.0);
   rpacket_set_nu_line (packet, 0.0);
@@ -839,11 +1592,33 @@ montecarlo_one_packet_loop (storage_model_t * storage, rpacket_t * packet,
   // Initializing tau_event if it's a real packet.
   if (virtual_packet == 0)
     {
-      rpacket_reset_tau_event (packet);
+      rpacket_reset_tau_event (packet, rng_state);
     }
+}
+
+/** Propagate a packet until it leaves the ejecta or is absorbed, with the
+ * settings of variant known at compile time.
+ *
+ * @param storage storage model data
+ * @param packet packet to propagate
+ * @param rng_state random number stream of the packet
+ * @param variant constant combination of the KERNEL_VARIANT flags
+ *
+ * @return 1 if the packet was reabsorbed, 0 otherwise
+ */
+static ALWAYS_INLINE int64_t
+montecarlo_packet_loop_variant (storage_model_t * storage,
+				rpacket_t * packet, rng_state_t *rng_state,
+				const int64_t variant)
+{
+  montecarlo_one_packet_loop_init (packet,
+				   (variant & KERNEL_VARIANT_VIRTUAL_PACKET) ? 1 : 0,
+				   rng_state);
   // For a virtual packet tau_event is the sum of all the tau's that the packet passes.
   while (rpacket_get_status (packet) == TARDIS_PACKET_STATUS_IN_PROCESS)
     {
+      double distance;
+      instrumentation_event_t event;
       // Check if we are at the end of line list.
       if (!rpacket_get_last_line (packet))
 	{
@@ -852,16 +1627,41 @@ montecarlo_one_packet_loop (storage_model_t * storage, rpacket_t * packet,
 			       line_list_nu[rpacket_get_next_line_id
 					    (packet)]);
 	}
-      double distance;
-      get_event_handler (packet, storage, &distance) (packet, storage,
-						      distance);
-      if (virtual_packet > 0 && rpacket_get_tau_event (packet) > 10.0)
+      montecarlo_compute_distances (packet, storage);
+      event = montecarlo_select_event (packet, &distance, rng_state, variant);
+      INSTRUMENTATION_START (event_start);
+      switch (event)
+	{
+	case INSTRUMENTATION_LINE_SCATTER:
+	  montecarlo_line_scatter_variant (packet, storage, distance,
+					   rng_state, variant);
+	  break;
+	case INSTRUMENTATION_BOUNDARY_CROSSING:
+	  move_packet_across_shell_boundary_variant (packet, storage, distance,
+						     rng_state, variant);
+	  break;
+	case INSTRUMENTATION_BOUND_FREE:
+	  montecarlo_bound_free_scatter (packet, storage, distance, rng_state);
+	  break;
+	case INSTRUMENTATION_FREE_FREE:
+	  montecarlo_free_free_scatter (packet, storage, distance, rng_state);
+	  break;
+	default:
+	  montecarlo_thomson_scatter (packet, storage, distance, rng_state);
+	  break;
+	}
+      if (!(variant & KERNEL_VARIANT_VIRTUAL_PACKET))
+	{
+	  INSTRUMENTATION_EVENT (&storage->counters, event, event_start);
+	}
+      if ((variant & KERNEL_VARIANT_VIRTUAL_PACKET) &&
+	  rpacket_get_tau_event (packet) > VIRTUAL_PACKET_TAU_LIMIT)
 	{
 	  rpacket_set_tau_event (packet, 100.0);
 	  rpacket_set_status (packet, TARDIS_PACKET_STATUS_EMITTED);
 	}
     }
-  if (virtual_packet > 0)
+  if (variant & KERNEL_VARIANT_VIRTUAL_PACKET)
     {
       rpacket_set_energy (packet,
 			  rpacket_get_energy (packet) * exp (-1.0 *
@@ -872,52 +1672,560 @@ montecarlo_one_packet_loop (storage_model_t * storage, rpacket_t * packet,
     TARDIS_PACKET_STATUS_REABSORBED ? 1 : 0;
 }
 
+/* One copy of the packet loop per kernel variant. */
+#define MONTECARLO_PACKET_LOOP(variant)					\
+  static int64_t							\
+  montecarlo_packet_loop_##variant (storage_model_t * storage,		\
+				    rpacket_t * packet,			\
+				    rng_state_t *rng_state)		\
+  {									\
+    return montecarlo_packet_loop_variant (storage, packet, rng_state,	\
+					   variant);			\
+  }
+
+MONTECARLO_PACKET_LOOP (0)
+MONTECARLO_PACKET_LOOP (1)
+MONTECARLO_PACKET_LOOP (2)
+MONTECARLO_PACKET_LOOP (3)
+MONTECARLO_PACKET_LOOP (4)
+MONTECARLO_PACKET_LOOP (5)
+MONTECARLO_PACKET_LOOP (6)
+MONTECARLO_PACKET_LOOP (7)
+MONTECARLO_PACKET_LOOP (8)
+MONTECARLO_PACKET_LOOP (9)
+MONTECARLO_PACKET_LOOP (10)
+MONTECARLO_PACKET_LOOP (11)
+MONTECARLO_PACKET_LOOP (12)
+MONTECARLO_PACKET_LOOP (13)
+MONTECARLO_PACKET_LOOP (14)
+MONTECARLO_PACKET_LOOP (15)
+
+static const montecarlo_packet_loop_t
+  montecarlo_packet_loops[KERNEL_NO_OF_VARIANTS] = {
+  &montecarlo_packet_loop_0, &montecarlo_packet_loop_1,
+  &montecarlo_packet_loop_2, &montecarlo_packet_loop_3,
+  &montecarlo_packet_loop_4, &montecarlo_packet_loop_5,
+  &montecarlo_packet_loop_6, &montecarlo_packet_loop_7,
+  &montecarlo_packet_loop_8, &montecarlo_packet_loop_9,
+  &montecarlo_packet_loop_10, &montecarlo_packet_loop_11,
+  &montecarlo_packet_loop_12, &montecarlo_packet_loop_13,
+  &montecarlo_packet_loop_14, &montecarlo_packet_loop_15
+};
+
+int64_t
+montecarlo_one_packet_loop (storage_model_t * storage, rpacket_t * packet,
+			    int64_t virtual_packet, rng_state_t *rng_state)
+{
+  int64_t variant = storage->kernel_variant;
+  if (virtual_packet > 0)
+    {
+      variant |= KERNEL_VARIANT_VIRTUAL_PACKET;
+    }
+  return montecarlo_packet_loops[variant] (storage, packet, rng_state);
+}
+
+void
+montecarlo_batch_compute_distances (rpacket_batch_t * batch,
+				    storage_model_t * storage)
+{
+  int64_t lane;
+  int64_t comov_nu_error = 0;
+  for (lane = 0; lane < batch->size; lane++)
+    {
+      if (batch->active[lane] && !batch->last_line[lane])
+	{
+	  batch->nu_line[lane] = storage->line_list_nu[batch->next_line_id[lane]];
+	}
+    }
+  /*
+     The distance kernels evaluate compute_distance2boundary and
+     compute_distance2line for all lanes at once. Lanes that sit on a close
+     line only get d_line = 0 and keep their other distances; close_line is
+     reset at the end. Inactive lanes are computed as well and ignored later
+     on, their shell ids always stay valid.
+   */
+  distance2boundary_lanes (batch->size, batch->r, batch->mu, batch->current_shell_id,
+			   batch->recently_crossed_boundary, storage->r_inner,
+			   storage->r_outer, batch->new_d_boundary,
+			   batch->new_next_shell_id);
+  distance2line_lanes (batch->size, batch->r, batch->mu, batch->nu, batch->nu_line,
+		       batch->last_line, storage->time_explosion,
+		       storage->inverse_time_explosion, batch->new_d_line);
+  for (lane = 0; lane < batch->size; lane++)
+    {
+      int64_t shell_id = batch->current_shell_id[lane];
+      int64_t update = !batch->close_line[lane];
+      // compute_distance2continuum without continuum processes.
+      double chi_electron = storage->electron_densities[shell_id] * storage->sigma_thomson;
+      double d_continuum = storage->inverse_electron_densities[shell_id] *
+	storage->inverse_sigma_thomson * batch->tau_event[lane];
+      // A negative distance means that the comoving frequency is below nu_line.
+      comov_nu_error |= batch->active[lane] & update & (batch->new_d_line[lane] < 0.0);
+      batch->d_boundary[lane] = update ? batch->new_d_boundary[lane] : batch->d_boundary[lane];
+      batch->next_shell_id[lane] = update ? batch->new_next_shell_id[lane] : batch->next_shell_id[lane];
+      batch->d_line[lane] = update ? batch->new_d_line[lane] : 0.0;
+      batch->d_cont[lane] = update ? d_continuum : batch->d_cont[lane];
+      batch->chi_cont[lane] = update ? chi_electron : batch->chi_cont[lane];
+    }
+  if (comov_nu_error || storage->cont_status == CONTINUUM_ON)
+    {
+      for (lane = 0; lane < batch->size; lane++)
+	{
+	  double d_line;
+	  rpacket_t *packet;
+	  if (!batch->active[lane] || batch->close_line[lane])
+	    {
+	      continue;
+	    }
+	  packet = rpacket_batch_load (batch, lane);
+	  // Rerun the scalar version to report the error.
+	  if (comov_nu_error)
+	    {
+	      compute_distance2line (packet, storage, &d_line);
+	    }
+	  if (storage->cont_status == CONTINUUM_ON)
+	    {
+	      compute_distance2continuum (packet, storage);
+	      batch->d_cont[lane] = rpacket_get_d_continuum (packet);
+	      batch->chi_cont[lane] = rpacket_get_chi_continuum (packet);
+	    }
+	}
+    }
+  memset (batch->close_line, 0, sizeof (int64_t) * batch->size);
+}
+
+bool
+montecarlo_batch_fill_lane (rpacket_batch_t * batch, int64_t lane,
+			    storage_model_t * storage, int64_t *next_packet,
+			    int64_t last_packet, int64_t virtual_packet_flag,
+			    unsigned long seed)
+{
+  rpacket_t *packet = &batch->packets[lane];
+  rng_state_t *rng_state = &batch->rng_states[lane];
+  int64_t packet_index = *next_packet;
+  if (packet_index >= last_packet)
+    {
+      batch->active[lane] = 0;
+      return false;
+    }
+  (*next_packet)++;
+  rng_seed (rng_state, seed + packet_index);
+  rpacket_set_id (packet, packet_index);
+  rpacket_init (packet, storage, packet_index, virtual_packet_flag);
+  if (virtual_packet_flag > 0)
+    {
+      montecarlo_one_packet (storage, packet, -1, rng_state);
+    }
+  montecarlo_one_packet_loop_init (packet, 0, rng_state);
+  rpacket_batch_store (batch, lane);
+  return true;
+}
+
+void
+montecarlo_batch_loop (storage_model_t * storage, rpacket_batch_t * batch,
+		       int64_t first_packet, int64_t last_packet,
+		       int64_t virtual_packet_flag, unsigned long seed)
+{
+  int64_t lane;
+  int64_t no_of_active = 0;
+  int64_t next_packet = first_packet;
+  for (lane = 0; lane < batch->size; lane++)
+    {
+      no_of_active += montecarlo_batch_fill_lane (batch, lane, storage, &next_packet,
+						  last_packet, virtual_packet_flag, seed);
+    }
+  while (no_of_active > 0)
+    {
+      montecarlo_batch_compute_distances (batch, storage);
+      for (lane = 0; lane < batch->size; lane++)
+	{
+	  double distance;
+	  rpacket_t *packet;
+	  montecarlo_event_handler_t handler;
+	  rng_state_t *rng_state = &batch->rng_states[lane];
+	  if (!batch->active[lane])
+	    {
+	      continue;
+	    }
+	  packet = rpacket_batch_load (batch, lane);
+	  handler = montecarlo_select_event_handler (packet, storage, &distance, rng_state);
+	  INSTRUMENTATION_START (event_start);
+	  handler (packet, storage, distance, rng_state);
+	  INSTRUMENTATION_EVENT (&storage->counters, montecarlo_event_type (handler),
+				 event_start);
+	  rpacket_batch_store (batch, lane);
+	  if (!batch->active[lane])
+	    {
+	      montecarlo_record_packet (storage, packet,
+					rpacket_get_status (packet) == TARDIS_PACKET_STATUS_REABSORBED);
+	      no_of_active -= !montecarlo_batch_fill_lane (batch, lane, storage, &next_packet,
+							   last_packet, virtual_packet_flag, seed);
+	    }
+	}
+    }
+}
+
+void
+montecarlo_thread_storage_init (storage_model_t * thread_storage,
+				storage_model_t * storage)
+{
+  int64_t no_of_blocks = (storage->no_of_shells * storage->line_lists_j_blues_nd +
+			  J_BLUE_BLOCK_SIZE - 1) >> J_BLUE_BLOCK_SHIFT;
+  int64_t padded_shells = (storage->no_of_shells + CACHE_LINE_DOUBLES - 1) /
+    CACHE_LINE_DOUBLES * CACHE_LINE_DOUBLES;
+  double *estimators;
+  memcpy (thread_storage, storage, sizeof (storage_model_t));
+  /*
+     Every private buffer is padded by a cache line on both ends,
+     so that no two threads ever write to the same cache line.
+   */
+  thread_storage->spectrum_virt_nu =
+    (double *) calloc (storage->spectrum_virt_nu_size + 2 * CACHE_LINE_DOUBLES,
+		       sizeof (double)) + CACHE_LINE_DOUBLES;
+  thread_storage->virt_packet_chunks = NULL;
+  thread_storage->virt_packet_chunks_tail = NULL;
+  thread_storage->virt_packet_count = 0;
+  if (storage->spectrum_emitted_nu != NULL)
+    {
+      thread_storage->spectrum_emitted_nu =
+	(double *) calloc (2 * storage->spectrum_nu_size + 2 * CACHE_LINE_DOUBLES,
+			   sizeof (double)) + CACHE_LINE_DOUBLES;
+      thread_storage->spectrum_reabsorbed_nu =
+	thread_storage->spectrum_emitted_nu + storage->spectrum_nu_size;
+    }
+  thread_storage->luminosity_emitted_energy = 0.0;
+  memset (&thread_storage->counters, 0, sizeof (instrumentation_counters_t));
+  thread_storage->luminosity_reabsorbed_energy = 0.0;
+  thread_storage->no_of_emitted_packets = 0;
+  thread_storage->line_lists_j_blues_map = NULL;
+  if (storage->sparse_j_blue_estimators)
+    {
+      thread_storage->line_lists_j_blues_map =
+	(j_blue_map_t *) malloc (sizeof (j_blue_map_t));
+      j_blue_map_init (thread_storage->line_lists_j_blues_map,
+		       J_BLUE_MAP_INITIAL_CAPACITY);
+    }
+  if (storage->thread_private_estimators)
+    {
+      estimators = (double *) calloc (2 * padded_shells + 2 * CACHE_LINE_DOUBLES,
+				      sizeof (double));
+      thread_storage->js = estimators + CACHE_LINE_DOUBLES;
+      thread_storage->nubars = thread_storage->js + padded_shells;
+      thread_storage->line_lists_j_blues_blocks =
+	(double **) calloc (no_of_blocks, sizeof (double *));
+    }
+}
+
+void
+montecarlo_reduce_j_blue_block (storage_model_t * storage,
+				storage_model_t * thread_storages,
+				int64_t no_of_threads, int64_t block_id)
+{
+  int64_t thread_id, i;
+  int64_t offset = block_id << J_BLUE_BLOCK_SHIFT;
+  int64_t block_size = storage->no_of_shells * storage->line_lists_j_blues_nd - offset;
+  if (block_size > J_BLUE_BLOCK_SIZE)
+    {
+      block_size = J_BLUE_BLOCK_SIZE;
+    }
+  for (thread_id = 0; thread_id < no_of_threads; thread_id++)
+    {
+      double *block;
+      if (thread_storages[thread_id].line_lists_j_blues_blocks == NULL)
+	{
+	  continue;
+	}
+      block = thread_storages[thread_id].line_lists_j_blues_blocks[block_id];
+      if (block != NULL && storage->line_lists_j_blues_compact != NULL)
+	{
+	  float *compact_block = (float *) block;
+	  for (i = 0; i < block_size; i++)
+	    {
+	      storage->line_lists_j_blues_compact[offset + i] =
+		(float) ((double) storage->line_lists_j_blues_compact[offset + i] +
+			 ((double) compact_block[2 * i] -
+			  (double) compact_block[2 * i + 1]));
+	    }
+	  free (block);
+	}
+      else if (block != NULL)
+	{
+	  for (i = 0; i < block_size; i++)
+	    {
+	      storage->line_lists_j_blues[offset + i] += block[i];
+	    }
+	  free (block);
+	}
+    }
+}
+
+void
+montecarlo_reduce_thread_storages (storage_model_t * storage,
+				   storage_model_t * thread_storages,
+				   int64_t no_of_threads)
+{
+  int64_t thread_id, i;
+  int64_t virt_packet_count = 0;
+  for (thread_id = 0; thread_id < no_of_threads; thread_id++)
+    {
+      virt_packet_count += thread_storages[thread_id].virt_packet_count;
+    }
+  /* The merged virtual packet lists are allocated once, with their final size. */
+  storage->virt_packet_nus = (double *) malloc (sizeof (double) * virt_packet_count);
+  storage->virt_packet_energies = (double *) malloc (sizeof (double) * virt_packet_count);
+  storage->virt_last_interaction_in_nu = (double *) malloc (sizeof (double) * virt_packet_count);
+  storage->virt_last_interaction_type = (int64_t *) malloc (sizeof (int64_t) * virt_packet_count);
+  storage->virt_last_line_interaction_in_id = (int64_t *) malloc (sizeof (int64_t) * virt_packet_count);
+  storage->virt_last_line_interaction_out_id = (int64_t *) malloc (sizeof (int64_t) * virt_packet_count);
+  storage->virt_packet_count = 0;
+  storage->virt_array_size = virt_packet_count;
+  for (thread_id = 0; thread_id < no_of_threads; thread_id++)
+    {
+      storage_model_t *thread_storage = &thread_storages[thread_id];
+      if (thread_storage->spectrum_virt_nu == NULL)
+	{
+	  continue;
+	}
+      for (i = 0; i < storage->spectrum_virt_nu_size; i++)
+	{
+	  storage->spectrum_virt_nu[i] += thread_storage->spectrum_virt_nu[i];
+	}
+      free (thread_storage->spectrum_virt_nu - CACHE_LINE_DOUBLES);
+      montecarlo_collect_virtual_packets (storage, thread_storage->virt_packet_chunks);
+      if (storage->spectrum_emitted_nu != NULL)
+	{
+	  for (i = 0; i < storage->spectrum_nu_size; i++)
+	    {
+	      storage->spectrum_emitted_nu[i] += thread_storage->spectrum_emitted_nu[i];
+	      storage->spectrum_reabsorbed_nu[i] += thread_storage->spectrum_reabsorbed_nu[i];
+	    }
+	  free (thread_storage->spectrum_emitted_nu - CACHE_LINE_DOUBLES);
+	  storage->luminosity_emitted_energy += thread_storage->luminosity_emitted_energy;
+	  storage->luminosity_reabsorbed_energy += thread_storage->luminosity_reabsorbed_energy;
+	}
+      storage->no_of_emitted_packets += thread_storage->no_of_emitted_packets;
+      if (thread_storage->line_lists_j_blues_blocks != NULL)
+	{
+	  for (i = 0; i < storage->no_of_shells; i++)
+	    {
+	      storage->js[i] += thread_storage->js[i];
+	      storage->nubars[i] += thread_storage->nubars[i];
+	    }
+	  free (thread_storage->js - CACHE_LINE_DOUBLES);
+	  free (thread_storage->line_lists_j_blues_blocks);
+	}
+    }
+}
+
+double
+montecarlo_wall_time (void)
+{
+#ifdef WITHOPENMP
+  return omp_get_wtime ();
+#else
+  return (double) clock () / CLOCKS_PER_SEC;
+#endif
+}
+
 void
 montecarlo_main_loop(storage_model_t * storage, int64_t virtual_packet_flag, int nthreads, unsigned long seed)
 {
   int64_t packet_index;
-  storage->virt_packet_nus = (double *)malloc(sizeof(double) * storage->no_of_packets);
-  storage->virt_packet_energies = (double *)malloc(sizeof(double) * storage->no_of_packets);
-  storage->virt_last_interaction_in_nu = (double *)malloc(sizeof(double) * storage->no_of_packets);
-  storage->virt_last_interaction_type = (int64_t *)malloc(sizeof(int64_t) * storage->no_of_packets);
-  storage->virt_last_line_interaction_in_id = (int64_t *)malloc(sizeof(int64_t) * storage->no_of_packets);
-  storage->virt_last_line_interaction_out_id = (int64_t *)malloc(sizeof(int64_t) * storage->no_of_packets);
-  storage->virt_packet_count = 0;
-  storage->virt_array_size = storage->no_of_packets;
+  int64_t no_of_threads = 1;
+  int64_t block_size = storage->no_of_packets;
+  storage_model_t *thread_storages = NULL;
 #ifdef WITHOPENMP
   fprintf(stderr, "Running with OpenMP - %d threads", nthreads);
   omp_set_dynamic(0);
   omp_set_num_threads(nthreads);
-#pragma omp parallel
-  {
-    initialize_random_kit(seed + omp_get_thread_num());
-#pragma omp for
+  no_of_threads = omp_get_max_threads();
 #else
   fprintf(stderr, "Running without OpenMP");
-  initialize_random_kit(seed);
 #endif
-  for (packet_index = 0; packet_index < storage->no_of_packets; packet_index++)
+  /* Slots of threads that are never started keep spectrum_virt_nu == NULL and are skipped. */
+  thread_storages = (storage_model_t *) calloc (no_of_threads, sizeof (storage_model_t));
+  /* Single precision j_blues are only summed with compensation in the per thread blocks. */
+  if (storage->line_lists_j_blues_compact != NULL)
     {
-      int reabsorbed = 0;
-      rpacket_t packet;
-      rpacket_set_id(&packet, packet_index);
-      rpacket_init(&packet, storage, packet_index, virtual_packet_flag);
-      if (virtual_packet_flag > 0)
-	{
-	  reabsorbed = montecarlo_one_packet(storage, &packet, -1);
-	}
-      reabsorbed = montecarlo_one_packet(storage, &packet, 0);
-      storage->output_nus[packet_index] = rpacket_get_nu(&packet);
-      if (reabsorbed == 1)
-	{
-	  storage->output_energies[packet_index] = -rpacket_get_energy(&packet);
-	}
-      else
-	{
-	  storage->output_energies[packet_index] = rpacket_get_energy(&packet);
-	}
+      storage->thread_private_estimators = 1;
     }
+  distance_kernels_select (DISTANCE_KERNELS_BEST);
+  storage->kernel_variant = montecarlo_kernel_variant (storage);
+  if (storage->packet_block_size > 0 && storage->packet_block_size < storage->no_of_packets)
+    {
+      block_size = storage->packet_block_size;
+    }
+  /* Unless they are given, the packets are created by the threads before they are propagated. */
+  packet_source_init (storage);
 #ifdef WITHOPENMP
-  }
+  /* The packet loops below take their schedule from here. */
+  switch (storage->packet_schedule)
+    {
+    case PACKET_SCHEDULE_DYNAMIC:
+      omp_set_schedule (omp_sched_dynamic, storage->packet_schedule_chunk_size);
+      break;
+    case PACKET_SCHEDULE_GUIDED:
+      omp_set_schedule (omp_sched_guided, storage->packet_schedule_chunk_size);
+      break;
+    default:
+      omp_set_schedule (omp_sched_static, storage->packet_schedule_chunk_size);
+      break;
+    }
+#endif
+#ifdef WITHOPENMP
+#pragma omp parallel
 #endif
+  {
+    /* Every thread owns its generator state; it is re-seeded per packet below. */
+    rng_state_t rng_state;
+    /*
+       Every thread works on its own shallow copy of the storage model, which
+       owns the thread's virtual packets and virtual spectrum and, with thread
+       private estimators, also js, nubars and the j_blues. They are reduced
+       into the shared storage after the loop.
+     */
+    storage_model_t *local_storage;
+    int64_t block_id;
+    int64_t thread_id = 0;
+    int64_t packet_count = 0;
+    int64_t block_start;
+    double busy_time = 0.0;
+    rpacket_batch_t batch;
+#ifdef WITHOPENMP
+    thread_id = omp_get_thread_num();
+#endif
+    local_storage = &thread_storages[thread_id];
+    montecarlo_thread_storage_init (local_storage, storage);
+    rng_init (&rng_state, storage->rng_backend);
+    if (storage->packet_batch_size > 0)
+      {
+	rpacket_batch_init (&batch, storage->packet_batch_size,
+			    storage->rng_backend);
+      }
+    /*
+       Streaming runs create and propagate the packets one block at a time,
+       so that the packet arrays only ever hold a block.
+     */
+    for (block_start = 0; block_start < storage->no_of_packets; block_start += block_size)
+      {
+	int64_t block_end = block_start + block_size;
+	double start_time;
+	if (block_end > storage->no_of_packets)
+	  {
+	    block_end = storage->no_of_packets;
+	  }
+	if (storage->packet_source != PACKET_SOURCE_ARRAYS)
+	  {
+	    int64_t chunk_id;
+	    local_storage->packet_block_start = block_start;
+#ifdef WITHOPENMP
+#pragma omp for
+#endif
+	    for (chunk_id = 0; chunk_id < (block_end - block_start + PACKET_SOURCE_CHUNK_SIZE - 1) / PACKET_SOURCE_CHUNK_SIZE; chunk_id++)
+	      {
+		int64_t first_packet = block_start + chunk_id * PACKET_SOURCE_CHUNK_SIZE;
+		int64_t last_packet = first_packet + PACKET_SOURCE_CHUNK_SIZE;
+		if (last_packet > block_end)
+		  {
+		    last_packet = block_end;
+		  }
+		packet_source_create_packets (local_storage, first_packet, last_packet);
+	      }
+	  }
+	start_time = montecarlo_wall_time ();
+	if (storage->packet_batch_size > 0)
+	  {
+	    /* Threads take chunks of several batches, so that lanes get refilled
+	       while the batch drains and the chunks are still fine grained. */
+	    int64_t chunk_size = storage->packet_batch_size * PACKET_BATCH_CHUNK_FACTOR;
+	    int64_t chunk_id;
+#ifdef WITHOPENMP
+#pragma omp for schedule(runtime) nowait
+#endif
+	    for (chunk_id = 0; chunk_id < (block_end - block_start + chunk_size - 1) / chunk_size; chunk_id++)
+	      {
+		int64_t first_packet = block_start + chunk_id * chunk_size;
+		int64_t last_packet = first_packet + chunk_size;
+		if (last_packet > block_end)
+		  {
+		    last_packet = block_end;
+		  }
+		montecarlo_batch_loop (local_storage, &batch, first_packet,
+				       last_packet, virtual_packet_flag, seed);
+		packet_count += last_packet - first_packet;
+	      }
+	  }
+	else
+	  {
+#ifdef WITHOPENMP
+#pragma omp for schedule(runtime) nowait
+#endif
+	    for (packet_index = block_start; packet_index < block_end; packet_index++)
+	      {
+		int reabsorbed = 0;
+		rpacket_t packet;
+		/*
+		   Each packet draws from its own stream, keyed on the packet index,
+		   so that a given seed reproduces the same result independent of
+		   the number of threads and of how packets are distributed among them.
+		 */
+		rng_seed (&rng_state, seed + packet_index);
+		rpacket_set_id(&packet, packet_index);
+		rpacket_init(&packet, local_storage, packet_index, virtual_packet_flag);
+		if (virtual_packet_flag > 0)
+		  {
+		    reabsorbed = montecarlo_one_packet(local_storage, &packet, -1, &rng_state);
+		  }
+		reabsorbed = montecarlo_one_packet(local_storage, &packet, 0, &rng_state);
+		montecarlo_record_packet (local_storage, &packet, reabsorbed == 1);
+		packet_count++;
+	      }
+	  }
+	/* The busy time is taken before waiting for the other threads. */
+	busy_time += montecarlo_wall_time () - start_time;
+	if (block_end < storage->no_of_packets)
+	  {
+	    /* The next block overwrites the packets of this one. */
+#ifdef WITHOPENMP
+#pragma omp barrier
+#endif
+	  }
+      }
+    if (storage->packet_batch_size > 0)
+      {
+	rpacket_batch_free (&batch);
+      }
+    rng_free (&rng_state);
+    if (storage->thread_busy_times != NULL)
+      {
+	storage->thread_busy_times[thread_id] = busy_time;
+	storage->thread_packet_counts[thread_id] = packet_count;
+      }
+    if (storage->thread_counters != NULL)
+      {
+	storage->thread_counters[thread_id] = local_storage->counters;
+      }
+#ifdef WITHOPENMP
+#pragma omp barrier
+#endif
+    if (storage->thread_private_estimators && !storage->sparse_j_blue_estimators)
+      {
+	/* Every block of the j_blue estimator is reduced by exactly one thread. */
+#ifdef WITHOPENMP
+#pragma omp for
+#endif
+	for (block_id = 0; block_id < (storage->no_of_shells * storage->line_lists_j_blues_nd +
+				       J_BLUE_BLOCK_SIZE - 1) >> J_BLUE_BLOCK_SHIFT; block_id++)
+	  {
+	    montecarlo_reduce_j_blue_block (storage, thread_storages, no_of_threads, block_id);
+	  }
+      }
+  }
+  if (storage->sparse_j_blue_estimators)
+    {
+      montecarlo_merge_j_blue_maps (storage, thread_storages, no_of_threads);
+    }
+  montecarlo_reduce_thread_storages (storage, thread_storages, no_of_threads);
+  free (thread_storages);
+  packet_source_free (storage);
 }
@@ -7,8 +7,14 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include <time.h>
 #include "randomkit/randomkit.h"
+#include "rng.h"
 #include "rpacket.h"
+#include "rpacket_batch.h"
+#include "distance_kernels.h"
+#include "instrumentation.h"
+#include "packet_source.h"
 #include "status.h"
 
 #ifdef __clang__
@@ -17,9 +23,39 @@
 #define INLINE inline
 #endif
 
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__ ((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+/* The thread private j_blue estimator is allocated lazily in blocks of this many entries. */
+#define J_BLUE_BLOCK_SHIFT 10
+#define J_BLUE_BLOCK_SIZE (1 << J_BLUE_BLOCK_SHIFT)
+#define CACHE_LINE_DOUBLES 8
+/* Initial number of slots of a thread private sparse j_blue estimator. */
+#define J_BLUE_MAP_INITIAL_CAPACITY 4096
+/* With batched propagation every thread takes this many batches of packets at a time. */
+#define PACKET_BATCH_CHUNK_FACTOR 16
+/* Optical depth beyond which a virtual packet is considered absorbed. */
+#define VIRTUAL_PACKET_TAU_LIMIT 10.0
+/*
+   Settings the packet loop is compiled for, one copy per combination.
+   The variant of a run is selected once in montecarlo_main_loop.
+ */
+#define KERNEL_VARIANT_MACRO_ATOM 1
+#define KERNEL_VARIANT_CONTINUUM 2
+#define KERNEL_VARIANT_REFLECTIVE_INNER_BOUNDARY 4
+#define KERNEL_VARIANT_VIRTUAL_PACKET 8
+#define KERNEL_NO_OF_VARIANTS 16
+
 typedef void (*montecarlo_event_handler_t) (rpacket_t * packet,
 					    storage_model_t * storage,
-					    double distance);
+					    double distance, rng_state_t *rng_state);
+
+typedef int64_t (*montecarlo_packet_loop_t) (storage_model_t * storage,
+					     rpacket_t * packet,
+					     rng_state_t *rng_state);
 
 /** Look for a place to insert a value in an inversely sorted float array.
  *
@@ -54,10 +90,84 @@ inline tardis_error_t binary_search (double *x, double x_insert, int64_t imin,
  *
  * @return index of the next line ot the red. If the key value is redder than the reddest line returns number_of_lines.
  */
-inline tardis_error_t line_search (double *nu, double nu_insert,
-				   int64_t number_of_lines, int64_t * result);
+tardis_error_t line_search (double *nu, double nu_insert,
+			    int64_t number_of_lines, int64_t * result);
 
-inline double rpacket_doppler_factor(rpacket_t * packet, storage_model_t * storage);
+/** Build the log(nu) bucket index of an inversely sorted frequency list.
+ *
+ * @param index frequency index to initialize
+ * @param nu an inversely (largest to lowest) sorted frequency list
+ * @param number_of_lines number of frequencies in the list
+ */
+void frequency_index_init (frequency_index_t * index, double *nu,
+			   int64_t number_of_lines);
+
+/** Free the buckets of a frequency index.
+ *
+ * @param index frequency index
+ */
+void frequency_index_free (frequency_index_t * index);
+
+/** Find the bucket of a frequency.
+ *
+ * @param index frequency index
+ * @param nu frequency
+ *
+ * @return the bucket, frequencies outside of the list are clamped to the first or last one
+ */
+int64_t frequency_index_bin (frequency_index_t * index, double nu);
+
+/** Insert a value in to an array of line frequencies with the help of its
+ * bucket index, only the few lines of one bucket are searched. Falls back to
+ * line_search if the index was not built. Lines at exactly nu_insert count
+ * as blue-ward.
+ *
+ * @param index frequency index of nu, see frequency_index_init
+ * @param nu array of line frequencies
+ * @param nu_insert value of nu key
+ * @param number_of_lines number of lines in the line list
+ *
+ * @return index of the next line ot the red. If the key value is redder than the reddest line returns number_of_lines.
+ */
+tardis_error_t indexed_line_search (frequency_index_t * index,
+					   double *nu, double nu_insert,
+					   int64_t number_of_lines,
+					   int64_t * result);
+
+/** Allocate an empty j_blue map.
+ *
+ * @param map j_blue map
+ * @param capacity initial number of slots, a power of two
+ */
+void j_blue_map_init (j_blue_map_t * map, int64_t capacity);
+
+/** Free the slots of a j_blue map.
+ *
+ * @param map j_blue map
+ */
+void j_blue_map_free (j_blue_map_t * map);
+
+/** Add a value to the entry of an estimator index, inserting the entry if
+ * it does not exist yet. The map doubles its capacity when it gets half full.
+ *
+ * @param map j_blue map
+ * @param index estimator index, shell_id * line_lists_j_blues_nd + line_id
+ * @param value value to add
+ */
+void j_blue_map_add (j_blue_map_t * map, int64_t index, double value);
+
+/** Merge the thread private j_blue maps into the sorted sparse estimator
+ * of storage and free them.
+ *
+ * @param storage storage model that receives line_lists_j_blues_sparse_*
+ * @param thread_storages thread private storage models
+ * @param no_of_threads number of thread private storage models
+ */
+void montecarlo_merge_j_blue_maps (storage_model_t * storage,
+				   storage_model_t * thread_storages,
+				   int64_t no_of_threads);
+
+double rpacket_doppler_factor(rpacket_t * packet, storage_model_t * storage);
 
 /** Calculate the distance to shell boundary.
  *
@@ -66,7 +176,7 @@ inline double rpacket_doppler_factor(rpacket_t * packet, storage_model_t * stora
  *
  * @return distance to shell boundary
  */
-inline double compute_distance2boundary (rpacket_t * packet,
+double compute_distance2boundary (rpacket_t * packet,
 					 storage_model_t * storage);
 
 /** Calculate the distance the packet has to travel until it redshifts to the first spectral line.
@@ -98,24 +208,243 @@ inline double compute_distance2electron (rpacket_t * packet,
  *
  * sets distance to the next continuum event (in centimeters) in packet rpacket structure
  */
-inline void compute_distance2continuum (rpacket_t * packet, storage_model_t * storage);
+void compute_distance2continuum (rpacket_t * packet, storage_model_t * storage);
 
-inline int64_t macro_atom (rpacket_t * packet, storage_model_t * storage);
+int64_t macro_atom (rpacket_t * packet, storage_model_t * storage,
+			   rng_state_t *rng_state);
 
-inline double move_packet (rpacket_t * packet, storage_model_t * storage,
+double move_packet (rpacket_t * packet, storage_model_t * storage,
 			   double distance);
 
-inline void increment_j_blue_estimator (rpacket_t * packet,
+/** Add a value to a single precision sum with Kahan summation.
+ *
+ * @param sum running sum
+ * @param compensation running compensation of the sum, the sum of the values is sum - compensation
+ * @param value value to add
+ */
+void kahan_add (float *sum, float *compensation, double value);
+
+void increment_j_blue_estimator (rpacket_t * packet,
 					storage_model_t * storage,
 					double d_line, int64_t j_blue_idx);
 
 int64_t montecarlo_one_packet (storage_model_t * storage, rpacket_t * packet,
-			       int64_t virtual_mode);
+			       int64_t virtual_mode, rng_state_t *rng_state);
 
 int64_t montecarlo_one_packet_loop (storage_model_t * storage,
 				    rpacket_t * packet,
-				    int64_t virtual_packet);
+				    int64_t virtual_packet, rng_state_t *rng_state);
+
+/** Reset the state of a packet before it is propagated.
+ *
+ * @param packet rpacket structure with packet information
+ * @param virtual_packet 0 for real packets, > 0 for virtual packets
+ * @param rng_state random number stream of the packet
+ */
+void montecarlo_one_packet_loop_init (rpacket_t * packet,
+					     int64_t virtual_packet,
+					     rng_state_t *rng_state);
+
+/** Pick the event that happens first from the distances stored in the packet.
+ *
+ * @param packet rpacket structure with up to date distances
+ * @param storage storage model data
+ * @param distance set to the distance to the event
+ * @param rng_state random number stream of the packet
+ *
+ * @return handler of the event
+ */
+montecarlo_event_handler_t
+montecarlo_select_event_handler (rpacket_t * packet, storage_model_t * storage,
+				 double *distance, rng_state_t *rng_state);
+
+/** Map an event handler to the event type it is counted as.
+ *
+ * @param handler event handler
+ *
+ * @return event type of the instrumentation counters
+ */
+instrumentation_event_t montecarlo_event_type (montecarlo_event_handler_t handler);
+
+/** Pass all lines after the current one that a packet crosses before its
+ * shell boundary without interacting, without an event for each of them.
+ *
+ * The first line that stops the packet is found by a search over
+ * line_lists_tau_cumulative. A real packet stops at its continuum event
+ * or at the line it interacts with, the passed lines get their j_blue
+ * estimators incremented and their tau_sobolevs subtracted from tau_event.
+ * A virtual packet stops at the line that takes its tau_event beyond
+ * VIRTUAL_PACKET_TAU_LIMIT, the passed lines add their tau_sobolevs to
+ * tau_event. The packet does not move.
+ *
+ * @param packet packet that just passed a line
+ * @param storage storage model data with line_lists_tau_cumulative
+ */
+void montecarlo_skip_lines (rpacket_t * packet, storage_model_t * storage);
+
+/** Compute the distances to the next line, shell boundary and continuum
+ * event for all lanes of a batch.
+ *
+ * @param batch packet batch
+ * @param storage storage model data
+ */
+void montecarlo_batch_compute_distances (rpacket_batch_t * batch,
+					 storage_model_t * storage);
 
+/** Start the next real packet of a range of packets in a lane of a batch.
+ *
+ * @param batch packet batch
+ * @param lane index of the lane
+ * @param storage storage model data
+ * @param next_packet index of the next packet of the range, incremented if used
+ * @param last_packet end of the range (exclusive)
+ * @param virtual_packet_flag number of virtual packets spawned per interaction
+ * @param seed base seed of the random number streams
+ *
+ * @return false if the range is exhausted and the lane stays inactive
+ */
+bool montecarlo_batch_fill_lane (rpacket_batch_t * batch, int64_t lane,
+				 storage_model_t * storage, int64_t *next_packet,
+				 int64_t last_packet, int64_t virtual_packet_flag,
+				 unsigned long seed);
+
+/** Propagate a range of real packets through the ejecta in batches.
+ *
+ * The distances are computed for the whole batch at once, the events are
+ * handled lane by lane. Lanes of finished packets are refilled from the
+ * range right away. The result is identical to the one of
+ * montecarlo_one_packet for every packet.
+ *
+ * @param storage storage model data
+ * @param batch packet batch with a lane for every packet in flight
+ * @param first_packet index of the first packet of the range
+ * @param last_packet end of the range (exclusive)
+ * @param virtual_packet_flag number of virtual packets spawned per interaction
+ * @param seed base seed of the random number streams
+ */
+void montecarlo_batch_loop (storage_model_t * storage, rpacket_batch_t * batch,
+			    int64_t first_packet, int64_t last_packet,
+			    int64_t virtual_packet_flag, unsigned long seed);
+
+/** Append a virtual packet that left the ejecta to the packet list and the
+ * virtual spectrum of storage. Streaming runs (packet_block_size > 0) only
+ * add it to the virtual spectrum.
+ *
+ * @param storage storage model data
+ * @param packet the real packet that spawned the virtual packet
+ * @param virt_packet the escaped virtual packet
+ * @param weight statistical weight of the virtual packet
+ */
+void montecarlo_store_virtual_packet (storage_model_t * storage,
+				      rpacket_t * packet,
+				      rpacket_t * virt_packet, double weight);
+
+/** Kernel variant of the settings of storage, the packet loop that is used
+ * for them is the one of this variant (with KERNEL_VARIANT_VIRTUAL_PACKET
+ * for virtual packets).
+ *
+ * @param storage storage model data
+ *
+ * @return combination of the KERNEL_VARIANT flags
+ */
+int64_t montecarlo_kernel_variant (const storage_model_t * storage);
+
+/** Index of a line of the kernel line list in the line list of the atomic
+ * data, which differ if optically thin lines were culled.
+ *
+ * @param storage storage model data
+ * @param line_id index in line_list_nu
+ *
+ * @return index in the line list of the atomic data
+ */
+int64_t montecarlo_full_line_id (const storage_model_t * storage,
+					int64_t line_id);
+
+/** Index of the output and last interaction arrays a packet is recorded in.
+ *
+ * @param storage storage model data
+ * @param packet real packet
+ *
+ * @return slot of the packet, -1 if packet_tracking_stride skips it
+ */
+int64_t montecarlo_tracking_slot (const storage_model_t * storage,
+					 rpacket_t * packet);
+
+/** Record a real packet that left the ejecta or was reabsorbed: its
+ * output frequency and energy if it is tracked and, if storage bins
+ * the spectra, its energy in the emitted or reabsorbed spectrum and in
+ * the luminosity totals.
+ *
+ * @param storage storage model data
+ * @param packet the finished packet
+ * @param reabsorbed the packet was reabsorbed at the inner boundary
+ */
+void montecarlo_record_packet (storage_model_t * storage, rpacket_t * packet,
+			       bool reabsorbed);
+
+/** Copy a list of virtual packet chunks to the end of the virtual packet
+ * arrays of storage and free the chunks.
+ *
+ * @param storage storage model with sufficiently large virtual packet arrays
+ * @param chunk first chunk of the list
+ */
+void montecarlo_collect_virtual_packets (storage_model_t * storage,
+					 virt_packet_chunk_t * chunk);
+
+/** Set up the thread private view of the storage model.
+ *
+ * The view shares all model data with storage but owns a zeroed, cache line
+ * padded virtual spectrum, its own list of virtual packets and, if storage
+ * bins them, its own emitted and reabsorbed spectra. With thread
+ * private estimators it also owns zeroed js and nubars estimators and a
+ * lazily allocated blocked j_blue estimator.
+ *
+ * @param thread_storage storage model to initialize
+ * @param storage shared storage model
+ */
+void montecarlo_thread_storage_init (storage_model_t * thread_storage,
+				     storage_model_t * storage);
+
+/** Add one block of all thread private j_blue estimators to storage and free it.
+ *
+ * @param storage shared storage model
+ * @param thread_storages thread private views
+ * @param no_of_threads number of views
+ * @param block_id index of the block to reduce
+ */
+void montecarlo_reduce_j_blue_block (storage_model_t * storage,
+				     storage_model_t * thread_storages,
+				     int64_t no_of_threads, int64_t block_id);
+
+/** Add the spectra, the virtual packets and (if private) the js and
+ * nubars estimators of all thread private views to storage and release the
+ * views' buffers. Allocates the virtual packet arrays of storage.
+ *
+ * @param storage shared storage model
+ * @param thread_storages thread private views
+ * @param no_of_threads number of views
+ */
+void montecarlo_reduce_thread_storages (storage_model_t * storage,
+					storage_model_t * thread_storages,
+					int64_t no_of_threads);
+
+/** Wall clock time, used for the busy times of the threads.
+ *
+ * @return time in s since an arbitrary reference
+ */
+double montecarlo_wall_time (void);
+
+/** Run the Monte Carlo transport for all packets in the storage.
+ *
+ * The random number stream of every packet is keyed on seed + packet index,
+ * which makes the result reproducible for a given seed independent of nthreads
+ * and of the packet schedule.
+ *
+ * @param storage storage model data
+ * @param virtual_packet_flag number of virtual packets spawned per interaction
+ * @param nthreads number of OpenMP threads
+ * @param seed base seed of the random number streams
+ */
 void montecarlo_main_loop(storage_model_t * storage, 
 			  int64_t virtual_packet_flag,
 			  int nthreads, 
@@ -123,10 +452,10 @@ void montecarlo_main_loop(storage_model_t * storage,
 
 /* New handlers for continuum implementation */
 
-inline montecarlo_event_handler_t montecarlo_continuum_event_handler(rpacket_t * packet, storage_model_t * storage);
+montecarlo_event_handler_t montecarlo_continuum_event_handler(rpacket_t * packet, storage_model_t * storage, rng_state_t *rng_state);
 
-void montecarlo_free_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance);
+void montecarlo_free_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance, rng_state_t *rng_state);
 
-void montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance);
+void montecarlo_bound_free_scatter (rpacket_t * packet, storage_model_t * storage, double distance, rng_state_t *rng_state);
 
 #endif // TARDIS_CMONTECARLO_H
@@ -0,0 +1,372 @@
+#include <math.h>
+#include "rpacket.h"
+#include "distance_kernels.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define DISTANCE_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+/* Keep the compiler from fusing the multiplies and adds, also of the intrinsics. */
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#elif defined(__GNUC__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+/*
+   All implementations evaluate the expressions of rpacket_doppler_factor,
+   compute_distance2boundary and compute_distance2line in the same order of
+   operations and without fused multiply-adds, so that they give bitwise
+   identical results. The vector implementations only process full vectors,
+   the remaining lanes are handled by the scalar implementation.
+ */
+
+static void
+doppler_factor_scalar (int64_t n, const double *r, const double *mu,
+		       double inverse_time_explosion, double *doppler_factor)
+{
+  int64_t i;
+  for (i = 0; i < n; i++)
+    {
+      doppler_factor[i] = 1.0 - mu[i] * r[i] * inverse_time_explosion * INVERSE_C;
+    }
+}
+
+static void
+distance2boundary_scalar (int64_t n, const double *r, const double *mu,
+			  const int64_t *shell_id,
+			  const int64_t *recently_crossed_boundary,
+			  const double *r_inner, const double *r_outer,
+			  double *d_boundary, int64_t *next_shell_id)
+{
+  int64_t i;
+  for (i = 0; i < n; i++)
+    {
+      double r_out = r_outer[shell_id[i]];
+      double r_in = r_inner[shell_id[i]];
+      double d_outer =
+	sqrt (r_out * r_out + ((mu[i] * mu[i] - 1.0) * r[i] * r[i])) - (r[i] * mu[i]);
+      double check = r_in * r_in + (r[i] * r[i] * (mu[i] * mu[i] - 1.0));
+      double d_inner = (recently_crossed_boundary[i] != 1 && check >= 0.0 && mu[i] < 0.0) ?
+	-r[i] * mu[i] - sqrt (fabs (check)) : MISS_DISTANCE;
+      int64_t inwards = d_inner < d_outer;
+      d_boundary[i] = inwards ? d_inner : d_outer;
+      next_shell_id[i] = inwards ? -1 : 1;
+    }
+}
+
+static void
+distance2line_scalar (int64_t n, const double *r, const double *mu,
+		      const double *nu, const double *nu_line,
+		      const int64_t *last_line, double time_explosion,
+		      double inverse_time_explosion, double *d_line)
+{
+  int64_t i;
+  for (i = 0; i < n; i++)
+    {
+      double doppler_factor = 1.0 - mu[i] * r[i] * inverse_time_explosion * INVERSE_C;
+      double comov_nu = nu[i] * doppler_factor;
+      d_line[i] = last_line[i] ? MISS_DISTANCE :
+	((comov_nu - nu_line[i]) / nu[i]) * C * time_explosion;
+    }
+}
+
+#ifdef DISTANCE_KERNELS_X86
+
+__attribute__ ((target ("avx2"))) static int64_t
+doppler_factor_avx2 (int64_t n, const double *r, const double *mu,
+		     double inverse_time_explosion, double *doppler_factor)
+{
+  int64_t i;
+  __m256d one = _mm256_set1_pd (1.0);
+  __m256d inv_t = _mm256_set1_pd (inverse_time_explosion);
+  __m256d inv_c = _mm256_set1_pd (INVERSE_C);
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m256d x = _mm256_mul_pd (_mm256_loadu_pd (mu + i), _mm256_loadu_pd (r + i));
+      x = _mm256_mul_pd (_mm256_mul_pd (x, inv_t), inv_c);
+      _mm256_storeu_pd (doppler_factor + i, _mm256_sub_pd (one, x));
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx2"))) static int64_t
+distance2boundary_avx2 (int64_t n, const double *r, const double *mu,
+			const int64_t *shell_id,
+			const int64_t *recently_crossed_boundary,
+			const double *r_inner, const double *r_outer,
+			double *d_boundary, int64_t *next_shell_id)
+{
+  int64_t i;
+  __m256d zero = _mm256_setzero_pd ();
+  __m256d one = _mm256_set1_pd (1.0);
+  __m256d miss = _mm256_set1_pd (MISS_DISTANCE);
+  __m256d sign = _mm256_set1_pd (-0.0);
+  __m256i one_epi64 = _mm256_set1_epi64x (1);
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m256i shell = _mm256_loadu_si256 ((const __m256i *) (shell_id + i));
+      __m256i crossed = _mm256_loadu_si256 ((const __m256i *) (recently_crossed_boundary + i));
+      __m256d r_out = _mm256_i64gather_pd (r_outer, shell, 8);
+      __m256d r_in = _mm256_i64gather_pd (r_inner, shell, 8);
+      __m256d rv = _mm256_loadu_pd (r + i);
+      __m256d muv = _mm256_loadu_pd (mu + i);
+      __m256d mu2m1 = _mm256_sub_pd (_mm256_mul_pd (muv, muv), one);
+      __m256d r_mu = _mm256_mul_pd (rv, muv);
+      __m256d d_outer =
+	_mm256_sub_pd (_mm256_sqrt_pd (_mm256_add_pd (_mm256_mul_pd (r_out, r_out),
+						      _mm256_mul_pd (_mm256_mul_pd (mu2m1, rv), rv))),
+		       r_mu);
+      __m256d check = _mm256_add_pd (_mm256_mul_pd (r_in, r_in),
+				     _mm256_mul_pd (_mm256_mul_pd (rv, rv), mu2m1));
+      __m256d inner_possible =
+	_mm256_and_pd (_mm256_cmp_pd (check, zero, _CMP_GE_OQ),
+		       _mm256_cmp_pd (muv, zero, _CMP_LT_OQ));
+      __m256d d_inner, inwards;
+      inner_possible =
+	_mm256_andnot_pd (_mm256_castsi256_pd (_mm256_cmpeq_epi64 (crossed, one_epi64)),
+			  inner_possible);
+      d_inner = _mm256_sub_pd (_mm256_xor_pd (r_mu, sign), _mm256_sqrt_pd (check));
+      d_inner = _mm256_blendv_pd (miss, d_inner, inner_possible);
+      inwards = _mm256_cmp_pd (d_inner, d_outer, _CMP_LT_OQ);
+      _mm256_storeu_pd (d_boundary + i, _mm256_blendv_pd (d_outer, d_inner, inwards));
+      /* The comparison mask is -1 for inwards lanes, 1 + 2 * mask gives -1 or 1. */
+      _mm256_storeu_si256 ((__m256i *) (next_shell_id + i),
+			   _mm256_add_epi64 (one_epi64,
+					     _mm256_add_epi64 (_mm256_castpd_si256 (inwards),
+							       _mm256_castpd_si256 (inwards))));
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx2"))) static int64_t
+distance2line_avx2 (int64_t n, const double *r, const double *mu,
+		    const double *nu, const double *nu_line,
+		    const int64_t *last_line, double time_explosion,
+		    double inverse_time_explosion, double *d_line)
+{
+  int64_t i;
+  __m256d one = _mm256_set1_pd (1.0);
+  __m256d inv_t = _mm256_set1_pd (inverse_time_explosion);
+  __m256d inv_c = _mm256_set1_pd (INVERSE_C);
+  __m256d c_t = _mm256_set1_pd (C);
+  __m256d t_exp = _mm256_set1_pd (time_explosion);
+  __m256d miss = _mm256_set1_pd (MISS_DISTANCE);
+  __m256i zero_epi64 = _mm256_setzero_si256 ();
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m256d nuv = _mm256_loadu_pd (nu + i);
+      __m256d x = _mm256_mul_pd (_mm256_loadu_pd (mu + i), _mm256_loadu_pd (r + i));
+      __m256d doppler_factor = _mm256_sub_pd (one, _mm256_mul_pd (_mm256_mul_pd (x, inv_t), inv_c));
+      __m256d comov_nu = _mm256_mul_pd (nuv, doppler_factor);
+      __m256d d = _mm256_div_pd (_mm256_sub_pd (comov_nu, _mm256_loadu_pd (nu_line + i)), nuv);
+      __m256d no_line =
+	_mm256_castsi256_pd (_mm256_cmpeq_epi64 (_mm256_loadu_si256 ((const __m256i *) (last_line + i)),
+						 zero_epi64));
+      d = _mm256_mul_pd (_mm256_mul_pd (d, c_t), t_exp);
+      _mm256_storeu_pd (d_line + i, _mm256_blendv_pd (miss, d, no_line));
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx512f"))) static int64_t
+doppler_factor_avx512 (int64_t n, const double *r, const double *mu,
+		       double inverse_time_explosion, double *doppler_factor)
+{
+  int64_t i;
+  __m512d one = _mm512_set1_pd (1.0);
+  __m512d inv_t = _mm512_set1_pd (inverse_time_explosion);
+  __m512d inv_c = _mm512_set1_pd (INVERSE_C);
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m512d x = _mm512_mul_pd (_mm512_loadu_pd (mu + i), _mm512_loadu_pd (r + i));
+      x = _mm512_mul_pd (_mm512_mul_pd (x, inv_t), inv_c);
+      _mm512_storeu_pd (doppler_factor + i, _mm512_sub_pd (one, x));
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx512f"))) static int64_t
+distance2boundary_avx512 (int64_t n, const double *r, const double *mu,
+			  const int64_t *shell_id,
+			  const int64_t *recently_crossed_boundary,
+			  const double *r_inner, const double *r_outer,
+			  double *d_boundary, int64_t *next_shell_id)
+{
+  int64_t i;
+  __m512d zero = _mm512_setzero_pd ();
+  __m512d one = _mm512_set1_pd (1.0);
+  __m512d miss = _mm512_set1_pd (MISS_DISTANCE);
+  __m512i sign = _mm512_set1_epi64 (INT64_MIN);
+  __m512i one_epi64 = _mm512_set1_epi64 (1);
+  __m512i minus_one_epi64 = _mm512_set1_epi64 (-1);
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m512i shell = _mm512_loadu_si512 ((const void *) (shell_id + i));
+      __m512i crossed = _mm512_loadu_si512 ((const void *) (recently_crossed_boundary + i));
+      __m512d r_out = _mm512_i64gather_pd (shell, r_outer, 8);
+      __m512d r_in = _mm512_i64gather_pd (shell, r_inner, 8);
+      __m512d rv = _mm512_loadu_pd (r + i);
+      __m512d muv = _mm512_loadu_pd (mu + i);
+      __m512d mu2m1 = _mm512_sub_pd (_mm512_mul_pd (muv, muv), one);
+      __m512d r_mu = _mm512_mul_pd (rv, muv);
+      __m512d d_outer =
+	_mm512_sub_pd (_mm512_sqrt_pd (_mm512_add_pd (_mm512_mul_pd (r_out, r_out),
+						      _mm512_mul_pd (_mm512_mul_pd (mu2m1, rv), rv))),
+		       r_mu);
+      __m512d check = _mm512_add_pd (_mm512_mul_pd (r_in, r_in),
+				     _mm512_mul_pd (_mm512_mul_pd (rv, rv), mu2m1));
+      __mmask8 inner_possible = _mm512_cmp_pd_mask (check, zero, _CMP_GE_OQ) &
+	_mm512_cmp_pd_mask (muv, zero, _CMP_LT_OQ) &
+	_mm512_cmpneq_epi64_mask (crossed, one_epi64);
+      __m512d d_inner =
+	_mm512_sub_pd (_mm512_castsi512_pd (_mm512_xor_si512 (_mm512_castpd_si512 (r_mu), sign)),
+		       _mm512_sqrt_pd (check));
+      __mmask8 inwards;
+      d_inner = _mm512_mask_blend_pd (inner_possible, miss, d_inner);
+      inwards = _mm512_cmp_pd_mask (d_inner, d_outer, _CMP_LT_OQ);
+      _mm512_storeu_pd (d_boundary + i, _mm512_mask_blend_pd (inwards, d_outer, d_inner));
+      _mm512_storeu_si512 ((void *) (next_shell_id + i),
+			   _mm512_mask_blend_epi64 (inwards, one_epi64, minus_one_epi64));
+    }
+  return i;
+}
+
+__attribute__ ((target ("avx512f"))) static int64_t
+distance2line_avx512 (int64_t n, const double *r, const double *mu,
+		      const double *nu, const double *nu_line,
+		      const int64_t *last_line, double time_explosion,
+		      double inverse_time_explosion, double *d_line)
+{
+  int64_t i;
+  __m512d one = _mm512_set1_pd (1.0);
+  __m512d inv_t = _mm512_set1_pd (inverse_time_explosion);
+  __m512d inv_c = _mm512_set1_pd (INVERSE_C);
+  __m512d c_t = _mm512_set1_pd (C);
+  __m512d t_exp = _mm512_set1_pd (time_explosion);
+  __m512d miss = _mm512_set1_pd (MISS_DISTANCE);
+  __m512i zero_epi64 = _mm512_setzero_si512 ();
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m512d nuv = _mm512_loadu_pd (nu + i);
+      __m512d x = _mm512_mul_pd (_mm512_loadu_pd (mu + i), _mm512_loadu_pd (r + i));
+      __m512d doppler_factor = _mm512_sub_pd (one, _mm512_mul_pd (_mm512_mul_pd (x, inv_t), inv_c));
+      __m512d comov_nu = _mm512_mul_pd (nuv, doppler_factor);
+      __m512d d = _mm512_div_pd (_mm512_sub_pd (comov_nu, _mm512_loadu_pd (nu_line + i)), nuv);
+      __mmask8 no_line =
+	_mm512_cmpeq_epi64_mask (_mm512_loadu_si512 ((const void *) (last_line + i)), zero_epi64);
+      d = _mm512_mul_pd (_mm512_mul_pd (d, c_t), t_exp);
+      _mm512_storeu_pd (d_line + i, _mm512_mask_blend_pd (no_line, miss, d));
+    }
+  return i;
+}
+
+#endif // DISTANCE_KERNELS_X86
+
+static distance_kernels_isa_t distance_kernels_isa = DISTANCE_KERNELS_SCALAR;
+
+int64_t
+distance_kernels_supported (distance_kernels_isa_t isa)
+{
+  switch (isa)
+    {
+    case DISTANCE_KERNELS_SCALAR:
+      return 1;
+#ifdef DISTANCE_KERNELS_X86
+    case DISTANCE_KERNELS_AVX2:
+      return __builtin_cpu_supports ("avx2");
+    case DISTANCE_KERNELS_AVX512:
+      return __builtin_cpu_supports ("avx512f");
+#endif
+    default:
+      return 0;
+    }
+}
+
+distance_kernels_isa_t
+distance_kernels_select (distance_kernels_isa_t isa)
+{
+  if (isa == DISTANCE_KERNELS_BEST)
+    {
+      isa = DISTANCE_KERNELS_AVX512;
+      while (!distance_kernels_supported (isa))
+	{
+	  isa--;
+	}
+    }
+  else if (!distance_kernels_supported (isa))
+    {
+      isa = DISTANCE_KERNELS_SCALAR;
+    }
+  distance_kernels_isa = isa;
+  return isa;
+}
+
+void
+doppler_factor_lanes (int64_t n, const double *r, const double *mu,
+		      double inverse_time_explosion, double *doppler_factor)
+{
+  int64_t done = 0;
+#ifdef DISTANCE_KERNELS_X86
+  if (distance_kernels_isa == DISTANCE_KERNELS_AVX512)
+    {
+      done = doppler_factor_avx512 (n, r, mu, inverse_time_explosion, doppler_factor);
+    }
+  else if (distance_kernels_isa == DISTANCE_KERNELS_AVX2)
+    {
+      done = doppler_factor_avx2 (n, r, mu, inverse_time_explosion, doppler_factor);
+    }
+#endif
+  doppler_factor_scalar (n - done, r + done, mu + done, inverse_time_explosion,
+			 doppler_factor + done);
+}
+
+void
+distance2boundary_lanes (int64_t n, const double *r, const double *mu,
+			 const int64_t *shell_id,
+			 const int64_t *recently_crossed_boundary,
+			 const double *r_inner, const double *r_outer,
+			 double *d_boundary, int64_t *next_shell_id)
+{
+  int64_t done = 0;
+#ifdef DISTANCE_KERNELS_X86
+  if (distance_kernels_isa == DISTANCE_KERNELS_AVX512)
+    {
+      done = distance2boundary_avx512 (n, r, mu, shell_id, recently_crossed_boundary,
+				       r_inner, r_outer, d_boundary, next_shell_id);
+    }
+  else if (distance_kernels_isa == DISTANCE_KERNELS_AVX2)
+    {
+      done = distance2boundary_avx2 (n, r, mu, shell_id, recently_crossed_boundary,
+				     r_inner, r_outer, d_boundary, next_shell_id);
+    }
+#endif
+  distance2boundary_scalar (n - done, r + done, mu + done, shell_id + done,
+			    recently_crossed_boundary + done, r_inner, r_outer,
+			    d_boundary + done, next_shell_id + done);
+}
+
+void
+distance2line_lanes (int64_t n, const double *r, const double *mu,
+		     const double *nu, const double *nu_line,
+		     const int64_t *last_line, double time_explosion,
+		     double inverse_time_explosion, double *d_line)
+{
+  int64_t done = 0;
+#ifdef DISTANCE_KERNELS_X86
+  if (distance_kernels_isa == DISTANCE_KERNELS_AVX512)
+    {
+      done = distance2line_avx512 (n, r, mu, nu, nu_line, last_line, time_explosion,
+				   inverse_time_explosion, d_line);
+    }
+  else if (distance_kernels_isa == DISTANCE_KERNELS_AVX2)
+    {
+      done = distance2line_avx2 (n, r, mu, nu, nu_line, last_line, time_explosion,
+				 inverse_time_explosion, d_line);
+    }
+#endif
+  distance2line_scalar (n - done, r + done, mu + done, nu + done, nu_line + done,
+			last_line + done, time_explosion, inverse_time_explosion,
+			d_line + done);
+}
@@ -0,0 +1,87 @@
+#ifndef TARDIS_DISTANCE_KERNELS_H
+#define TARDIS_DISTANCE_KERNELS_H
+
+#include <stdint.h>
+
+/**
+ * @brief Instruction sets the distance kernels are available for.
+ */
+typedef enum
+{
+  DISTANCE_KERNELS_BEST = -1,
+  DISTANCE_KERNELS_SCALAR = 0,
+  DISTANCE_KERNELS_AVX2 = 1,
+  DISTANCE_KERNELS_AVX512 = 2
+} distance_kernels_isa_t;
+
+/** Select the implementation used by the distance kernels.
+ *
+ * The kernels use the scalar implementation until this is called. It must
+ * not be called while kernels are running on other threads.
+ *
+ * @param isa requested instruction set, DISTANCE_KERNELS_BEST for the best one the CPU supports
+ *
+ * @return the selected instruction set, DISTANCE_KERNELS_SCALAR if the requested one is not supported
+ */
+distance_kernels_isa_t distance_kernels_select (distance_kernels_isa_t isa);
+
+/** Check whether the CPU and the compiler support an instruction set.
+ *
+ * @param isa instruction set
+ *
+ * @return 1 if the kernels can run with isa, 0 otherwise
+ */
+int64_t distance_kernels_supported (distance_kernels_isa_t isa);
+
+/** Calculate the doppler factors of n packet lanes,
+ * the lane wise version of rpacket_doppler_factor.
+ *
+ * @param n number of lanes
+ * @param r distances from center in cm
+ * @param mu cosines of the angles of the packets
+ * @param inverse_time_explosion inverse time since explosion in 1/s
+ * @param doppler_factor resulting doppler factors
+ */
+void doppler_factor_lanes (int64_t n, const double *r, const double *mu,
+			   double inverse_time_explosion,
+			   double *doppler_factor);
+
+/** Calculate the distances of n packet lanes to their shell boundaries,
+ * the lane wise version of compute_distance2boundary.
+ *
+ * @param n number of lanes
+ * @param r distances from center in cm
+ * @param mu cosines of the angles of the packets
+ * @param shell_id current shell ids
+ * @param recently_crossed_boundary the packets sit on a shell boundary
+ * @param r_inner inner radii of the shells
+ * @param r_outer outer radii of the shells
+ * @param d_boundary resulting distances to the shell boundaries
+ * @param next_shell_id resulting directions of the next shells (-1 or 1)
+ */
+void distance2boundary_lanes (int64_t n, const double *r, const double *mu,
+			      const int64_t *shell_id,
+			      const int64_t *recently_crossed_boundary,
+			      const double *r_inner, const double *r_outer,
+			      double *d_boundary, int64_t *next_shell_id);
+
+/** Calculate the distances of n packet lanes to their next lines,
+ * the lane wise version of compute_distance2line. Lanes with
+ * comoving frequencies below their next line get negative distances.
+ *
+ * @param n number of lanes
+ * @param r distances from center in cm
+ * @param mu cosines of the angles of the packets
+ * @param nu frequencies of the packets in Hz
+ * @param nu_line frequencies of the next lines in Hz
+ * @param last_line the packets are red-ward of the last line
+ * @param time_explosion time since explosion in s
+ * @param inverse_time_explosion inverse time since explosion in 1/s
+ * @param d_line resulting distances to the next lines
+ */
+void distance2line_lanes (int64_t n, const double *r, const double *mu,
+			  const double *nu, const double *nu_line,
+			  const int64_t *last_line, double time_explosion,
+			  double inverse_time_explosion, double *d_line);
+
+#endif // TARDIS_DISTANCE_KERNELS_H
@@ -0,0 +1,36 @@
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "instrumentation.h"
+
+int64_t
+instrumentation_enabled (void)
+{
+#ifdef WITHINSTRUMENTATION
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+uint64_t
+instrumentation_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc ();
+#else
+  struct timespec now;
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+void
+instrumentation_record_event (instrumentation_counters_t * counters,
+			      instrumentation_event_t event,
+			      uint64_t start_ticks)
+{
+  counters->events[event]++;
+  counters->event_ticks[event] += instrumentation_ticks () - start_ticks;
+}
@@ -0,0 +1,67 @@
+#ifndef TARDIS_INSTRUMENTATION_H
+#define TARDIS_INSTRUMENTATION_H
+
+#include <stdint.h>
+
+/**
+ * @brief Events of a real packet that are counted and timed.
+ */
+typedef enum
+{
+  INSTRUMENTATION_LINE_SCATTER = 0,
+  INSTRUMENTATION_BOUNDARY_CROSSING = 1,
+  INSTRUMENTATION_THOMSON_SCATTER = 2,
+  INSTRUMENTATION_BOUND_FREE = 3,
+  INSTRUMENTATION_FREE_FREE = 4,
+  INSTRUMENTATION_NO_OF_EVENTS = 5
+} instrumentation_event_t;
+
+/**
+ * @brief Event counters of a thread.
+ *
+ * Only the instrumented build (WITHINSTRUMENTATION) updates them, the
+ * counting macros below compile to nothing otherwise.
+ */
+typedef struct InstrumentationCounters
+{
+  int64_t events[INSTRUMENTATION_NO_OF_EVENTS]; /**< Events of the real packets per type. */
+  uint64_t event_ticks[INSTRUMENTATION_NO_OF_EVENTS]; /**< Ticks spent in the event handlers, including the virtual packets they spawn. */
+  int64_t macro_atom_jumps; /**< Transitions of the macro atom. */
+  int64_t virtual_packets; /**< Virtual packets spawned. */
+  int64_t packets; /**< Real packets propagated. */
+} instrumentation_counters_t;
+
+#ifdef WITHINSTRUMENTATION
+#define INSTRUMENTATION_COUNT(counters, counter) ((counters)->counter++)
+#define INSTRUMENTATION_START(ticks) uint64_t ticks = instrumentation_ticks ()
+#define INSTRUMENTATION_EVENT(counters, event, ticks) \
+  instrumentation_record_event ((counters), (event), (ticks))
+#else
+#define INSTRUMENTATION_COUNT(counters, counter)
+#define INSTRUMENTATION_START(ticks)
+#define INSTRUMENTATION_EVENT(counters, event, ticks)
+#endif
+
+/** Check whether the extension was built with instrumentation.
+ *
+ * @return 1 if the counters are updated, 0 otherwise
+ */
+int64_t instrumentation_enabled (void);
+
+/** Read the tick counter the event handlers are timed with.
+ *
+ * @return CPU cycles on x86, nanoseconds of the monotonic clock elsewhere
+ */
+uint64_t instrumentation_ticks (void);
+
+/** Count an event and add the ticks spent on it.
+ *
+ * @param counters counters of the thread
+ * @param event type of the event
+ * @param start_ticks instrumentation_ticks before the event handler ran
+ */
+void instrumentation_record_event (instrumentation_counters_t * counters,
+				   instrumentation_event_t event,
+				   uint64_t start_ticks);
+
+#endif // TARDIS_INSTRUMENTATION_H
@@ -0,0 +1,207 @@
+#include <math.h>
+#include "rpacket.h"
+#include "packet_source.h"
+
+double
+sample_blackbody_nu (double temperature, double nu_start, double nu_end,
+		     rng_state_t *rng_state)
+{
+  double nu = nu_start;
+  int64_t rejections;
+  for (rejections = 0; rejections < BLACKBODY_MAX_REJECTIONS; rejections++)
+    {
+      /* Pick the term l of the series with probability l^-4 / (pi^4 / 90),
+	 then x = h nu / k T from the gamma distribution of that term. */
+      double target = rng_double (rng_state) * PI4_OVER_90;
+      double sum = 1.0;
+      double l = 1.0;
+      double product;
+      while (sum < target)
+	{
+	  l += 1.0;
+	  sum += 1.0 / (l * l * l * l);
+	}
+      product = rng_double (rng_state) * rng_double (rng_state) *
+	rng_double (rng_state) * rng_double (rng_state);
+      nu = -log (product) / l * KB * temperature / H;
+      if (nu >= nu_start && nu <= nu_end)
+	{
+	  return nu;
+	}
+    }
+  return nu < nu_start ? nu_start : nu_end;
+}
+
+void
+blackbody_cdf_init (double *cdf, int64_t size, double temperature,
+		    double nu_start, double nu_end)
+{
+  double delta_nu = (nu_end - nu_start) / size;
+  double last_intensity = 0.0;
+  int64_t i;
+  cdf[0] = 0.0;
+  for (i = 0; i <= size; i++)
+    {
+      double nu = nu_start + i * delta_nu;
+      double x = H * nu / (KB * temperature);
+      double intensity = x > 0.0 ? nu * nu * nu / expm1 (x) : 0.0;
+      if (i > 0)
+	{
+	  cdf[i] = cdf[i - 1] + 0.5 * (intensity + last_intensity);
+	}
+      last_intensity = intensity;
+    }
+  for (i = 1; i <= size; i++)
+    {
+      cdf[i] /= cdf[size];
+    }
+}
+
+double
+blackbody_cdf_nu (const double *cdf, int64_t size, double nu_start,
+		  double nu_end, double u)
+{
+  int64_t imin = 0;
+  int64_t imax = size;
+  /* Find the bin with cdf[imin] <= u < cdf[imin + 1]. */
+  while (imax - imin > 1)
+    {
+      int64_t imid = (imin + imax) / 2;
+      if (cdf[imid] <= u)
+	{
+	  imin = imid;
+	}
+      else
+	{
+	  imax = imid;
+	}
+    }
+  return nu_start + (imin + (u - cdf[imin]) / (cdf[imin + 1] - cdf[imin])) *
+    (nu_end - nu_start) / size;
+}
+
+void
+packet_source_init (storage_model_t *storage)
+{
+  if (storage->packet_source == PACKET_SOURCE_ARRAYS)
+    {
+      return;
+    }
+  int64_t size = storage->packet_block_size > 0 &&
+    storage->packet_block_size < storage->no_of_packets ?
+    storage->packet_block_size : storage->no_of_packets;
+  storage->packet_nus = (double *) malloc (sizeof (double) * size);
+  storage->packet_mus = (double *) malloc (sizeof (double) * size);
+  storage->packet_energies = (double *) malloc (sizeof (double) * size);
+  if (storage->packet_source == PACKET_SOURCE_SOBOL)
+    {
+      rk_state mt_state;
+      storage->packet_source_cdf = (double *) malloc (sizeof (double) * (PACKET_SOURCE_CDF_SIZE + 1));
+      blackbody_cdf_init (storage->packet_source_cdf, PACKET_SOURCE_CDF_SIZE,
+			  storage->packet_source_temperature,
+			  storage->packet_source_nu_start, storage->packet_source_nu_end);
+      /* The first dimensions have tabulated directions, so the seed only shifts the points. */
+      rk_seed (storage->packet_source_seed, &mt_state);
+      rk_sobol_init (PACKET_SOURCE_SOBOL_DIMENSION, &storage->packet_source_sobol,
+		     &mt_state, rk_sobol_Ldirections, NULL);
+      rk_sobol_randomshift (&storage->packet_source_sobol, &mt_state);
+    }
+}
+
+void
+packet_source_free (storage_model_t *storage)
+{
+  if (storage->packet_source == PACKET_SOURCE_ARRAYS)
+    {
+      return;
+    }
+  free (storage->packet_nus);
+  free (storage->packet_mus);
+  free (storage->packet_energies);
+  storage->packet_nus = NULL;
+  storage->packet_mus = NULL;
+  storage->packet_energies = NULL;
+  if (storage->packet_source == PACKET_SOURCE_SOBOL)
+    {
+      free (storage->packet_source_cdf);
+      storage->packet_source_cdf = NULL;
+      rk_sobol_free (&storage->packet_source_sobol);
+    }
+}
+
+/** Move a Sobol generator to an arbitrary point of its sequence.
+ *
+ * After n draws rk_sobol_double has XORed the shift with the directions
+ * of the bits that are set in the Gray code of n.
+ *
+ * @param sobol generator with its own numerators and the shared directions
+ * @param shift numerators of the randomly shifted generator before its first draw
+ * @param count number of points to skip
+ */
+static void
+sobol_seek (rk_sobol_state *sobol, const unsigned long *shift,
+	    unsigned long count)
+{
+  unsigned long gray = count ^ (count >> 1);
+  size_t j, k;
+  for (k = 0; k < sobol->dimension; k++)
+    {
+      sobol->numerator[k] = shift[k];
+    }
+  for (j = 0; gray != 0; j++, gray >>= 1)
+    {
+      if (gray & 1)
+	{
+	  for (k = 0; k < sobol->dimension; k++)
+	    {
+	      sobol->numerator[k] ^= sobol->direction[j * sobol->dimension + k];
+	    }
+	}
+    }
+  sobol->count = count;
+}
+
+void
+packet_source_create_packets (storage_model_t *storage, int64_t first_packet,
+			      int64_t last_packet)
+{
+  rng_state_t rng_state;
+  rk_sobol_state sobol;
+  unsigned long numerator[PACKET_SOURCE_SOBOL_DIMENSION];
+  double x[PACKET_SOURCE_SOBOL_DIMENSION];
+  double energy = 1.0 / storage->no_of_packets;
+  int64_t packet_index;
+  rng_init (&rng_state, storage->rng_backend);
+  if (storage->packet_source == PACKET_SOURCE_SOBOL)
+    {
+      /* Every chunk works on its own numerators, the directions are shared. */
+      sobol = storage->packet_source_sobol;
+      sobol.numerator = numerator;
+      sobol_seek (&sobol, storage->packet_source_sobol.numerator, first_packet);
+    }
+  for (packet_index = first_packet; packet_index < last_packet; packet_index++)
+    {
+      int64_t i = packet_index - storage->packet_block_start;
+      if (storage->packet_source == PACKET_SOURCE_SOBOL)
+	{
+	  rk_sobol_double (&sobol, x);
+	  storage->packet_nus[i] =
+	    blackbody_cdf_nu (storage->packet_source_cdf, PACKET_SOURCE_CDF_SIZE,
+			      storage->packet_source_nu_start,
+			      storage->packet_source_nu_end, x[0]);
+	  storage->packet_mus[i] = sqrt (x[1]);
+	}
+      else
+	{
+	  rng_seed (&rng_state, storage->packet_source_seed + packet_index);
+	  storage->packet_nus[i] =
+	    sample_blackbody_nu (storage->packet_source_temperature,
+				 storage->packet_source_nu_start,
+				 storage->packet_source_nu_end, &rng_state);
+	  /* An isotropic intensity at the inner boundary gives mu = sqrt(z). */
+	  storage->packet_mus[i] = sqrt (rng_double (&rng_state));
+	}
+      storage->packet_energies[i] = energy;
+    }
+  rng_free (&rng_state);
+}
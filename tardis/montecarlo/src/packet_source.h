@@ -0,0 +1,92 @@
+#ifndef TARDIS_PACKET_SOURCE_H
+#define TARDIS_PACKET_SOURCE_H
+
+#include <stdint.h>
+#include "randomkit/randomkit.h"
+#include "rng.h"
+#include "status.h"
+#include "storage.h"
+
+/* Upper limit of the series sum_{l=1}^{inf} l^-4 = pi^4 / 90. */
+#define PI4_OVER_90 1.082323233711138
+/* Number of out of range frequencies after which a sample is clamped to the range. */
+#define BLACKBODY_MAX_REJECTIONS 10000
+/* Number of packets a thread creates at a time. */
+#define PACKET_SOURCE_CHUNK_SIZE 1024
+/* Number of frequency bins of the tabulated black body of PACKET_SOURCE_SOBOL. */
+#define PACKET_SOURCE_CDF_SIZE 65536
+/* The Sobol points have one coordinate for nu and one for mu. */
+#define PACKET_SOURCE_SOBOL_DIMENSION 2
+
+/** Draw a frequency from a Planck distribution.
+ *
+ * Uses the analytic sampling of Bjorkman & Wood (2001), which needs no
+ * table and five random numbers per attempt. Frequencies outside of
+ * [nu_start, nu_end] are rejected.
+ *
+ * @param temperature temperature of the black body in K
+ * @param nu_start lowest frequency in Hz
+ * @param nu_end highest frequency in Hz
+ * @param rng_state random number generator state
+ *
+ * @return frequency in Hz
+ */
+double sample_blackbody_nu (double temperature, double nu_start, double nu_end,
+			    rng_state_t *rng_state);
+
+/** Tabulate the cumulative Planck distribution on a regular frequency grid.
+ *
+ * @param cdf resulting cumulative distribution at the size + 1 bin edges, normalized to 1
+ * @param size number of bins
+ * @param temperature temperature of the black body in K
+ * @param nu_start lowest frequency in Hz
+ * @param nu_end highest frequency in Hz
+ */
+void blackbody_cdf_init (double *cdf, int64_t size, double temperature,
+			 double nu_start, double nu_end);
+
+/** Invert a tabulated cumulative distribution, with a constant
+ * probability density within every bin.
+ *
+ * @param cdf cumulative distribution from blackbody_cdf_init
+ * @param size number of bins
+ * @param nu_start lowest frequency in Hz
+ * @param nu_end highest frequency in Hz
+ * @param u uniform deviate in [0, 1)
+ *
+ * @return frequency in Hz
+ */
+double blackbody_cdf_nu (const double *cdf, int64_t size, double nu_start,
+			 double nu_end, double u);
+
+/** Allocate the packet arrays and the sampling state of the packet source.
+ * The arrays hold one block of packets if packet_block_size is set.
+ *
+ * Does nothing for PACKET_SOURCE_ARRAYS, where the packets are given.
+ *
+ * @param storage storage model
+ */
+void packet_source_init (storage_model_t *storage);
+
+/** Free what packet_source_init allocated, including the packets.
+ *
+ * @param storage storage model
+ */
+void packet_source_free (storage_model_t *storage);
+
+/** Create the packets [first_packet, last_packet) at the inner boundary.
+ *
+ * The packets do not depend on the number of threads that create them:
+ * with PACKET_SOURCE_BLACKBODY every packet is drawn from its own stream
+ * keyed on packet_source_seed and the packet index, with
+ * PACKET_SOURCE_SOBOL packet i is point i of a randomly shifted Sobol
+ * sequence. The arrays of storage start at packet packet_block_start.
+ *
+ * @param storage storage model with the packet arrays to fill
+ * @param first_packet index of the first packet
+ * @param last_packet index after the last packet
+ */
+void packet_source_create_packets (storage_model_t *storage, int64_t first_packet,
+				   int64_t last_packet);
+
+#endif // TARDIS_PACKET_SOURCE_H
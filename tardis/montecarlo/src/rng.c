@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include "rng.h"
+
+/** Expand a seed into well mixed 64 bit words, as recommended for
+ * seeding xoshiro256**.
+ *
+ * @param x splitmix64 state, advanced by the call
+ *
+ * @return next word
+ */
+static uint64_t
+splitmix64 (uint64_t *x)
+{
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static inline uint64_t
+rotl (uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+/* A zeroed Mersenne Twister state, so that an unseeded stream is still well defined. */
+void
+rng_init (rng_state_t *rng_state, rng_backend_t backend)
+{
+  rng_state->backend = backend;
+  rng_state->mt = NULL;
+  if (backend == RNG_BACKEND_MT)
+    {
+      rng_state->mt = (rk_state *) calloc (1, sizeof (rk_state));
+    }
+  rng_state->xoshiro.next = RNG_BUFFER_SIZE;
+}
+
+void
+rng_free (rng_state_t *rng_state)
+{
+  free (rng_state->mt);
+  rng_state->mt = NULL;
+}
+
+void
+rng_seed (rng_state_t *rng_state, unsigned long seed)
+{
+  if (rng_state->backend == RNG_BACKEND_XOSHIRO)
+    {
+      uint64_t x = seed;
+      int k;
+      for (k = 0; k < 4; k++)
+	{
+	  rng_state->xoshiro.s[k] = splitmix64 (&x);
+	}
+      rng_state->xoshiro.next = RNG_BUFFER_SIZE;
+    }
+  else
+    {
+      rk_seed (seed, rng_state->mt);
+    }
+}
+
+void
+rng_fill (rng_state_t *rng_state)
+{
+  uint64_t *s = rng_state->xoshiro.s;
+  int64_t i;
+  for (i = 0; i < RNG_BUFFER_SIZE; i++)
+    {
+      uint64_t result = rotl (s[1] * 5, 7) * 9;
+      uint64_t t = s[1] << 17;
+      s[2] ^= s[0];
+      s[3] ^= s[1];
+      s[1] ^= s[2];
+      s[0] ^= s[3];
+      s[2] ^= t;
+      s[3] = rotl (s[3], 45);
+      /* The upper 53 bits give every double of [0, 1) on a 2^-53 grid. */
+      rng_state->xoshiro.buffer[i] = (result >> 11) * (1.0 / 9007199254740992.0);
+    }
+  rng_state->xoshiro.next = 0;
+}
@@ -0,0 +1,87 @@
+#ifndef TARDIS_RNG_H
+#define TARDIS_RNG_H
+
+#include <stdint.h>
+#include "randomkit/randomkit.h"
+
+/* Number of doubles xoshiro256** generates at a time. */
+#define RNG_BUFFER_SIZE 16
+
+/**
+ * @brief Random number generators of the Monte Carlo kernel.
+ */
+typedef enum
+{
+  RNG_BACKEND_MT = 0, /**< Mersenne Twister of randomkit, the reference, expensive to seed. */
+  RNG_BACKEND_XOSHIRO = 1 /**< xoshiro256**, 32 bytes of generator state and cheap to seed. */
+} rng_backend_t;
+
+/**
+ * @brief State of xoshiro256** with the doubles it generated ahead.
+ */
+typedef struct XoshiroState
+{
+  int64_t next; /**< Index of the next unused double in buffer. */
+  uint64_t s[4]; /**< State of xoshiro256**. */
+  double buffer[RNG_BUFFER_SIZE]; /**< Doubles generated ahead. */
+} xoshiro_state_t;
+
+/**
+ * @brief State of a random number stream. The Mersenne Twister keeps its
+ * 2.5 kB state out of line, so that a xoshiro256** stream stays small.
+ */
+typedef struct RNGState
+{
+  rng_backend_t backend;
+  rk_state *mt; /**< State of the Mersenne Twister, NULL for xoshiro256**. */
+  xoshiro_state_t xoshiro; /**< State of xoshiro256**. */
+} rng_state_t;
+
+/** Set up a random number stream, allocating the Mersenne Twister state
+ * if the backend needs one. The stream has to be seeded before use.
+ *
+ * @param rng_state stream to set up
+ * @param backend generator of the stream
+ */
+void rng_init (rng_state_t *rng_state, rng_backend_t backend);
+
+/** Free the state allocated by rng_init.
+ *
+ * @param rng_state stream to free
+ */
+void rng_free (rng_state_t *rng_state);
+
+/** Seed a random number stream.
+ *
+ * @param rng_state stream to seed, set up by rng_init
+ * @param seed seed, streams of neighbouring seeds are independent
+ */
+void rng_seed (rng_state_t *rng_state, unsigned long seed);
+
+/** Refill the buffer of a xoshiro256** stream.
+ *
+ * @param rng_state stream with an exhausted buffer
+ */
+void rng_fill (rng_state_t *rng_state);
+
+/** Draw a uniform deviate.
+ *
+ * @param rng_state stream to draw from
+ *
+ * @return a double in [0, 1)
+ */
+static inline double
+rng_double (rng_state_t *rng_state)
+{
+  if (rng_state->backend == RNG_BACKEND_MT)
+    {
+      return rk_double (rng_state->mt);
+    }
+  if (rng_state->xoshiro.next == RNG_BUFFER_SIZE)
+    {
+      rng_fill (rng_state);
+    }
+  return rng_state->xoshiro.buffer[rng_state->xoshiro.next++];
+}
+
+#endif // TARDIS_RNG_H
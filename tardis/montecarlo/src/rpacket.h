@@ -3,11 +3,12 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
-#include "randomkit/randomkit.h"
+#include "rng.h"
 #include "status.h"
 #include "storage.h"
 
@@ -23,8 +24,28 @@
 #define H 6.6260755e-27		// erg * s, converted to CGS units from the NIST Constant Index
 #define KB 1.3806488e-16	// erg / K converted to CGS units from the NIST Constant Index
 
+/* Bits of rpacket_t.flags. */
+#define RPACKET_LAST_LINE 0x01
+#define RPACKET_CLOSE_LINE 0x02
+
+/**
+ * @brief Opacities of the continuum processes, only read with the continuum on.
+ */
+typedef struct RPacketContinuum
+{
+  double chi_th; /**< Opacity due to electron scattering */
+  double chi_ff; /**< Opacity due to free-free processes */
+  double chi_bf; /**< Opacity due to bound-free processes */
+  double d_electron; /**< Distance to electron event. */
+  int64_t current_continuum_id; /* Packet can interact with bf-continua with an index equal or bigger than this */
+} rpacket_continuum_t;
+
 /**
  * @brief A photon packet.
+ *
+ * The transport state up to flags fills one cache line, followed by the
+ * packet id, the distances to the next events and the continuum opacities.
+ * Only the transport state is copied into a virtual packet.
  */
 typedef struct RPacket
 {
@@ -34,159 +55,372 @@ typedef struct RPacket
   double r; /**< Distance from center in cm. */
   double tau_event;
   double nu_line;
-  int64_t current_shell_id; /**< ID of the current shell. */
-  int64_t next_line_id;	/**< The index of the next line that the packet will encounter. */
+  int32_t current_shell_id; /**< ID of the current shell. */
+  int32_t next_line_id;	/**< The index of the next line that the packet will encounter. */
   /**
-   * @brief The packet has a nu red-ward of the last line.
-   * It will not encounter any lines anymore.
-   */
-  int64_t last_line;
-  /** 
-   * @brief The packet just encountered a line that is very close to the next line.
-   * The next iteration will automatically make an interaction with the next line 
-   * (avoiding numerical problems).
-   */
-  int64_t close_line;
-  /** 
    * @brief The packet has recently crossed the boundary and is now sitting on the boundary.
    * To avoid numerical errors, make sure that d_inner is not calculated. The value is -1
    * if the packed moved inwards, 1 if the packet moved outwards and 0 otherwise.
    */
-  int64_t recently_crossed_boundary;
+  int16_t recently_crossed_boundary;
   /**
    * @brief packet is a virtual packet and will ignore any d_line or d_electron checks.
    * It now whenever a d_line is calculated only adds the tau_line to an
    * internal float.
    */
-  int64_t current_continuum_id; /* Packet can interact with bf-continua with an index equal or bigger than this */
-  int64_t virtual_packet_flag;
-  int64_t virtual_packet;
-  double d_line; /**< Distance to electron event. */
-  double d_electron; /**< Distance to line event. */
+  int16_t virtual_packet;
+  int16_t next_shell_id; /**< shell id that the packet will go to next, -1 inwards and 1 outwards. */
+  uint8_t status; /**< Packet status (in process, emitted or reabsorbed), a rpacket_status_t. */
+  /**
+   * @brief Bit flags of the packet:
+   * - RPACKET_LAST_LINE: the packet has a nu red-ward of the last line.
+   *   It will not encounter any lines anymore.
+   * - RPACKET_CLOSE_LINE: the packet just encountered a line that is very
+   *   close to the next line. The next iteration will automatically make an
+   *   interaction with the next line (avoiding numerical problems).
+   */
+  uint8_t flags;
+  int64_t id;
+  int16_t virtual_packet_flag; /**< Number of virtual packets spawned at every interaction. */
+  double d_line; /**< Distance to line event. */
   double d_boundary; /**< Distance to shell boundary. */
   double d_cont; /**< Distance to continuum event */
-  int64_t next_shell_id; /**< ID of the next shell packet visits. */
-  rpacket_status_t status; /**< Packet status (in process, emitted or reabsorbed). */
-  int64_t id;
-  double chi_th; /**< Opacity due to electron scattering */
   double chi_cont; /**< Opacity due to continuum processes */
-  double chi_ff; /**< Opacity due to free-free processes */
-  double chi_bf; /**< Opacity due to bound-free processes */
+  rpacket_continuum_t continuum;
 } rpacket_t;
 
-inline double rpacket_get_nu (rpacket_t * packet);
+/* Size of the transport state, which must fit in a cache line. */
+#define RPACKET_CORE_SIZE offsetof (rpacket_t, id)
+typedef char rpacket_core_size_check[RPACKET_CORE_SIZE <= 64 ? 1 : -1];
 
-inline void rpacket_set_nu (rpacket_t * packet, double nu);
+/** Set or clear a bit of the flags of a packet.
+ *
+ * @param packet rpacket structure
+ * @param flag RPACKET_ bit
+ * @param value set the bit if true
+ */
+static inline void
+rpacket_set_flag (rpacket_t * packet, uint8_t flag, bool value)
+{
+  packet->flags = value ? (packet->flags | flag) : (packet->flags & ~flag);
+}
 
-inline double rpacket_get_mu (rpacket_t * packet);
+/*
+  Getter and setter methods, defined here so that they are inlined into
+  the kernel.
+*/
 
-inline void rpacket_set_mu (rpacket_t * packet, double mu);
+static inline double
+rpacket_get_nu (rpacket_t * packet)
+{
+  return packet->nu;
+}
 
-inline double rpacket_get_energy (rpacket_t * packet);
+static inline void
+rpacket_set_nu (rpacket_t * packet, double nu)
+{
+  packet->nu = nu;
+}
 
-inline void rpacket_set_energy (rpacket_t * packet, double energy);
+static inline double
+rpacket_get_mu (rpacket_t * packet)
+{
+  return packet->mu;
+}
 
-inline double rpacket_get_r (rpacket_t * packet);
+static inline void
+rpacket_set_mu (rpacket_t * packet, double mu)
+{
+  packet->mu = mu;
+}
 
-inline void rpacket_set_r (rpacket_t * packet, double r);
+static inline double
+rpacket_get_energy (rpacket_t * packet)
+{
+  return packet->energy;
+}
 
-inline double rpacket_get_tau_event (rpacket_t * packet);
+static inline void
+rpacket_set_energy (rpacket_t * packet, double energy)
+{
+  packet->energy = energy;
+}
 
-inline void rpacket_set_tau_event (rpacket_t * packet, double tau_event);
+static inline double
+rpacket_get_r (rpacket_t * packet)
+{
+  return packet->r;
+}
 
-inline double rpacket_get_nu_line (rpacket_t * packet);
+static inline void
+rpacket_set_r (rpacket_t * packet, double r)
+{
+  packet->r = r;
+}
 
-inline void rpacket_set_nu_line (rpacket_t * packet, double nu_line);
+static inline double
+rpacket_get_tau_event (rpacket_t * packet)
+{
+  return packet->tau_event;
+}
 
-inline unsigned int rpacket_get_current_shell_id (rpacket_t * packet);
+static inline void
+rpacket_set_tau_event (rpacket_t * packet, double tau_event)
+{
+  packet->tau_event = tau_event;
+}
 
-inline void rpacket_set_current_shell_id (rpacket_t * packet,
-            unsigned int current_shell_id);
+static inline double
+rpacket_get_nu_line (rpacket_t * packet)
+{
+  return packet->nu_line;
+}
 
-inline unsigned int rpacket_get_next_line_id (rpacket_t * packet);
+static inline void
+rpacket_set_nu_line (rpacket_t * packet, double nu_line)
+{
+  packet->nu_line = nu_line;
+}
 
-inline void rpacket_set_next_line_id (rpacket_t * packet,
-              unsigned int next_line_id);
+static inline unsigned int
+rpacket_get_current_shell_id (rpacket_t * packet)
+{
+  return packet->current_shell_id;
+}
+
+static inline void
+rpacket_set_current_shell_id (rpacket_t * packet,
+            unsigned int current_shell_id)
+{
+  packet->current_shell_id = current_shell_id;
+}
+
+static inline unsigned int
+rpacket_get_next_line_id (rpacket_t * packet)
+{
+  return packet->next_line_id;
+}
 
-inline bool rpacket_get_last_line (rpacket_t * packet);
+static inline void
+rpacket_set_next_line_id (rpacket_t * packet, unsigned int next_line_id)
+{
+  packet->next_line_id = next_line_id;
+}
 
-inline void rpacket_set_last_line (rpacket_t * packet, bool last_line);
+static inline bool
+rpacket_get_last_line (rpacket_t * packet)
+{
+  return (packet->flags & RPACKET_LAST_LINE) != 0;
+}
 
-inline bool rpacket_get_close_line (rpacket_t * packet);
+static inline void
+rpacket_set_last_line (rpacket_t * packet, bool last_line)
+{
+  rpacket_set_flag (packet, RPACKET_LAST_LINE, last_line);
+}
 
-inline void rpacket_set_close_line (rpacket_t * packet, bool close_line);
+static inline bool
+rpacket_get_close_line (rpacket_t * packet)
+{
+  return (packet->flags & RPACKET_CLOSE_LINE) != 0;
+}
 
-inline int rpacket_get_recently_crossed_boundary (rpacket_t * packet);
+static inline void
+rpacket_set_close_line (rpacket_t * packet, bool close_line)
+{
+  rpacket_set_flag (packet, RPACKET_CLOSE_LINE, close_line);
+}
 
-inline void rpacket_set_recently_crossed_boundary (rpacket_t * packet,
-               int
-               recently_crossed_boundary);
+static inline int
+rpacket_get_recently_crossed_boundary (rpacket_t * packet)
+{
+  return packet->recently_crossed_boundary;
+}
 
-inline int rpacket_get_virtual_packet_flag (rpacket_t * packet);
+static inline void
+rpacket_set_recently_crossed_boundary (rpacket_t * packet,
+               int recently_crossed_boundary)
+{
+  packet->recently_crossed_boundary = recently_crossed_boundary;
+}
 
-inline void rpacket_set_virtual_packet_flag (rpacket_t * packet,
-               int virtual_packet_flag);
+static inline int
+rpacket_get_virtual_packet_flag (rpacket_t * packet)
+{
+  return packet->virtual_packet_flag;
+}
 
-inline int rpacket_get_virtual_packet (rpacket_t * packet);
+static inline void
+rpacket_set_virtual_packet_flag (rpacket_t * packet, int virtual_packet_flag)
+{
+  packet->virtual_packet_flag = virtual_packet_flag;
+}
 
-inline void rpacket_set_virtual_packet (rpacket_t * packet,
-          int virtual_packet);
+static inline int
+rpacket_get_virtual_packet (rpacket_t * packet)
+{
+  return packet->virtual_packet;
+}
 
-inline double rpacket_get_d_boundary (rpacket_t * packet);
+static inline void
+rpacket_set_virtual_packet (rpacket_t * packet, int virtual_packet)
+{
+  packet->virtual_packet = virtual_packet;
+}
 
-inline void rpacket_set_d_boundary (rpacket_t * packet, double d_boundary);
+static inline double
+rpacket_get_d_boundary (rpacket_t * packet)
+{
+  return packet->d_boundary;
+}
 
-inline double rpacket_get_d_electron (rpacket_t * packet);
+static inline void
+rpacket_set_d_boundary (rpacket_t * packet, double d_boundary)
+{
+  packet->d_boundary = d_boundary;
+}
 
-inline void rpacket_set_d_electron (rpacket_t * packet, double d_electron);
+static inline double
+rpacket_get_d_electron (rpacket_t * packet)
+{
+  return packet->continuum.d_electron;
+}
 
-inline double rpacket_get_d_line (rpacket_t * packet);
+static inline void
+rpacket_set_d_electron (rpacket_t * packet, double d_electron)
+{
+  packet->continuum.d_electron = d_electron;
+}
 
-inline void rpacket_set_d_line (rpacket_t * packet, double d_line);
+static inline double
+rpacket_get_d_line (rpacket_t * packet)
+{
+  return packet->d_line;
+}
 
-inline int rpacket_get_next_shell_id (rpacket_t * packet);
+static inline void
+rpacket_set_d_line (rpacket_t * packet, double d_line)
+{
+  packet->d_line = d_line;
+}
 
-inline void rpacket_set_next_shell_id (rpacket_t * packet, int next_shell_id);
+static inline int
+rpacket_get_next_shell_id (rpacket_t * packet)
+{
+  return packet->next_shell_id;
+}
 
-inline rpacket_status_t rpacket_get_status (rpacket_t * packet);
+static inline void
+rpacket_set_next_shell_id (rpacket_t * packet, int next_shell_id)
+{
+  packet->next_shell_id = next_shell_id;
+}
 
-inline void rpacket_set_status (rpacket_t * packet, rpacket_status_t status);
+static inline rpacket_status_t
+rpacket_get_status (rpacket_t * packet)
+{
+  return (rpacket_status_t) packet->status;
+}
 
-inline int rpacket_get_id (rpacket_t * packet);
+static inline void
+rpacket_set_status (rpacket_t * packet, rpacket_status_t status)
+{
+  packet->status = status;
+}
 
-inline void rpacket_set_id (rpacket_t * packet, int id);
+static inline int64_t
+rpacket_get_id (rpacket_t * packet)
+{
+  return packet->id;
+}
 
-inline void rpacket_reset_tau_event (rpacket_t * packet);
+static inline void
+rpacket_set_id (rpacket_t * packet, int64_t id)
+{
+  packet->id = id;
+}
 
-tardis_error_t rpacket_init (rpacket_t * packet, storage_model_t * storage,
-           int packet_index, int virtual_packet_flag);
+/* New getter and setter methods for continuum implementation*/
 
-void initialize_random_kit (unsigned long seed);
+static inline void
+rpacket_set_d_continuum(rpacket_t * packet, double d_continuum)
+{
+  packet->d_cont = d_continuum;
+}
 
-/* New getter and setter methods for continuum implementation */
+static inline double
+rpacket_get_d_continuum(rpacket_t * packet)
+{
+  return packet->d_cont;
+}
 
-inline void rpacket_set_d_continuum (rpacket_t * packet, double d_continuum);
+static inline void
+rpacket_set_chi_electron(rpacket_t * packet, double chi_electron)
+{
+  packet->continuum.chi_th = chi_electron;
+}
 
-inline double rpacket_get_d_continuum (rpacket_t * packet);
+static inline double
+rpacket_get_chi_electron(rpacket_t * packet)
+{
+  return packet->continuum.chi_th;
+}
 
-inline void rpacket_set_chi_electron (rpacket_t * packet, double chi_electron);
+static inline double
+rpacket_get_chi_continuum(rpacket_t * packet)
+{
+  return packet->chi_cont;
+}
 
-inline double rpacket_get_chi_electron (rpacket_t * packet);
+static inline void
+rpacket_set_chi_continuum(rpacket_t * packet, double chi_continuum)
+{
+  packet->chi_cont = chi_continuum;
+}
 
-inline void rpacket_set_chi_continuum (rpacket_t * packet, double chi_continuum);
+static inline void
+rpacket_set_chi_freefree(rpacket_t * packet, double chi_freefree)
+{
+  packet->continuum.chi_ff = chi_freefree;
+}
 
-inline double rpacket_get_chi_continuum (rpacket_t * packet);
+static inline double
+rpacket_get_chi_freefree(rpacket_t * packet)
+{
+  return packet->continuum.chi_ff;
+}
 
-inline void rpacket_set_chi_freefree (rpacket_t * packet, double chi_freefree);
+static inline double
+rpacket_get_chi_boundfree(rpacket_t * packet)
+{
+  return packet->continuum.chi_bf;
+}
 
-inline double rpacket_get_chi_freefree (rpacket_t * packet);
+static inline void
+rpacket_set_chi_boundfree(rpacket_t * packet, double chi_boundfree)
+{
+  packet->continuum.chi_bf = chi_boundfree;
+}
 
-inline void rpacket_set_chi_boundfree (rpacket_t * packet, double chi_boundfree);
+static inline void
+rpacket_set_current_continuum_id (rpacket_t * packet, unsigned int current_continuum_id)
+{
+  packet->continuum.current_continuum_id = current_continuum_id;
+}
 
-inline double rpacket_get_chi_boundfree (rpacket_t * packet);
+static inline unsigned int
+rpacket_get_current_continuum_id (rpacket_t * packet)
+{
+  return packet->continuum.current_continuum_id;
+}
 
-inline unsigned int rpacket_get_current_continuum_id (rpacket_t * packet);
+static inline void
+rpacket_reset_tau_event (rpacket_t * packet, rng_state_t *rng_state)
+{
+  rpacket_set_tau_event (packet, -log (rng_double (rng_state)));
+}
 
-inline void rpacket_set_current_continuum_id (rpacket_t * packet, unsigned int current_continuum_id);
+tardis_error_t rpacket_init (rpacket_t * packet, storage_model_t * storage,
+           int64_t packet_index, int virtual_packet_flag);
 
 #endif // TARDIS_RPACKET_H
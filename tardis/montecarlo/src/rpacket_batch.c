@@ -0,0 +1,115 @@
+#include "rpacket_batch.h"
+
+/* All arrays are zeroed, so that every lane refers to a valid shell from the start. */
+void
+rpacket_batch_init (rpacket_batch_t * batch, int64_t size,
+		    rng_backend_t rng_backend)
+{
+  int64_t lane;
+  batch->size = size;
+  batch->nu = (double *) calloc (size, sizeof (double));
+  batch->mu = (double *) calloc (size, sizeof (double));
+  batch->energy = (double *) calloc (size, sizeof (double));
+  batch->r = (double *) calloc (size, sizeof (double));
+  batch->tau_event = (double *) calloc (size, sizeof (double));
+  batch->nu_line = (double *) calloc (size, sizeof (double));
+  batch->current_shell_id = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->next_line_id = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->last_line = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->close_line = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->recently_crossed_boundary = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->next_shell_id = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->d_line = (double *) calloc (size, sizeof (double));
+  batch->d_boundary = (double *) calloc (size, sizeof (double));
+  batch->d_cont = (double *) calloc (size, sizeof (double));
+  batch->chi_cont = (double *) calloc (size, sizeof (double));
+  batch->new_d_boundary = (double *) calloc (size, sizeof (double));
+  batch->new_next_shell_id = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->new_d_line = (double *) calloc (size, sizeof (double));
+  batch->active = (int64_t *) calloc (size, sizeof (int64_t));
+  batch->packets = (rpacket_t *) calloc (size, sizeof (rpacket_t));
+  batch->rng_states = (rng_state_t *) calloc (size, sizeof (rng_state_t));
+  for (lane = 0; lane < size; lane++)
+    {
+      rng_init (&batch->rng_states[lane], rng_backend);
+    }
+}
+
+void
+rpacket_batch_free (rpacket_batch_t * batch)
+{
+  int64_t lane;
+  for (lane = 0; lane < batch->size; lane++)
+    {
+      rng_free (&batch->rng_states[lane]);
+    }
+  free (batch->nu);
+  free (batch->mu);
+  free (batch->energy);
+  free (batch->r);
+  free (batch->tau_event);
+  free (batch->nu_line);
+  free (batch->current_shell_id);
+  free (batch->next_line_id);
+  free (batch->last_line);
+  free (batch->close_line);
+  free (batch->recently_crossed_boundary);
+  free (batch->next_shell_id);
+  free (batch->d_line);
+  free (batch->d_boundary);
+  free (batch->d_cont);
+  free (batch->chi_cont);
+  free (batch->new_d_boundary);
+  free (batch->new_next_shell_id);
+  free (batch->new_d_line);
+  free (batch->active);
+  free (batch->packets);
+  free (batch->rng_states);
+}
+
+rpacket_t *
+rpacket_batch_load (rpacket_batch_t * batch, int64_t lane)
+{
+  rpacket_t *packet = &batch->packets[lane];
+  rpacket_set_nu (packet, batch->nu[lane]);
+  rpacket_set_mu (packet, batch->mu[lane]);
+  rpacket_set_energy (packet, batch->energy[lane]);
+  rpacket_set_r (packet, batch->r[lane]);
+  rpacket_set_tau_event (packet, batch->tau_event[lane]);
+  rpacket_set_nu_line (packet, batch->nu_line[lane]);
+  rpacket_set_current_shell_id (packet, batch->current_shell_id[lane]);
+  rpacket_set_next_line_id (packet, batch->next_line_id[lane]);
+  rpacket_set_last_line (packet, batch->last_line[lane]);
+  rpacket_set_close_line (packet, batch->close_line[lane]);
+  rpacket_set_recently_crossed_boundary (packet, batch->recently_crossed_boundary[lane]);
+  rpacket_set_next_shell_id (packet, batch->next_shell_id[lane]);
+  rpacket_set_d_line (packet, batch->d_line[lane]);
+  rpacket_set_d_boundary (packet, batch->d_boundary[lane]);
+  rpacket_set_d_continuum (packet, batch->d_cont[lane]);
+  rpacket_set_chi_continuum (packet, batch->chi_cont[lane]);
+  return packet;
+}
+
+void
+rpacket_batch_store (rpacket_batch_t * batch, int64_t lane)
+{
+  rpacket_t *packet = &batch->packets[lane];
+  batch->nu[lane] = rpacket_get_nu (packet);
+  batch->mu[lane] = rpacket_get_mu (packet);
+  batch->energy[lane] = rpacket_get_energy (packet);
+  batch->r[lane] = rpacket_get_r (packet);
+  batch->tau_event[lane] = rpacket_get_tau_event (packet);
+  batch->nu_line[lane] = rpacket_get_nu_line (packet);
+  batch->current_shell_id[lane] = rpacket_get_current_shell_id (packet);
+  batch->next_line_id[lane] = rpacket_get_next_line_id (packet);
+  batch->last_line[lane] = rpacket_get_last_line (packet);
+  batch->close_line[lane] = rpacket_get_close_line (packet);
+  batch->recently_crossed_boundary[lane] = rpacket_get_recently_crossed_boundary (packet);
+  batch->next_shell_id[lane] = rpacket_get_next_shell_id (packet);
+  batch->d_line[lane] = rpacket_get_d_line (packet);
+  batch->d_boundary[lane] = rpacket_get_d_boundary (packet);
+  batch->d_cont[lane] = rpacket_get_d_continuum (packet);
+  batch->chi_cont[lane] = rpacket_get_chi_continuum (packet);
+  batch->active[lane] =
+    rpacket_get_status (packet) == TARDIS_PACKET_STATUS_IN_PROCESS;
+}
@@ -0,0 +1,75 @@
+#ifndef TARDIS_RPACKET_BATCH_H
+#define TARDIS_RPACKET_BATCH_H
+
+#include <stdint.h>
+#include "rng.h"
+#include "rpacket.h"
+
+/**
+ * @brief A batch of photon packets in structure-of-arrays layout.
+ *
+ * The fields needed to compute the distances to the next events are kept
+ * in one array per field, so that the distance computations can run as
+ * vectorized loops over all lanes. The remaining packet state lives in an
+ * rpacket_t per lane and is synchronized with the arrays whenever a lane
+ * is handed to the scalar event handlers.
+ */
+typedef struct RPacketBatch
+{
+  int64_t size; /**< Number of lanes in the batch. */
+  double *nu; /**< Frequency of the packet in Hz. */
+  double *mu; /**< Cosine of the angle of the packet. */
+  double *energy; /**< Energy of the packet in erg. */
+  double *r; /**< Distance from center in cm. */
+  double *tau_event; /**< Optical depth to the next interaction. */
+  double *nu_line; /**< Frequency of the next line. */
+  int64_t *current_shell_id; /**< ID of the current shell. */
+  int64_t *next_line_id; /**< The index of the next line that the packet will encounter. */
+  int64_t *last_line; /**< The packet has a nu red-ward of the last line. */
+  int64_t *close_line; /**< The packet sits on a line very close to the next one. */
+  int64_t *recently_crossed_boundary; /**< The packet sits on a shell boundary. */
+  int64_t *next_shell_id; /**< ID of the next shell packet visits. */
+  double *d_line; /**< Distance to line event. */
+  double *d_boundary; /**< Distance to shell boundary. */
+  double *d_cont; /**< Distance to continuum event. */
+  double *chi_cont; /**< Opacity due to continuum processes. */
+  double *new_d_boundary; /**< Scratch space for the distance kernels. */
+  int64_t *new_next_shell_id; /**< Scratch space for the distance kernels. */
+  double *new_d_line; /**< Scratch space for the distance kernels. */
+  int64_t *active; /**< The lane holds a packet that is still in process. */
+  rpacket_t *packets; /**< Remaining state of the packet in each lane. */
+  rng_state_t *rng_states; /**< Random number stream of the packet in each lane. */
+} rpacket_batch_t;
+
+/** Allocate the arrays of a packet batch. All lanes start inactive.
+ *
+ * @param batch packet batch to initialize
+ * @param size number of lanes
+ * @param rng_backend generator of the random number streams of the lanes
+ */
+void rpacket_batch_init (rpacket_batch_t * batch, int64_t size,
+			 rng_backend_t rng_backend);
+
+/** Free the arrays of a packet batch.
+ *
+ * @param batch packet batch
+ */
+void rpacket_batch_free (rpacket_batch_t * batch);
+
+/** Copy the packet in a lane of the batch into its rpacket_t.
+ *
+ * @param batch packet batch
+ * @param lane index of the lane
+ *
+ * @return the up to date packet of the lane
+ */
+rpacket_t * rpacket_batch_load (rpacket_batch_t * batch, int64_t lane);
+
+/** Copy the rpacket_t of a lane back into the batch arrays.
+ *
+ * @param batch packet batch
+ * @param lane index of the lane
+ */
+void rpacket_batch_store (rpacket_batch_t * batch, int64_t lane);
+
+#endif // TARDIS_RPACKET_BATCH_H
@@ -27,4 +27,18 @@ typedef enum
   CONTINUUM_ON = 1,
 } ContinuumProcessesStatus;
 
+typedef enum
+{
+  PACKET_SCHEDULE_STATIC = 0,
+  PACKET_SCHEDULE_DYNAMIC = 1,
+  PACKET_SCHEDULE_GUIDED = 2
+} packet_schedule_t;
+
+typedef enum
+{
+  PACKET_SOURCE_ARRAYS = 0,
+  PACKET_SOURCE_BLACKBODY = 1,
+  PACKET_SOURCE_SOBOL = 2
+} packet_source_t;
+
 #endif // TARDIS_STATUS_H
\ No newline at end of file
@@ -7,6 +7,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <math.h>
+#include "randomkit/randomkit.h"
+#include "rng.h"
+#include "instrumentation.h"
 
 #ifdef __clang__
 #define INLINE extern inline
@@ -14,6 +17,66 @@
 #define INLINE inline
 #endif
 
+#define VIRT_PACKET_CHUNK_SIZE 4096
+
+/**
+ * @brief A fixed size block of virtual packets that escaped the ejecta.
+ * Chunks are chained to an append-only list, so that storing a virtual
+ * packet never moves the ones stored before.
+ */
+typedef struct VirtualPacketChunk
+{
+  double nus[VIRT_PACKET_CHUNK_SIZE];
+  double energies[VIRT_PACKET_CHUNK_SIZE];
+  double last_interaction_in_nu[VIRT_PACKET_CHUNK_SIZE];
+  int64_t last_interaction_type[VIRT_PACKET_CHUNK_SIZE];
+  int64_t last_line_interaction_in_id[VIRT_PACKET_CHUNK_SIZE];
+  int64_t last_line_interaction_out_id[VIRT_PACKET_CHUNK_SIZE];
+  int64_t count;
+  struct VirtualPacketChunk *next;
+} virt_packet_chunk_t;
+
+/**
+ * @brief Buckets of a reverse sorted frequency list in log(nu).
+ * Bucket b covers log(nu) in [log_nu_min + b / inverse_bin_width,
+ * log_nu_min + (b + 1) / inverse_bin_width) and the frequencies in it
+ * have the indices [first_below[b + 1], first_below[b]).
+ */
+typedef struct FrequencyIndex
+{
+  int64_t *first_below; /**< Index of the first frequency below bucket b, no_of_bins + 1 entries. */
+  int64_t no_of_bins;
+  double log_nu_min;
+  double inverse_bin_width;
+} frequency_index_t;
+
+/**
+ * @brief Hash map with open addressing from j_blue estimator indices to
+ * their sums, so that only the entries that are hit take memory.
+ */
+typedef struct JBlueMap
+{
+  int64_t *indices; /**< Estimator index of every slot, -1 for empty slots. */
+  double *values;
+  int64_t capacity; /**< Number of slots, a power of two. */
+  int64_t count; /**< Number of occupied slots. */
+} j_blue_map_t;
+
+/**
+ * @brief One macro atom transition in one shell, together with the outcome
+ * of its alias. A macro atom jump only reads the record it draws.
+ */
+typedef struct MacroAtomTransition
+{
+  double alias_probability; /**< Probability of taking this transition instead of its alias. */
+  int32_t transition_type;
+  int32_t destination_level_id;
+  int32_t transition_line_id;
+  int32_t alias_transition_type;
+  int32_t alias_destination_level_id;
+  int32_t alias_transition_line_id;
+} macro_atom_transition_t;
+
 typedef struct StorageModel
 {
   double *packet_nus;
@@ -27,6 +90,16 @@ typedef struct StorageModel
   int64_t *last_line_interaction_shell_id;
   int64_t *last_interaction_type;
   int64_t no_of_packets;
+  int64_t packet_block_size; /**< Packets created and propagated at a time, 0 for all packets at once. */
+  int64_t packet_block_start; /**< Index of the packet in packet_nus[0], packet_mus[0] and packet_energies[0]. */
+  int64_t packet_tracking_stride; /**< Every stride-th packet has its output and last interactions recorded, 0 for none. */
+  packet_source_t packet_source; /**< Where the packet_nus, packet_mus and packet_energies come from. */
+  double packet_source_temperature; /**< Temperature of the inner boundary in K for PACKET_SOURCE_BLACKBODY. */
+  double packet_source_nu_start;
+  double packet_source_nu_end;
+  unsigned long packet_source_seed;
+  double *packet_source_cdf; /**< Tabulated black body of PACKET_SOURCE_SOBOL. */
+  rk_sobol_state packet_source_sobol; /**< Randomly shifted Sobol sequence of PACKET_SOURCE_SOBOL. */
   int64_t no_of_shells;
   double *r_inner;
   double *r_outer;
@@ -38,16 +111,23 @@ typedef struct StorageModel
   double *line_list_nu;
   double *continuum_list_nu;
   double *line_lists_tau_sobolevs;
+  float *line_lists_tau_sobolevs_compact; /**< Single precision copy of line_lists_tau_sobolevs, used instead of it if not NULL. */
   int64_t line_lists_tau_sobolevs_nd;
+  double *line_lists_tau_cumulative; /**< Sums of the tau_sobolevs of the lines before every line of a shell, line_lists_tau_sobolevs_nd + 1 per shell. Lines are skipped if not NULL. */
   double *line_lists_j_blues;
+  float *line_lists_j_blues_compact; /**< Single precision j_blue estimator, used instead of line_lists_j_blues if not NULL. Always accumulated in thread private blocks. */
   int64_t line_lists_j_blues_nd;
   int64_t no_of_lines;
+  int64_t *line_list_full_ids; /**< Index in the line list of the atomic data of every line of line_list_nu if optically thin lines were culled, NULL otherwise. */
+  double *line_list_full_nu; /**< Frequencies of the line list of the atomic data, used by the macro atom if lines were culled. */
+  int64_t *line_list_full_next; /**< Index in line_list_nu of the first line after every line of the atomic data if lines were culled. */
   int64_t no_of_edges;
   int64_t line_interaction_id;
   double *transition_probabilities;
   int64_t transition_probabilities_nd;
   int64_t *line2macro_level_upper;
   int64_t *macro_block_references;
+  macro_atom_transition_t *macro_atom_transitions;
   int64_t *transition_type;
   int64_t *destination_level_id;
   int64_t *transition_line_id;
@@ -59,6 +139,15 @@ typedef struct StorageModel
   double spectrum_virt_start_nu;
   double spectrum_virt_end_nu;
   double *spectrum_virt_nu;
+  int64_t spectrum_virt_nu_size;
+  double *spectrum_emitted_nu; /**< Energy of the emitted packets per spectrum bin, not binned if NULL. */
+  double *spectrum_reabsorbed_nu; /**< Energy of the reabsorbed packets per spectrum bin. */
+  int64_t spectrum_nu_size;
+  double luminosity_nu_start;
+  double luminosity_nu_end;
+  double luminosity_emitted_energy; /**< Energy of the emitted packets within (luminosity_nu_start, luminosity_nu_end). */
+  double luminosity_reabsorbed_energy; /**< Energy of the reabsorbed packets within (luminosity_nu_start, luminosity_nu_end). */
+  int64_t no_of_emitted_packets; /**< Number of packets that escaped through the outer boundary. */
   double sigma_thomson;
   double inverse_sigma_thomson;
   double inner_boundary_albedo;
@@ -69,6 +158,7 @@ typedef struct StorageModel
   double *l_pop;
   double *l_pop_r;
   ContinuumProcessesStatus cont_status;
+  int64_t kernel_variant; /**< Packet loop the settings are propagated with, set by montecarlo_main_loop. */
   double *virt_packet_nus;
   double *virt_packet_energies;
   double *virt_last_interaction_in_nu;
@@ -77,6 +167,25 @@ typedef struct StorageModel
   int64_t *virt_last_line_interaction_out_id;
   int64_t virt_packet_count;
   int64_t virt_array_size;
+  virt_packet_chunk_t *virt_packet_chunks;
+  virt_packet_chunk_t *virt_packet_chunks_tail;
+  int64_t thread_private_estimators;
+  double **line_lists_j_blues_blocks;
+  int64_t packet_batch_size;
+  rng_backend_t rng_backend; /**< Generator of the random number streams of the packets. */
+  packet_schedule_t packet_schedule;
+  int64_t packet_schedule_chunk_size; /**< Packets (or batches) per chunk, 0 for the OpenMP default. */
+  double *thread_busy_times; /**< Time every thread spent on its packets in s, not recorded if NULL. */
+  int64_t *thread_packet_counts; /**< Number of packets every thread propagated. */
+  instrumentation_counters_t counters; /**< Event counters of the thread owning this storage. */
+  instrumentation_counters_t *thread_counters; /**< Event counters of every thread, not recorded if NULL. */
+  int64_t sparse_j_blue_estimators;
+  j_blue_map_t *line_lists_j_blues_map; /**< Thread private sparse j_blue estimator. */
+  int64_t *line_lists_j_blues_sparse_indices; /**< Sorted indices of the non zero j_blue estimators. */
+  double *line_lists_j_blues_sparse_values;
+  int64_t line_lists_j_blues_sparse_count;
+  frequency_index_t line_list_nu_index;
+  frequency_index_t continuum_list_nu_index;
 } storage_model_t;
 
 #endif // TARDIS_STORAGE_H
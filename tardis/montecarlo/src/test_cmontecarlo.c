@@ -9,6 +9,7 @@
 
 rpacket_t * rp;
 storage_model_t * sm;
+rng_state_t rng_state;
 
 double TIME_EXPLOSION =  5.2e7; /* 10 days(in seconds)   ~      51840000.0 */
 double R_INNER_VALUE =  6.2e11; /* 12,000xTIME_EXPLOSION ~  622080000000.0 */
@@ -32,11 +33,29 @@ double test_calculate_chi_bf(void);
 bool test_montecarlo_bound_free_scatter(void);
 double test_bf_cross_section(void);
 int64_t test_montecarlo_free_free_scatter(void);
+bool test_rpacket_reset_tau_event_reproducible(void);
+bool test_thread_private_j_blue_estimator(void);
+int64_t test_montecarlo_store_virtual_packet(void);
+bool test_montecarlo_batch_compute_distances(void);
+bool test_distance_kernels(void);
+bool test_indexed_line_search(void);
+int64_t test_macro_atom_alias_sampling(void);
+bool test_compact_j_blue_estimator(void);
+bool test_sparse_j_blue_estimator(void);
+bool test_blackbody_packet_source(void);
+bool test_sobol_packet_source(void);
+bool test_xoshiro_rng(void);
+bool test_montecarlo_record_packet(void);
+bool test_instrumentation_counters(void);
+bool test_montecarlo_skip_lines(void);
+bool test_line_scatter_culled_lines(void);
+bool test_montecarlo_kernel_variant(void);
+bool test_montecarlo_main_loop_reproducible(void);
 
 /* initialise RPacket */
 void
 init_rpacket(void){
-	rp = (rpacket_t *) malloc(sizeof(rpacket_t));
+	rp = (rpacket_t *) calloc(1, sizeof(rpacket_t));
 	
 	double MU = 0.3;
 	double R = 7.5e14;
@@ -76,6 +95,7 @@ void
 init_storage_model(void){
 	sm = (storage_model_t *) malloc(sizeof(storage_model_t));
 	int NUMBER_OF_SHELLS = 2;
+	rng_init(&rng_state, RNG_BACKEND_MT);
 
 	sm->time_explosion = TIME_EXPLOSION;
 	sm->inverse_time_explosion = 1.0/TIME_EXPLOSION;
@@ -128,12 +148,48 @@ init_storage_model(void){
 	sm->last_line_interaction_shell_id[0] = 0;
 	sm->last_line_interaction_shell_id[1] = 0;
 
+	sm->last_line_interaction_out_id = (int64_t *) malloc(sizeof(int64_t)*NUMBER_OF_SHELLS);
+	sm->last_line_interaction_out_id[0] = 0;
+	sm->last_line_interaction_out_id[1] = 0;
+
+	sm->last_interaction_in_nu = (double *) malloc(sizeof(double)*1);
+	sm->last_interaction_in_nu[0] = 0;
+
 	sm->last_interaction_type = (int64_t *) malloc(sizeof(int64_t)*1);
 	sm->last_interaction_type[0] = 2;
 
 	sm->line_interaction_id = 0;
 
 	sm->line_lists_j_blues_nd = 0;
+	sm->thread_private_estimators = false;
+	sm->line_lists_j_blues_blocks = NULL;
+	sm->line_lists_j_blues_compact = NULL;
+	sm->line_lists_tau_sobolevs_compact = NULL;
+	sm->line_lists_tau_cumulative = NULL;
+	sm->line_list_full_ids = NULL;
+	sm->thread_counters = NULL;
+	sm->sparse_j_blue_estimators = false;
+	sm->packet_schedule = PACKET_SCHEDULE_STATIC;
+	sm->packet_schedule_chunk_size = 0;
+	sm->thread_busy_times = NULL;
+	sm->thread_packet_counts = NULL;
+	sm->line_lists_j_blues_map = NULL;
+	sm->packet_batch_size = 0;
+	sm->rng_backend = RNG_BACKEND_MT;
+	sm->packet_source = PACKET_SOURCE_ARRAYS;
+	sm->packet_block_size = 0;
+	sm->packet_block_start = 0;
+	sm->packet_tracking_stride = 1;
+	sm->spectrum_emitted_nu = NULL;
+	sm->packet_source_seed = 0;
+	sm->packet_source_cdf = NULL;
+	sm->line_list_nu_index.first_below = NULL;
+	sm->continuum_list_nu_index.first_below = NULL;
+	sm->macro_atom_transitions = NULL;
+
+	sm->virt_packet_count = 0;
+	sm->virt_packet_chunks = NULL;
+	sm->virt_packet_chunks_tail = NULL;
 
 	sm->line_lists_j_blues = (double *) malloc(sizeof(double )*2);
 	sm->line_lists_j_blues[0] = 1e-10;
@@ -148,6 +204,7 @@ init_storage_model(void){
 	sm->line2macro_level_upper[1] = 0;
 
 	sm->reflective_inner_boundary = false;
+	sm->kernel_variant = 0;
 	sm->inner_boundary_albedo = 0.0;
 	sm->no_of_shells = NUMBER_OF_SHELLS;
 
@@ -161,6 +218,7 @@ init_storage_model(void){
 
 	sm->spectrum_virt_nu = (double *) malloc(sizeof(double )*20000);
 	memset(sm->spectrum_virt_nu, 0, sizeof(double)*20000);
+	sm->spectrum_virt_nu_size = 20000;
 
 	/*
 	*  Initialising the below values to 0 untill
@@ -230,37 +288,37 @@ test_increment_j_blue_estimator(){
 bool
 test_montecarlo_line_scatter(){
 	double DISTANCE = 1e13;
-	montecarlo_line_scatter(rp, sm, DISTANCE);
+	montecarlo_line_scatter(rp, sm, DISTANCE, &rng_state);
 	return true;
 }
 
 bool
 test_montecarlo_thomson_scatter(){
 	double DISTANCE = 1e13;
-	montecarlo_thomson_scatter(rp, sm, DISTANCE);
+	montecarlo_thomson_scatter(rp, sm, DISTANCE, &rng_state);
 	return true;
 }
 
 bool
 test_move_packet_across_shell_boundary(){
 	double DISTANCE = 0.95e13;
-	return move_packet_across_shell_boundary(rp, sm, DISTANCE);
+	return move_packet_across_shell_boundary(rp, sm, DISTANCE, &rng_state);
 }
 
 
 int64_t
 test_montecarlo_one_packet(){
-	return montecarlo_one_packet(sm, rp, 1);
+	return montecarlo_one_packet(sm, rp, 1, &rng_state);
 }
 
 int64_t
 test_montecarlo_one_packet_loop(){
-	return montecarlo_one_packet_loop(sm, rp, 1);
+	return montecarlo_one_packet_loop(sm, rp, 1, &rng_state);
 }
 
 bool
 test_macro_atom(){
-	macro_atom(rp, sm);
+	macro_atom(rp, sm, &rng_state);
 	return true;	
 }
 
@@ -273,7 +331,7 @@ test_calculate_chi_bf(){
 bool
 test_montecarlo_bound_free_scatter(){
 	double DISTANCE = 1e13;
-	montecarlo_bound_free_scatter(rp, sm, DISTANCE);
+	montecarlo_bound_free_scatter(rp, sm, DISTANCE, &rng_state);
 	return rpacket_get_status(rp);
 }
 
@@ -286,6 +344,686 @@ test_bf_cross_section(){
 int64_t
 test_montecarlo_free_free_scatter(){
 	double DISTANCE = 1e13;
-	montecarlo_free_free_scatter(rp, sm, DISTANCE);
+	montecarlo_free_free_scatter(rp, sm, DISTANCE, &rng_state);
 	return rpacket_get_status(rp);
-}
\ No newline at end of file
+}
+
+bool
+test_rpacket_reset_tau_event_reproducible(){
+	rng_state_t first_state, second_state;
+	rpacket_t first_packet, second_packet;
+	bool result;
+	rng_init(&first_state, RNG_BACKEND_MT);
+	rng_init(&second_state, RNG_BACKEND_MT);
+	rng_seed(&first_state, 23111963 + 42);
+	rng_seed(&second_state, 23111963 + 42);
+	rpacket_reset_tau_event(&first_packet, &first_state);
+	rng_double(&rng_state);
+	rpacket_reset_tau_event(&second_packet, &second_state);
+	result = rpacket_get_tau_event(&first_packet) == rpacket_get_tau_event(&second_packet);
+	rng_free(&first_state);
+	rng_free(&second_state);
+	return result;
+}
+
+bool
+test_thread_private_j_blue_estimator(){
+	storage_model_t thread_storage;
+	double j_blue_shared, j_blue_private;
+	int64_t j_blue_idx = 1;
+	double d_line = rpacket_get_d_line(rp);
+	sm->line_lists_j_blues[j_blue_idx] = 0.0;
+	increment_j_blue_estimator(rp, sm, d_line, j_blue_idx);
+	j_blue_shared = sm->line_lists_j_blues[j_blue_idx];
+	sm->line_lists_j_blues[j_blue_idx] = 0.0;
+	sm->no_of_packets = 1;
+	sm->line_lists_j_blues_nd = 2;
+	sm->thread_private_estimators = true;
+	montecarlo_thread_storage_init(&thread_storage, sm);
+	sm->thread_private_estimators = false;
+	increment_j_blue_estimator(rp, &thread_storage, d_line, j_blue_idx);
+	montecarlo_reduce_j_blue_block(sm, &thread_storage, 1, 0);
+	montecarlo_reduce_thread_storages(sm, &thread_storage, 1);
+	sm->line_lists_j_blues_nd = 0;
+	j_blue_private = sm->line_lists_j_blues[j_blue_idx];
+	return j_blue_shared == j_blue_private;
+}
+
+int64_t
+test_montecarlo_store_virtual_packet(){
+	storage_model_t thread_storage;
+	int64_t i;
+	int64_t no_of_virtual_packets = VIRT_PACKET_CHUNK_SIZE + 10;
+	montecarlo_thread_storage_init(&thread_storage, sm);
+	for (i = 0; i < no_of_virtual_packets; i++)
+	{
+		rpacket_set_nu(rp, sm->spectrum_start_nu + i);
+		montecarlo_store_virtual_packet(&thread_storage, rp, rp, 1.0);
+	}
+	montecarlo_reduce_thread_storages(sm, &thread_storage, 1);
+	for (i = 0; i < no_of_virtual_packets; i++)
+	{
+		if (sm->virt_packet_nus[i] != sm->spectrum_start_nu + i)
+		{
+			return -1;
+		}
+	}
+	return sm->virt_packet_count;
+}
+
+bool
+test_montecarlo_batch_compute_distances(){
+	rpacket_batch_t batch;
+	rpacket_t packet;
+	double d_line;
+	bool result;
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	rpacket_set_nu(&packet, 1.3e16);
+	rpacket_set_mu(&packet, -0.3);
+	rpacket_set_recently_crossed_boundary(&packet, 0);
+	rpacket_set_last_line(&packet, false);
+	rpacket_set_close_line(&packet, false);
+	rpacket_set_virtual_packet(&packet, 0);
+	rpacket_set_status(&packet, TARDIS_PACKET_STATUS_IN_PROCESS);
+	rpacket_batch_init(&batch, 1, RNG_BACKEND_MT);
+	memcpy(&batch.packets[0], &packet, sizeof(rpacket_t));
+	rpacket_batch_store(&batch, 0);
+	montecarlo_batch_compute_distances(&batch, sm);
+	rpacket_set_nu_line(&packet, sm->line_list_nu[rpacket_get_next_line_id(&packet)]);
+	rpacket_set_d_boundary(&packet, compute_distance2boundary(&packet, sm));
+	compute_distance2line(&packet, sm, &d_line);
+	compute_distance2continuum(&packet, sm);
+	result = batch.d_boundary[0] == rpacket_get_d_boundary(&packet) &&
+		batch.next_shell_id[0] == rpacket_get_next_shell_id(&packet) &&
+		batch.d_line[0] == d_line &&
+		batch.d_cont[0] == rpacket_get_d_continuum(&packet);
+	rpacket_batch_free(&batch);
+	return result;
+}
+
+bool
+test_distance_kernels(){
+	int64_t i, isa;
+	int64_t n = 19;
+	double r[19], mu[19], nu[19], nu_line[19], doppler_factor[19], d_boundary[19], d_line[19];
+	int64_t shell_id[19], recently_crossed_boundary[19], last_line[19], next_shell_id[19];
+	bool result = true;
+	rpacket_t packet;
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	for (i = 0; i < n; i++)
+	{
+		shell_id[i] = i % 2;
+		r[i] = sm->r_inner[shell_id[i]] + (i + 1) * (sm->r_outer[shell_id[i]] - sm->r_inner[shell_id[i]]) / (n + 1);
+		mu[i] = -1.0 + 2.0 * i / (n - 1);
+		nu[i] = 1.3e16;
+		nu_line[i] = sm->line_list_nu[i % 5];
+		recently_crossed_boundary[i] = i % 3 - 1;
+		last_line[i] = i % 4 == 0;
+	}
+	for (isa = DISTANCE_KERNELS_SCALAR; isa <= DISTANCE_KERNELS_AVX512; isa++)
+	{
+		if (!distance_kernels_supported(isa))
+		{
+			continue;
+		}
+		distance_kernels_select(isa);
+		doppler_factor_lanes(n, r, mu, sm->inverse_time_explosion, doppler_factor);
+		distance2boundary_lanes(n, r, mu, shell_id, recently_crossed_boundary,
+					sm->r_inner, sm->r_outer, d_boundary, next_shell_id);
+		distance2line_lanes(n, r, mu, nu, nu_line, last_line, sm->time_explosion,
+				    sm->inverse_time_explosion, d_line);
+		for (i = 0; i < n; i++)
+		{
+			double d_line_scalar = MISS_DISTANCE;
+			rpacket_set_r(&packet, r[i]);
+			rpacket_set_mu(&packet, mu[i]);
+			rpacket_set_nu(&packet, nu[i]);
+			rpacket_set_nu_line(&packet, nu_line[i]);
+			rpacket_set_current_shell_id(&packet, shell_id[i]);
+			rpacket_set_recently_crossed_boundary(&packet, recently_crossed_boundary[i]);
+			rpacket_set_last_line(&packet, last_line[i]);
+			compute_distance2line(&packet, sm, &d_line_scalar);
+			result = result &&
+				doppler_factor[i] == rpacket_doppler_factor(&packet, sm) &&
+				d_boundary[i] == compute_distance2boundary(&packet, sm) &&
+				next_shell_id[i] == rpacket_get_next_shell_id(&packet) &&
+				d_line[i] == d_line_scalar;
+		}
+	}
+	distance_kernels_select(DISTANCE_KERNELS_SCALAR);
+	return result;
+}
+
+bool
+test_indexed_line_search(){
+	int64_t i, no_of_lines = 1000;
+	int64_t expected, result;
+	double nu_insert;
+	double *nu = (double *) malloc(sizeof(double) * no_of_lines);
+	frequency_index_t index;
+	bool success = true;
+	for (i = 0; i < no_of_lines; i++)
+	{
+		nu[i] = 1.0e16 * pow(0.99, i * i / 100.0);
+		if (i % 7 == 3)
+		{
+			nu[i] = nu[i - 1];
+		}
+	}
+	frequency_index_init(&index, nu, no_of_lines);
+	for (i = 0; i < 10000; i++)
+	{
+		nu_insert = nu[no_of_lines - 1] * (0.9 + i * 1.2e-3 * (nu[0] / nu[no_of_lines - 1] - 0.9));
+		line_search(nu, nu_insert, no_of_lines, &expected);
+		indexed_line_search(&index, nu, nu_insert, no_of_lines, &result);
+		success = success && result == expected;
+	}
+	frequency_index_free(&index);
+	free(nu);
+	return success;
+}
+
+int64_t
+test_macro_atom_alias_sampling(){
+	/* One level with an impossible and a certain emission in both shells. */
+	int64_t macro_block_references[] = {0, 2};
+	macro_atom_transition_t transitions[] = {
+		{0.0, 0, 0, 3, -1, 0, 5}, {1.0, -1, 0, 5, -1, 0, 5},
+		{0.0, 0, 0, 3, -1, 0, 5}, {1.0, -1, 0, 5, -1, 0, 5}};
+	int64_t i, line_id = -1;
+	int64_t next_line_id = rpacket_get_next_line_id(rp);
+	storage_model_t alias_storage;
+	memcpy(&alias_storage, sm, sizeof(storage_model_t));
+	alias_storage.transition_probabilities_nd = 2;
+	alias_storage.macro_block_references = macro_block_references;
+	alias_storage.macro_atom_transitions = transitions;
+	rpacket_set_next_line_id(rp, 1);
+	for (i = 0; i < 100; i++)
+	{
+		line_id = macro_atom(rp, &alias_storage, &rng_state);
+		if (line_id != 5)
+		{
+			break;
+		}
+	}
+	rpacket_set_next_line_id(rp, next_line_id);
+	return line_id;
+}
+
+bool
+test_compact_j_blue_estimator(){
+	/* Many small increments of a single precision thread private estimator. */
+	storage_model_t compact_storage, thread_storage;
+	rpacket_t packet;
+	float j_blues_compact[] = {0.0, 0.0};
+	double j_blues[] = {0.0, 0.0};
+	int64_t i, j_blue_idx = 1;
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	rpacket_set_r(&packet, 7.5e14);
+	rpacket_set_mu(&packet, 0.3);
+	rpacket_set_nu(&packet, 0.4);
+	rpacket_set_energy(&packet, 0.9);
+	memcpy(&compact_storage, sm, sizeof(storage_model_t));
+	compact_storage.line_lists_j_blues = j_blues;
+	compact_storage.line_lists_j_blues_nd = 2;
+	increment_j_blue_estimator(&packet, &compact_storage, 0.0, j_blue_idx);
+	compact_storage.line_lists_j_blues_compact = j_blues_compact;
+	compact_storage.thread_private_estimators = true;
+	montecarlo_thread_storage_init(&thread_storage, &compact_storage);
+	for (i = 0; i < 100000; i++)
+	{
+		increment_j_blue_estimator(&packet, &thread_storage, 0.0, j_blue_idx);
+	}
+	montecarlo_reduce_j_blue_block(&compact_storage, &thread_storage, 1, 0);
+	montecarlo_reduce_thread_storages(&compact_storage, &thread_storage, 1);
+	return fabs(j_blues_compact[j_blue_idx] - 100000 * j_blues[j_blue_idx]) <
+		1e-6 * 100000 * j_blues[j_blue_idx];
+}
+
+bool
+test_sparse_j_blue_estimator(){
+	/* Two threads hit more indices than fit into the initial capacity. */
+	storage_model_t thread_storages[2];
+	storage_model_t sparse_storage;
+	int64_t i, thread_id;
+	bool success = true;
+	memcpy(&sparse_storage, sm, sizeof(storage_model_t));
+	for (thread_id = 0; thread_id < 2; thread_id++)
+	{
+		memcpy(&thread_storages[thread_id], sm, sizeof(storage_model_t));
+		thread_storages[thread_id].line_lists_j_blues_map = (j_blue_map_t *) malloc(sizeof(j_blue_map_t));
+		j_blue_map_init(thread_storages[thread_id].line_lists_j_blues_map, 4);
+	}
+	for (i = 0; i < 3 * J_BLUE_MAP_INITIAL_CAPACITY; i++)
+	{
+		j_blue_map_add(thread_storages[i % 2].line_lists_j_blues_map, 7 * (i % 1000), 1.0);
+	}
+	montecarlo_merge_j_blue_maps(&sparse_storage, thread_storages, 2);
+	success = sparse_storage.line_lists_j_blues_sparse_count == 1000;
+	for (i = 0; success && i < 1000; i++)
+	{
+		success = sparse_storage.line_lists_j_blues_sparse_indices[i] == 7 * i &&
+			sparse_storage.line_lists_j_blues_sparse_values[i] ==
+			(i < 3 * J_BLUE_MAP_INITIAL_CAPACITY % 1000 ? 13.0 : 12.0);
+	}
+	free(sparse_storage.line_lists_j_blues_sparse_indices);
+	free(sparse_storage.line_lists_j_blues_sparse_values);
+	return success;
+}
+
+bool
+test_blackbody_packet_source(){
+	/* The mean of h nu / k T over a Planck spectrum is 24 zeta(5) / (pi^4 / 15). */
+	storage_model_t source_storage;
+	int64_t i, no_of_packets = 100000;
+	double temperature = 10000.0, mean_x = 0.0;
+	bool success = true;
+	memcpy(&source_storage, sm, sizeof(storage_model_t));
+	source_storage.no_of_packets = no_of_packets;
+	source_storage.packet_source = PACKET_SOURCE_BLACKBODY;
+	source_storage.packet_source_temperature = temperature;
+	source_storage.packet_source_nu_start = 0.0;
+	source_storage.packet_source_nu_end = 1e20;
+	source_storage.packet_source_seed = 23111963;
+	source_storage.packet_nus = (double *) malloc(sizeof(double) * no_of_packets);
+	source_storage.packet_mus = (double *) malloc(sizeof(double) * no_of_packets);
+	source_storage.packet_energies = (double *) malloc(sizeof(double) * no_of_packets);
+	packet_source_create_packets(&source_storage, 0, no_of_packets);
+	for (i = 0; i < no_of_packets; i++)
+	{
+		mean_x += source_storage.packet_nus[i] * H / (KB * temperature) / no_of_packets;
+		success = success && source_storage.packet_mus[i] >= 0.0 &&
+			source_storage.packet_mus[i] <= 1.0 &&
+			source_storage.packet_energies[i] == 1.0 / no_of_packets;
+	}
+	success = success && fabs(mean_x - 3.832229) < 0.02;
+	/* Packets outside of the frequency range are redrawn. */
+	source_storage.packet_source_nu_start = 1e14;
+	source_storage.packet_source_nu_end = 1e15;
+	packet_source_create_packets(&source_storage, 0, 1000);
+	for (i = 0; i < 1000; i++)
+	{
+		success = success && source_storage.packet_nus[i] >= 1e14 &&
+			source_storage.packet_nus[i] <= 1e15;
+	}
+	free(source_storage.packet_nus);
+	free(source_storage.packet_mus);
+	free(source_storage.packet_energies);
+	return success;
+}
+
+bool
+test_sobol_packet_source(){
+	/* Chunks give the same points as one pass and mu = sqrt(z) averages to 2/3. */
+	storage_model_t source_storage;
+	double *packet_nus, *packet_mus;
+	int64_t i, no_of_packets = 4096;
+	double mean_mu = 0.0;
+	bool success = true;
+	memcpy(&source_storage, sm, sizeof(storage_model_t));
+	source_storage.no_of_packets = no_of_packets;
+	source_storage.packet_source = PACKET_SOURCE_SOBOL;
+	source_storage.packet_source_temperature = 10000.0;
+	source_storage.packet_source_nu_start = 1e14;
+	source_storage.packet_source_nu_end = 1e16;
+	source_storage.packet_source_seed = 23111963;
+	packet_source_init(&source_storage);
+	packet_source_create_packets(&source_storage, 0, no_of_packets);
+	packet_nus = (double *) malloc(sizeof(double) * no_of_packets);
+	packet_mus = (double *) malloc(sizeof(double) * no_of_packets);
+	memcpy(packet_nus, source_storage.packet_nus, sizeof(double) * no_of_packets);
+	memcpy(packet_mus, source_storage.packet_mus, sizeof(double) * no_of_packets);
+	for (i = 0; i < no_of_packets; i += 7)
+	{
+		packet_source_create_packets(&source_storage, i, i + 7 < no_of_packets ? i + 7 : no_of_packets);
+	}
+	for (i = 0; i < no_of_packets; i++)
+	{
+		mean_mu += packet_mus[i] / no_of_packets;
+		success = success && source_storage.packet_nus[i] == packet_nus[i] &&
+			source_storage.packet_mus[i] == packet_mus[i] &&
+			packet_nus[i] >= 1e14 && packet_nus[i] <= 1e16;
+	}
+	success = success && fabs(mean_mu - 2.0 / 3.0) < 1e-4;
+	free(packet_nus);
+	free(packet_mus);
+	packet_source_free(&source_storage);
+	return success;
+}
+
+bool
+test_xoshiro_rng(){
+	/* Equal seeds give equal streams across buffer refills, neighbouring seeds do not. */
+	rng_state_t first_state, second_state, third_state;
+	int64_t i, n = 10 * RNG_BUFFER_SIZE + 3;
+	double x, mean = 0.0;
+	bool success = true;
+	rng_init(&first_state, RNG_BACKEND_XOSHIRO);
+	rng_init(&second_state, RNG_BACKEND_XOSHIRO);
+	rng_init(&third_state, RNG_BACKEND_XOSHIRO);
+	rng_seed(&first_state, 23111963);
+	rng_seed(&second_state, 23111963);
+	rng_seed(&third_state, 23111964);
+	for (i = 0; i < n; i++)
+	{
+		x = rng_double(&first_state);
+		success = success && x == rng_double(&second_state) &&
+			x != rng_double(&third_state) && x >= 0.0 && x < 1.0;
+	}
+	for (i = 0; i < 100000; i++)
+	{
+		mean += rng_double(&first_state) / 100000;
+	}
+	return success && fabs(mean - 0.5) < 0.005;
+}
+
+bool
+test_montecarlo_record_packet(){
+	/* Every third packet is tracked, all packets are binned. */
+	storage_model_t record_storage;
+	rpacket_t packet;
+	double output_nus[] = {0.0, 0.0, 0.0};
+	double output_energies[] = {0.0, 0.0, 0.0};
+	double spectra[] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+	memcpy(&record_storage, sm, sizeof(storage_model_t));
+	record_storage.output_nus = output_nus;
+	record_storage.output_energies = output_energies;
+	record_storage.packet_tracking_stride = 3;
+	record_storage.spectrum_emitted_nu = spectra;
+	record_storage.spectrum_reabsorbed_nu = spectra + 3;
+	record_storage.spectrum_nu_size = 3;
+	record_storage.spectrum_start_nu = 1.0;
+	record_storage.spectrum_end_nu = 4.0;
+	record_storage.spectrum_delta_nu = 1.0;
+	record_storage.luminosity_nu_start = 1.0;
+	record_storage.luminosity_nu_end = 3.0;
+	record_storage.luminosity_emitted_energy = 0.0;
+	record_storage.luminosity_reabsorbed_energy = 0.0;
+	record_storage.no_of_emitted_packets = 0;
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	rpacket_set_energy(&packet, 0.5);
+	rpacket_set_id(&packet, 6);
+	rpacket_set_nu(&packet, 2.5);
+	montecarlo_record_packet(&record_storage, &packet, true);
+	rpacket_set_id(&packet, 7);
+	rpacket_set_nu(&packet, 4.0);
+	montecarlo_record_packet(&record_storage, &packet, false);
+	return output_nus[2] == 2.5 && output_energies[2] == -0.5 &&
+		output_nus[1] == 0.0 && spectra[4] == 0.5 && spectra[2] == 0.5 &&
+		record_storage.luminosity_reabsorbed_energy == 0.5 &&
+		record_storage.luminosity_emitted_energy == 0.0 &&
+		record_storage.no_of_emitted_packets == 1;
+}
+
+bool
+test_instrumentation_counters(){
+	/* The counters are updated by hand, so that this also runs without instrumentation. */
+	instrumentation_counters_t counters;
+	montecarlo_event_handler_t handler;
+	double distance;
+	rpacket_t packet;
+	memset(&counters, 0, sizeof(instrumentation_counters_t));
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	rpacket_set_d_line(&packet, 1.0);
+	rpacket_set_d_boundary(&packet, 2.0);
+	rpacket_set_d_continuum(&packet, 3.0);
+	handler = montecarlo_select_event_handler(&packet, sm, &distance, &rng_state);
+	instrumentation_record_event(&counters, montecarlo_event_type(handler),
+		instrumentation_ticks());
+	instrumentation_record_event(&counters, montecarlo_event_type(handler),
+		instrumentation_ticks());
+	rpacket_set_d_line(&packet, 4.0);
+	handler = montecarlo_select_event_handler(&packet, sm, &distance, &rng_state);
+	instrumentation_record_event(&counters, montecarlo_event_type(handler),
+		instrumentation_ticks());
+	return counters.events[INSTRUMENTATION_LINE_SCATTER] == 2 &&
+		counters.events[INSTRUMENTATION_BOUNDARY_CROSSING] == 1 &&
+		counters.events[INSTRUMENTATION_THOMSON_SCATTER] == 0 &&
+		montecarlo_event_type(&montecarlo_bound_free_scatter) == INSTRUMENTATION_BOUND_FREE &&
+		montecarlo_event_type(&montecarlo_free_free_scatter) == INSTRUMENTATION_FREE_FREE;
+}
+
+bool
+test_montecarlo_skip_lines(){
+	/* The packet just passed line 0, lines 1 and 2 are weak, line 3 stops it. */
+	storage_model_t skip_storage;
+	rpacket_t packet;
+	double line_list_nu[5];
+	double tau_sobolevs[] = {0.0, 0.1, 0.2, 5.0, 0.1, 0.0, 0.1, 0.2, 5.0, 0.1};
+	double tau_cumulative[12];
+	double j_blues[10];
+	double comov_nu;
+	int64_t shell_id, line_id;
+	memcpy(&skip_storage, sm, sizeof(storage_model_t));
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	memset(j_blues, 0, sizeof(j_blues));
+	rpacket_set_current_shell_id(&packet, 0);
+	rpacket_set_r(&packet, 7.5e14);
+	rpacket_set_mu(&packet, 0.3);
+	rpacket_set_recently_crossed_boundary(&packet, 1);
+	rpacket_set_virtual_packet(&packet, 0);
+	rpacket_set_last_line(&packet, false);
+	rpacket_set_nu(&packet, 1e15);
+	rpacket_set_tau_event(&packet, 1.0);
+	rpacket_set_next_line_id(&packet, 1);
+	comov_nu = rpacket_get_nu(&packet) * rpacket_doppler_factor(&packet, &skip_storage);
+	line_list_nu[0] = comov_nu + 1e10;
+	for (line_id = 1; line_id < 5; line_id++)
+	{
+		line_list_nu[line_id] = comov_nu - line_id * 1e10;
+	}
+	for (shell_id = 0; shell_id < 2; shell_id++)
+	{
+		tau_cumulative[shell_id * 6] = 0.0;
+		for (line_id = 0; line_id < 5; line_id++)
+		{
+			tau_cumulative[shell_id * 6 + line_id + 1] =
+				tau_cumulative[shell_id * 6 + line_id] + tau_sobolevs[shell_id * 5 + line_id];
+		}
+	}
+	skip_storage.no_of_lines = 5;
+	skip_storage.line_list_nu = line_list_nu;
+	skip_storage.line_lists_tau_sobolevs = tau_sobolevs;
+	skip_storage.line_lists_tau_sobolevs_nd = 5;
+	skip_storage.line_lists_tau_cumulative = tau_cumulative;
+	skip_storage.line_lists_j_blues = j_blues;
+	skip_storage.line_lists_j_blues_nd = 5;
+	skip_storage.sigma_thomson = SIGMA_THOMSON;
+	skip_storage.inverse_sigma_thomson = 1.0 / SIGMA_THOMSON;
+	skip_storage.cont_status = CONTINUUM_OFF;
+	montecarlo_skip_lines(&packet, &skip_storage);
+	return rpacket_get_next_line_id(&packet) == 3 &&
+		fabs(rpacket_get_tau_event(&packet) - 0.7) < 1e-12 &&
+		j_blues[1] > 0.0 && j_blues[2] > 0.0 && j_blues[3] == 0.0 &&
+		!rpacket_get_last_line(&packet);
+}
+
+bool
+test_line_scatter_culled_lines(){
+	/* Lines 1 and 3 of the atomic data were culled, the packet scatters in line 2. */
+	storage_model_t culled_storage;
+	montecarlo_event_handler_t handler;
+	rpacket_t packet;
+	double distance;
+	double line_list_nu[] = {4e15, 2e15};
+	double line_list_full_nu[] = {4e15, 3e15, 2e15, 1e15};
+	int64_t line_list_full_ids[] = {0, 2};
+	int64_t line_list_full_next[] = {1, 1, 2, 2};
+	double tau_sobolevs[] = {0.0, 1000.0, 0.0, 1000.0};
+	double j_blues[4] = {0.0, 0.0, 0.0, 0.0};
+	memcpy(&culled_storage, sm, sizeof(storage_model_t));
+	memcpy(&packet, rp, sizeof(rpacket_t));
+	culled_storage.no_of_lines = 2;
+	culled_storage.line_list_nu = line_list_nu;
+	culled_storage.line_list_full_ids = line_list_full_ids;
+	culled_storage.line_list_full_nu = line_list_full_nu;
+	culled_storage.line_list_full_next = line_list_full_next;
+	culled_storage.line_lists_tau_sobolevs = tau_sobolevs;
+	culled_storage.line_lists_tau_sobolevs_nd = 2;
+	culled_storage.line_lists_j_blues = j_blues;
+	culled_storage.line_lists_j_blues_nd = 2;
+	culled_storage.line_interaction_id = 0;
+	rpacket_set_id(&packet, 0);
+	rpacket_set_current_shell_id(&packet, 0);
+	rpacket_set_r(&packet, 7.5e14);
+	rpacket_set_mu(&packet, 0.3);
+	rpacket_set_nu(&packet, 2.1e15);
+	rpacket_set_virtual_packet(&packet, 0);
+	rpacket_set_virtual_packet_flag(&packet, 0);
+	rpacket_set_last_line(&packet, false);
+	rpacket_set_next_line_id(&packet, 1);
+	rpacket_set_tau_event(&packet, 1e-3);
+	rpacket_set_chi_continuum(&packet, 0.0);
+	rpacket_set_d_line(&packet, 0.0);
+	rpacket_set_d_boundary(&packet, 1.0);
+	rpacket_set_d_continuum(&packet, 2.0);
+	handler = montecarlo_select_event_handler(&packet, &culled_storage, &distance, &rng_state);
+	handler(&packet, &culled_storage, distance, &rng_state);
+	return culled_storage.last_line_interaction_in_id[0] == 2 &&
+		culled_storage.last_line_interaction_out_id[0] == 2 &&
+		rpacket_get_nu_line(&packet) == 2e15 &&
+		rpacket_get_next_line_id(&packet) == 2 &&
+		rpacket_get_last_line(&packet);
+}
+
+bool
+test_montecarlo_kernel_variant(){
+	storage_model_t variant_storage;
+	int64_t scatter, macro_atom;
+	memcpy(&variant_storage, sm, sizeof(storage_model_t));
+	variant_storage.line_interaction_id = 0;
+	variant_storage.cont_status = CONTINUUM_OFF;
+	variant_storage.reflective_inner_boundary = false;
+	scatter = montecarlo_kernel_variant(&variant_storage);
+	variant_storage.line_interaction_id = 2;
+	variant_storage.reflective_inner_boundary = true;
+	macro_atom = montecarlo_kernel_variant(&variant_storage);
+	return scatter == 0 &&
+		macro_atom == (KERNEL_VARIANT_MACRO_ATOM | KERNEL_VARIANT_REFLECTIVE_INNER_BOUNDARY) &&
+		macro_atom < KERNEL_NO_OF_VARIANTS;
+}
+
+/* A model of a few shells and lines that montecarlo_main_loop can run. */
+void
+init_main_loop_storage(storage_model_t *storage, rng_backend_t backend,
+		int64_t no_of_packets){
+	int64_t i, no_of_shells = 5, no_of_lines = 200;
+	memset(storage, 0, sizeof(storage_model_t));
+	storage->no_of_packets = no_of_packets;
+	storage->no_of_shells = no_of_shells;
+	storage->no_of_lines = no_of_lines;
+	storage->time_explosion = TIME_EXPLOSION;
+	storage->inverse_time_explosion = 1.0 / TIME_EXPLOSION;
+	storage->sigma_thomson = SIGMA_THOMSON;
+	storage->inverse_sigma_thomson = 1.0 / SIGMA_THOMSON;
+	storage->r_inner = (double *) malloc(sizeof(double) * no_of_shells);
+	storage->r_outer = (double *) malloc(sizeof(double) * no_of_shells);
+	storage->electron_densities = (double *) malloc(sizeof(double) * no_of_shells);
+	storage->inverse_electron_densities = (double *) malloc(sizeof(double) * no_of_shells);
+	storage->js = (double *) calloc(no_of_shells, sizeof(double));
+	storage->nubars = (double *) calloc(no_of_shells, sizeof(double));
+	for (i = 0; i < no_of_shells; i++)
+	{
+		storage->r_inner[i] = (1.1e9 + 2e8 * i) * TIME_EXPLOSION;
+		storage->r_outer[i] = (1.3e9 + 2e8 * i) * TIME_EXPLOSION;
+		storage->electron_densities[i] = 1e9 / (i + 1);
+		storage->inverse_electron_densities[i] = 1.0 / storage->electron_densities[i];
+	}
+	storage->line_list_nu = (double *) malloc(sizeof(double) * no_of_lines);
+	storage->line_lists_tau_sobolevs = (double *) malloc(sizeof(double) * no_of_shells * no_of_lines);
+	storage->line_lists_j_blues = (double *) calloc(no_of_shells * no_of_lines, sizeof(double));
+	storage->line_lists_tau_sobolevs_nd = no_of_lines;
+	storage->line_lists_j_blues_nd = no_of_lines;
+	for (i = 0; i < no_of_lines; i++)
+	{
+		storage->line_list_nu[i] = 3e15 * pow(0.1, (double) i / no_of_lines);
+	}
+	for (i = 0; i < no_of_shells * no_of_lines; i++)
+	{
+		storage->line_lists_tau_sobolevs[i] = (i % 3) * 0.5;
+	}
+	storage->spectrum_start_nu = 1e14;
+	storage->spectrum_end_nu = 6e15;
+	storage->spectrum_delta_nu = (6e15 - 1e14) / 1000;
+	storage->spectrum_virt_nu = (double *) calloc(1000, sizeof(double));
+	storage->spectrum_virt_nu_size = 1000;
+	storage->rng_backend = backend;
+	storage->packet_tracking_stride = 1;
+	storage->packet_nus = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->packet_mus = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->packet_energies = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->output_nus = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->output_energies = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->last_interaction_in_nu = (double *) malloc(sizeof(double) * no_of_packets);
+	storage->last_interaction_type = (int64_t *) malloc(sizeof(int64_t) * no_of_packets);
+	storage->last_line_interaction_in_id = (int64_t *) malloc(sizeof(int64_t) * no_of_packets);
+	storage->last_line_interaction_out_id = (int64_t *) malloc(sizeof(int64_t) * no_of_packets);
+	storage->last_line_interaction_shell_id = (int64_t *) malloc(sizeof(int64_t) * no_of_packets);
+	for (i = 0; i < no_of_packets; i++)
+	{
+		storage->packet_nus[i] = 2e14 + 2.8e15 * (i % 97) / 97.0;
+		storage->packet_mus[i] = (i % 89 + 0.5) / 89.0;
+		storage->packet_energies[i] = 1.0 / no_of_packets;
+		storage->last_line_interaction_in_id[i] = -1;
+		storage->last_line_interaction_out_id[i] = -1;
+		storage->last_line_interaction_shell_id[i] = -1;
+		storage->last_interaction_type[i] = -1;
+		storage->last_interaction_in_nu[i] = 0.0;
+	}
+}
+
+void
+free_main_loop_storage(storage_model_t *storage){
+	free(storage->r_inner);
+	free(storage->r_outer);
+	free(storage->electron_densities);
+	free(storage->inverse_electron_densities);
+	free(storage->js);
+	free(storage->nubars);
+	free(storage->line_list_nu);
+	free(storage->line_lists_tau_sobolevs);
+	free(storage->line_lists_j_blues);
+	free(storage->spectrum_virt_nu);
+	free(storage->packet_nus);
+	free(storage->packet_mus);
+	free(storage->packet_energies);
+	free(storage->output_nus);
+	free(storage->output_energies);
+	free(storage->last_interaction_in_nu);
+	free(storage->last_interaction_type);
+	free(storage->last_line_interaction_in_id);
+	free(storage->last_line_interaction_out_id);
+	free(storage->last_line_interaction_shell_id);
+}
+
+bool
+test_montecarlo_main_loop_reproducible(){
+	/* Every packet ends the same with one thread as with several. */
+	storage_model_t single_storage, threaded_storage;
+	rng_backend_t backends[] = {RNG_BACKEND_MT, RNG_BACKEND_XOSHIRO};
+	int64_t i, j, no_of_packets = 2000;
+	bool success = true;
+	for (j = 0; j < 2; j++)
+	{
+		init_main_loop_storage(&single_storage, backends[j], no_of_packets);
+		init_main_loop_storage(&threaded_storage, backends[j], no_of_packets);
+		montecarlo_main_loop(&single_storage, 0, 1, 23111963);
+		montecarlo_main_loop(&threaded_storage, 0, 4, 23111963);
+		for (i = 0; i < no_of_packets; i++)
+		{
+			success = success &&
+				single_storage.output_nus[i] == threaded_storage.output_nus[i] &&
+				single_storage.output_energies[i] == threaded_storage.output_energies[i] &&
+				single_storage.last_line_interaction_out_id[i] ==
+				threaded_storage.last_line_interaction_out_id[i];
+		}
+		for (i = 0; i < single_storage.no_of_shells; i++)
+		{
+			success = success && single_storage.js[i] > 0.0 &&
+				fabs(single_storage.js[i] - threaded_storage.js[i]) < 1e-10 * single_storage.js[i];
+		}
+		free_main_loop_storage(&single_storage);
+		free_main_loop_storage(&threaded_storage);
+	}
+	return success;
+}
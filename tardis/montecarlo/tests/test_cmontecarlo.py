@@ -1,6 +1,6 @@
 import os
 import random
-from ctypes import CDLL, c_double
+from ctypes import CDLL, c_double, c_bool
 
 import pytest
 import numpy as np
@@ -73,6 +73,7 @@ def test_calculate_chi_bf():
 		chi_bf)
 
 def test_montecarlo_bound_free_scatter():
+	tests.test_montecarlo_bound_free_scatter.restype = c_bool
 	assert tests.test_montecarlo_bound_free_scatter() == 1
 
 @pytest.mark.xfail
@@ -83,4 +84,74 @@ def test_bf_cross_section():
 		bf_cross_section)
 
 def test_montecarlo_free_free_scatter():
-	assert tests.test_montecarlo_free_free_scatter() == 2
\ No newline at end of file
+	assert tests.test_montecarlo_free_free_scatter() == 2
+
+def test_rpacket_reset_tau_event_reproducible():
+	tests.test_rpacket_reset_tau_event_reproducible.restype = c_bool
+	assert tests.test_rpacket_reset_tau_event_reproducible()
+
+def test_thread_private_j_blue_estimator():
+	tests.test_thread_private_j_blue_estimator.restype = c_bool
+	assert tests.test_thread_private_j_blue_estimator()
+
+def test_montecarlo_store_virtual_packet():
+	assert tests.test_montecarlo_store_virtual_packet() == 4106
+
+def test_montecarlo_batch_compute_distances():
+	tests.test_montecarlo_batch_compute_distances.restype = c_bool
+	assert tests.test_montecarlo_batch_compute_distances()
+
+def test_distance_kernels():
+	tests.test_distance_kernels.restype = c_bool
+	assert tests.test_distance_kernels()
+
+def test_indexed_line_search():
+	tests.test_indexed_line_search.restype = c_bool
+	assert tests.test_indexed_line_search()
+
+def test_macro_atom_alias_sampling():
+	assert tests.test_macro_atom_alias_sampling() == 5
+
+def test_compact_j_blue_estimator():
+	tests.test_compact_j_blue_estimator.restype = c_bool
+	assert tests.test_compact_j_blue_estimator()
+
+def test_sparse_j_blue_estimator():
+	tests.test_sparse_j_blue_estimator.restype = c_bool
+	assert tests.test_sparse_j_blue_estimator()
+
+def test_blackbody_packet_source():
+	tests.test_blackbody_packet_source.restype = c_bool
+	assert tests.test_blackbody_packet_source()
+
+def test_sobol_packet_source():
+	tests.test_sobol_packet_source.restype = c_bool
+	assert tests.test_sobol_packet_source()
+
+def test_xoshiro_rng():
+	tests.test_xoshiro_rng.restype = c_bool
+	assert tests.test_xoshiro_rng()
+
+def test_montecarlo_record_packet():
+	tests.test_montecarlo_record_packet.restype = c_bool
+	assert tests.test_montecarlo_record_packet()
+
+def test_instrumentation_counters():
+	tests.test_instrumentation_counters.restype = c_bool
+	assert tests.test_instrumentation_counters()
+
+def test_montecarlo_skip_lines():
+	tests.test_montecarlo_skip_lines.restype = c_bool
+	assert tests.test_montecarlo_skip_lines()
+
+def test_line_scatter_culled_lines():
+	tests.test_line_scatter_culled_lines.restype = c_bool
+	assert tests.test_line_scatter_culled_lines()
+
+def test_montecarlo_kernel_variant():
+	tests.test_montecarlo_kernel_variant.restype = c_bool
+	assert tests.test_montecarlo_kernel_variant()
+
+def test_montecarlo_main_loop_reproducible():
+	tests.test_montecarlo_main_loop_reproducible.restype = c_bool
+	assert tests.test_montecarlo_main_loop_reproducible()
@@ -4,7 +4,8 @@ from tardis.plasma.properties import (BetaRadiation, LevelBoltzmannFactorLTE,
     IonizationData, NumberDensity, IonNumberDensity, LinesLowerLevelIndex,
     LinesUpperLevelIndex, TauSobolev, TRadiative, AtomicData, Abundance,
     Density, TimeExplosion, BetaSobolev, JBlues,
-    TransitionProbabilities, StimulatedEmissionFactor, SelectedAtoms,
+    TransitionProbabilities, TransitionAliasTables, StimulatedEmissionFactor,
+    SelectedAtoms,
     PhiSahaNebular, LevelBoltzmannFactorDiluteLTE, DilutionFactor,
     ZetaData, ElectronTemperature, LinkTRadTElectron, BetaElectron,
     RadiationFieldCorrection, RadiationFieldCorrectionInput,
@@ -27,7 +28,7 @@ basic_properties = PlasmaPropertyCollection([BetaRadiation,
 lte_ionization_properties = PlasmaPropertyCollection([PhiSahaLTE])
 lte_excitation_properties = PlasmaPropertyCollection([LevelBoltzmannFactorLTE])
 macro_atom_properties = PlasmaPropertyCollection([BetaSobolev,
-    TransitionProbabilities])
+    TransitionProbabilities, TransitionAliasTables])
 nebular_ionization_properties = PlasmaPropertyCollection([PhiSahaNebular,
     ZetaData, BetaElectron, RadiationFieldCorrection, Chi0])
 dilute_lte_excitation_properties = PlasmaPropertyCollection([
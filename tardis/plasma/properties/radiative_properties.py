@@ -10,7 +10,7 @@ from tardis import macro_atom
 logger = logging.getLogger(__name__)
 
 __all__ = ['StimulatedEmissionFactor', 'TauSobolev', 'BetaSobolev',
-    'TransitionProbabilities', 'LTEJBlues']
+    'TransitionProbabilities', 'TransitionAliasTables', 'LTEJBlues']
 
 class StimulatedEmissionFactor(ProcessingPlasmaProperty):
     """
@@ -153,6 +153,26 @@ class TransitionProbabilities(ProcessingPlasmaProperty):
                 columns=tau_sobolevs.columns)
         return transition_probabilities
 
+class TransitionAliasTables(ProcessingPlasmaProperty):
+    """
+    Outputs:
+        transition_alias_probabilities : Numpy Array [len(macro_atom_data), len(t_rad)]
+        transition_alias_indices : Numpy Array [len(macro_atom_data), len(t_rad)]
+            Alias tables of the transition probabilities of every macro
+            atom level, which let the Monte Carlo kernel draw a transition
+            in constant time.
+    """
+    outputs = ('transition_alias_probabilities', 'transition_alias_indices')
+
+    def calculate(self, atomic_data, transition_probabilities):
+        if transition_probabilities is None:
+            return None, None
+        block_references = np.hstack((
+            atomic_data.macro_atom_references.block_references,
+            len(transition_probabilities)))
+        return macro_atom.build_alias_tables(
+            transition_probabilities.values, block_references)
+
 class LTEJBlues(ProcessingPlasmaProperty):
     outputs = ('lte_j_blues',)
     latex_name = ('J^{b}_{lu(LTE)}')
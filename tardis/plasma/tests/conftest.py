@@ -261,4 +261,10 @@ def transition_probabilities(atomic_data, beta_sobolev, j_blues,
     return transition_probabilities_module.calculate(atomic_data, beta_sobolev,
                                                      j_blues,
                                                      stimulated_emission_factor,
-                                                     tau_sobolev)
\ No newline at end of file
+                                                     tau_sobolev)
+
+@pytest.fixture
+def transition_alias_tables(atomic_data, transition_probabilities):
+    transition_alias_tables_module = TransitionAliasTables(None)
+    return transition_alias_tables_module.calculate(atomic_data,
+                                                    transition_probabilities)
@@ -10,4 +10,19 @@ def test_tau_sobolev(tau_sobolev):
 
 def test_beta_sobolev(beta_sobolev):
     assert beta_sobolev.shape == (253,20)
-    assert np.allclose(beta_sobolev[10][10], 1.671404577575537e-07)
\ No newline at end of file
+    assert np.allclose(beta_sobolev[10][10], 1.671404577575537e-07)
+
+def test_transition_alias_tables(atomic_data, transition_probabilities,
+                                 transition_alias_tables):
+    alias_probabilities, alias_indices = transition_alias_tables
+    p = transition_probabilities.values
+    block_references = np.hstack((
+        atomic_data.macro_atom_references.block_references, len(p)))
+    # Every transition gets its own share plus the shares aliased to it.
+    drawn = alias_probabilities.copy()
+    for start, end in zip(block_references[:-1], block_references[1:]):
+        for j in range(start, end):
+            for k in range(p.shape[1]):
+                drawn[alias_indices[j, k], k] += 1 - alias_probabilities[j, k]
+        drawn[start:end] /= end - start
+    assert np.allclose(drawn, p)
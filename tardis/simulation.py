@@ -21,16 +21,24 @@ def run_radial1d(radial1d_model, history_fname=None):
     initialize_j_blues = True
     initialize_nlte = True
     update_radiation_field = False
+    transport_inputs = radial1d_model.transport_input_hdf5_properties
+    def write_transport_inputs():
+        # The inputs of the transport are written while it runs.
+        radial1d_model.to_hdf5(history_buffer, path='model%03d' % (radial1d_model.iterations_executed + 1),
+                               close_h5=False, properties=transport_inputs)
+
     while radial1d_model.iterations_remaining > 1:
         logger.info('Remaining run %d', radial1d_model.iterations_remaining)
         radial1d_model.simulate(update_radiation_field=update_radiation_field, enable_virtual=False, initialize_nlte=initialize_nlte,
-                                initialize_j_blues=initialize_j_blues)
+                                initialize_j_blues=initialize_j_blues,
+                                while_running=write_transport_inputs if history_fname else None)
         initialize_j_blues=False
         initialize_nlte=False
         update_radiation_field = True
 
         if history_fname:
-            radial1d_model.to_hdf5(history_buffer, path='model%03d' % radial1d_model.iterations_executed, close_h5=False)
+            radial1d_model.to_hdf5(history_buffer, path='model%03d' % radial1d_model.iterations_executed, close_h5=False,
+                                   exclude_properties=transport_inputs)
 
     #Finished second to last loop running one more time
     logger.info('Doing last run')
@@ -38,10 +46,12 @@ def run_radial1d(radial1d_model, history_fname=None):
         radial1d_model.current_no_of_packets = radial1d_model.tardis_config.montecarlo.last_no_of_packets
 
     radial1d_model.simulate(enable_virtual=True, update_radiation_field=update_radiation_field, initialize_nlte=initialize_nlte,
-                            initialize_j_blues=initialize_j_blues)
+                            initialize_j_blues=initialize_j_blues,
+                            while_running=write_transport_inputs if history_fname else None)
 
     if history_fname:
-        radial1d_model.to_hdf5(history_buffer, path='model%03d' % radial1d_model.iterations_executed)
+        radial1d_model.to_hdf5(history_buffer, path='model%03d' % radial1d_model.iterations_executed,
+                               exclude_properties=transport_inputs)
 
 
 